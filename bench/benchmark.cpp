@@ -0,0 +1,875 @@
+//
+// DESCRIPTION:
+// Non-interactive benchmark suite. Compares sfl::pool_allocator against
+// std::allocator on node-based containers, with different free orders and
+// with multi-threaded producer/consumer workload.
+//
+// Every case runs in a separate child process (on Linux and Unix), so that
+// peak RSS is measured per case and every case starts with a fresh pool.
+//
+// Reports operations per second, p50/p99 latency of sampled operations and
+// peak RSS. Writes results as text table to standard output and as JSON or
+// CSV to the file given by --output.
+//
+// USAGE:
+// benchmark [--filter SUBSTRING] [--scale FACTOR] [--threads N]
+//           [--format json|csv] [--output FILE] [--no-fork]
+//
+// BUILD:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp benchmark.cpp -o benchmark -DNDEBUG
+//
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__) || defined(__unix__)
+extern "C"
+{
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+#define BENCHMARK_FORK
+#endif
+
+#include "pool_allocator.hpp"
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+const unsigned SEED = 42;
+
+/// On average every SAMPLE_PERIOD-th operation is timed individually.
+/// Operations are sampled at random to avoid aliasing with periodic events
+/// such as refills of thread caches. Must be power of two.
+const std::uint32_t SAMPLE_PERIOD = 16;
+
+enum class free_order
+{
+    none,
+    lifo,
+    fifo,
+    random
+};
+
+const char* to_string(free_order order)
+{
+    switch (order)
+    {
+    case free_order::lifo:
+        return "lifo";
+    case free_order::fifo:
+        return "fifo";
+    case free_order::random:
+        return "random";
+    default:
+        return "-";
+    }
+}
+
+struct result
+{
+    std::string name;
+    std::string allocator;
+    std::string order;
+    unsigned threads;
+    std::size_t ops;
+    double seconds;
+    double ops_per_sec;
+    double p50_ns;
+    double p99_ns;
+    long peak_rss_kib;
+};
+
+/// Records latency of sampled operations.
+///
+class recorder
+{
+private:
+
+    std::size_t ops_;
+    std::uint32_t state_;
+    std::vector<std::uint32_t> samples_;
+
+    bool sample() noexcept
+    {
+        // xorshift32
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return (state_ & (SAMPLE_PERIOD - 1)) == 0;
+    }
+
+public:
+
+    recorder()
+        : ops_(0)
+        , state_(SEED)
+    {}
+
+    template <typename Op>
+    void run(Op op)
+    {
+        ++ops_;
+
+        if (sample())
+        {
+            const auto t1 = clock_type::now();
+            op();
+            const auto t2 = clock_type::now();
+            samples_.push_back
+            (
+                std::uint32_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count())
+            );
+        }
+        else
+        {
+            op();
+        }
+    }
+
+    /// Records one sample for a batch of `n` operations.
+    ///
+    void add_batch(std::size_t n, clock_type::duration d)
+    {
+        ops_ += n;
+        samples_.push_back
+        (
+            std::uint32_t(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / n)
+        );
+    }
+
+    void merge(const recorder& other)
+    {
+        ops_ += other.ops_;
+        samples_.insert(samples_.end(), other.samples_.begin(), other.samples_.end());
+    }
+
+    std::size_t ops() const
+    {
+        return ops_;
+    }
+
+    double percentile(double p)
+    {
+        if (samples_.empty())
+        {
+            return 0;
+        }
+        const std::size_t k = std::size_t(p * (samples_.size() - 1));
+        std::nth_element(samples_.begin(), samples_.begin() + k, samples_.end());
+        return samples_[k];
+    }
+};
+
+template <typename Iterators>
+void order_iterators(Iterators& its, free_order order, std::mt19937& gen)
+{
+    switch (order)
+    {
+    case free_order::lifo:
+        std::reverse(its.begin(), its.end());
+        break;
+    case free_order::random:
+        std::shuffle(its.begin(), its.end(), gen);
+        break;
+    default:
+        break;
+    }
+}
+
+//
+// ---- WORKLOADS --------------------------------------------------------------
+//
+
+template <template <typename> class Alloc>
+void list_workload(recorder& rec, std::size_t n, free_order order)
+{
+    using list_type = std::list<std::size_t, Alloc<std::size_t>>;
+
+    std::mt19937 gen(SEED);
+
+    list_type l;
+
+    std::vector<typename list_type::iterator> its;
+    its.reserve(n);
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        rec.run([&]() { l.push_back(i); });
+        its.push_back(std::prev(l.end()));
+    }
+
+    order_iterators(its, order, gen);
+
+    for (auto it : its)
+    {
+        rec.run([&]() { l.erase(it); });
+    }
+}
+
+template <template <typename> class Alloc>
+void map_workload(recorder& rec, std::size_t n, free_order order)
+{
+    using value_type = std::pair<const std::size_t, std::size_t>;
+    using map_type = std::map<std::size_t, std::size_t, std::less<std::size_t>, Alloc<value_type>>;
+
+    std::mt19937 gen(SEED);
+
+    map_type m;
+
+    std::vector<typename map_type::iterator> its;
+    its.reserve(n);
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        const std::size_t key = gen();
+        rec.run
+        (
+            [&]()
+            {
+                auto res = m.emplace(key, i);
+                if (res.second)
+                {
+                    its.push_back(res.first);
+                }
+            }
+        );
+    }
+
+    order_iterators(its, order, gen);
+
+    for (auto it : its)
+    {
+        rec.run([&]() { m.erase(it); });
+    }
+}
+
+template <template <typename> class Alloc>
+void set_workload(recorder& rec, std::size_t n, free_order order)
+{
+    using set_type = std::set<std::size_t, std::less<std::size_t>, Alloc<std::size_t>>;
+
+    std::mt19937 gen(SEED);
+
+    set_type s;
+
+    std::vector<typename set_type::iterator> its;
+    its.reserve(n);
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        const std::size_t key = gen();
+        rec.run
+        (
+            [&]()
+            {
+                auto res = s.insert(key);
+                if (res.second)
+                {
+                    its.push_back(res.first);
+                }
+            }
+        );
+    }
+
+    order_iterators(its, order, gen);
+
+    for (auto it : its)
+    {
+        rec.run([&]() { s.erase(it); });
+    }
+}
+
+template <template <typename> class Alloc>
+void unordered_map_workload(recorder& rec, std::size_t n, free_order order)
+{
+    using value_type = std::pair<const std::size_t, std::size_t>;
+    using map_type = std::unordered_map
+    <
+        std::size_t,
+        std::size_t,
+        std::hash<std::size_t>,
+        std::equal_to<std::size_t>,
+        Alloc<value_type>
+    >;
+
+    std::mt19937 gen(SEED);
+
+    map_type m;
+
+    std::vector<std::size_t> keys;
+    keys.reserve(n);
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        const std::size_t key = gen();
+        rec.run
+        (
+            [&]()
+            {
+                if (m.emplace(key, i).second)
+                {
+                    keys.push_back(key);
+                }
+            }
+        );
+    }
+
+    order_iterators(keys, order, gen);
+
+    for (auto key : keys)
+    {
+        rec.run([&]() { m.erase(key); });
+    }
+}
+
+template <template <typename> class Alloc>
+void deque_workload(recorder& rec, std::size_t n, free_order order)
+{
+    std::deque<std::size_t, Alloc<std::size_t>> d;
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        rec.run([&]() { d.push_back(i); });
+    }
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        if (order == free_order::lifo)
+        {
+            rec.run([&]() { d.pop_back(); });
+        }
+        else
+        {
+            rec.run([&]() { d.pop_front(); });
+        }
+    }
+}
+
+/// Vector of small vectors. Workload of former test_1a..test_3b programs.
+/// Subvectors have fixed size if `random_size` is false, otherwise random
+/// size from 1 to 32.
+///
+template <template <typename> class Alloc>
+void vector_of_vectors_workload(recorder& rec, std::size_t n, bool random_size)
+{
+    std::mt19937 gen(SEED);
+    std::uniform_int_distribution<std::size_t> distrib(1, 32);
+
+    std::vector<std::vector<char, Alloc<char>>> vec(n);
+
+    for (auto& subvec : vec)
+    {
+        const std::size_t sz = random_size ? distrib(gen) : 32;
+        rec.run([&]() { subvec.resize(sz); });
+    }
+
+    for (auto& subvec : vec)
+    {
+        rec.run([&]() { std::vector<char, Alloc<char>>().swap(subvec); });
+    }
+}
+
+/// Producers allocate lists, consumers on other threads deallocate them.
+///
+template <template <typename> class Alloc>
+void producer_consumer_workload(recorder& rec, std::size_t n, unsigned threads)
+{
+    using list_type = std::list<std::size_t, Alloc<std::size_t>>;
+
+    const std::size_t batch = 1000;
+    const std::size_t batches_per_producer = std::max<std::size_t>(1, n / batch / threads);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<list_type> queue;
+
+    std::vector<recorder> recorders(2 * threads);
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        workers.emplace_back
+        (
+            [&, t]()
+            {
+                for (std::size_t b = 0; b < batches_per_producer; ++b)
+                {
+                    list_type l;
+                    const auto t1 = clock_type::now();
+                    for (std::size_t i = 0; i < batch; ++i)
+                    {
+                        l.push_back(i);
+                    }
+                    recorders[2 * t].add_batch(batch, clock_type::now() - t1);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    queue.push_back(std::move(l));
+                    cv.notify_one();
+                }
+            }
+        );
+
+        workers.emplace_back
+        (
+            [&, t]()
+            {
+                for (std::size_t b = 0; b < batches_per_producer; ++b)
+                {
+                    list_type l;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [&]() { return !queue.empty(); });
+                        l = std::move(queue.front());
+                        queue.pop_front();
+                    }
+                    const auto t1 = clock_type::now();
+                    l.clear();
+                    recorders[2 * t + 1].add_batch(batch, clock_type::now() - t1);
+                }
+            }
+        );
+    }
+
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+
+    for (auto& r : recorders)
+    {
+        rec.merge(r);
+    }
+}
+
+//
+// ---- CASES ------------------------------------------------------------------
+//
+
+template <typename T>
+using std_allocator = std::allocator<T>;
+
+template <typename T>
+using pool_allocator = sfl::pool_allocator<T>;
+
+template <typename T>
+using single_threaded_pool_allocator = sfl::pool_allocator<T, sfl::single_threaded>;
+
+struct bench_variant
+{
+    std::string allocator;
+    std::function<void(recorder&)> run;
+};
+
+struct bench_case
+{
+    std::string name;
+    free_order order;
+    unsigned threads;
+    std::size_t n;
+    std::vector<bench_variant> variants;
+};
+
+#define BENCHMARK_CASE(name, func, order, n)                                \
+    cases.push_back                                                         \
+    ({                                                                      \
+        name, order, 1, n,                                                  \
+        {                                                                   \
+            {                                                               \
+                "std::allocator",                                           \
+                [=](recorder& rec) { func<std_allocator>(rec, n, order); }  \
+            },                                                              \
+            {                                                               \
+                "sfl::pool_allocator",                                      \
+                [=](recorder& rec) { func<pool_allocator>(rec, n, order); } \
+            },                                                              \
+            {                                                               \
+                "sfl::pool_allocator/st",                                   \
+                [=](recorder& rec)                                          \
+                {                                                           \
+                    func<single_threaded_pool_allocator>(rec, n, order);    \
+                }                                                           \
+            }                                                               \
+        }                                                                   \
+    })
+
+std::vector<bench_case> make_cases(double scale, unsigned threads)
+{
+    std::vector<bench_case> cases;
+
+    const std::size_t n = std::max<std::size_t>(1000, std::size_t(1000000 * scale));
+
+    const free_order orders[] = {free_order::lifo, free_order::fifo, free_order::random};
+
+    for (free_order order : orders)
+    {
+        BENCHMARK_CASE("list", list_workload, order, n);
+        BENCHMARK_CASE("map", map_workload, order, n);
+        BENCHMARK_CASE("set", set_workload, order, n);
+        BENCHMARK_CASE("unordered_map", unordered_map_workload, order, n);
+    }
+
+    BENCHMARK_CASE("deque", deque_workload, free_order::lifo, 4 * n);
+    BENCHMARK_CASE("deque", deque_workload, free_order::fifo, 4 * n);
+
+    const bool sizes[] = {false, true};
+
+    for (bool random_size : sizes)
+    {
+        cases.push_back
+        ({
+            random_size ? "vector_of_vectors_random_size" : "vector_of_vectors_fixed_size",
+            free_order::fifo, 1, n,
+            {
+                {
+                    "std::allocator",
+                    [=](recorder& rec) { vector_of_vectors_workload<std_allocator>(rec, n, random_size); }
+                },
+                {
+                    "sfl::pool_allocator",
+                    [=](recorder& rec) { vector_of_vectors_workload<pool_allocator>(rec, n, random_size); }
+                },
+                {
+                    "sfl::pool_allocator/st",
+                    [=](recorder& rec)
+                    {
+                        vector_of_vectors_workload<single_threaded_pool_allocator>(rec, n, random_size);
+                    }
+                }
+            }
+        });
+    }
+
+    // Single-threaded pool is not applicable, nodes are freed by other thread.
+    cases.push_back
+    ({
+        "producer_consumer", free_order::fifo, threads, 4 * n,
+        {
+            {
+                "std::allocator",
+                [=](recorder& rec) { producer_consumer_workload<std_allocator>(rec, 4 * n, threads); }
+            },
+            {
+                "sfl::pool_allocator",
+                [=](recorder& rec) { producer_consumer_workload<pool_allocator>(rec, 4 * n, threads); }
+            }
+        }
+    });
+
+    return cases;
+}
+
+#undef BENCHMARK_CASE
+
+//
+// ---- RUNNER -----------------------------------------------------------------
+//
+
+result measure(const bench_case& c, const bench_variant& v)
+{
+    recorder rec;
+
+    const auto t1 = clock_type::now();
+    v.run(rec);
+    const auto t2 = clock_type::now();
+
+    result r;
+    r.name = c.name;
+    r.allocator = v.allocator;
+    r.order = to_string(c.order);
+    r.threads = c.threads;
+    r.ops = rec.ops();
+    r.seconds = std::chrono::duration<double>(t2 - t1).count();
+    r.ops_per_sec = r.seconds > 0 ? r.ops / r.seconds : 0;
+    r.p50_ns = rec.percentile(0.50);
+    r.p99_ns = rec.percentile(0.99);
+    r.peak_rss_kib = -1;
+    return r;
+}
+
+#ifdef BENCHMARK_FORK
+
+/// Runs case in child process. Peak RSS is taken from child's rusage.
+///
+bool measure_isolated(const bench_case& c, const bench_variant& v, result& r)
+{
+    int fds[2];
+    if (::pipe(fds) != 0)
+    {
+        return false;
+    }
+
+    const pid_t pid = ::fork();
+
+    if (pid < 0)
+    {
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        ::close(fds[0]);
+        const result res = measure(c, v);
+        char buf[256];
+        const int len = std::snprintf
+        (
+            buf, sizeof(buf), "%zu %.17g %.17g %.17g",
+            res.ops, res.seconds, res.p50_ns, res.p99_ns
+        );
+        if (::write(fds[1], buf, len) != len)
+        {
+            ::_exit(1);
+        }
+        ::_exit(0);
+    }
+
+    ::close(fds[1]);
+
+    std::string out;
+    char buf[256];
+    ssize_t len;
+    while ((len = ::read(fds[0], buf, sizeof(buf))) > 0)
+    {
+        out.append(buf, len);
+    }
+    ::close(fds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    std::memset(&usage, 0, sizeof(usage));
+    if (::wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return false;
+    }
+
+    r.name = c.name;
+    r.allocator = v.allocator;
+    r.order = to_string(c.order);
+    r.threads = c.threads;
+
+    std::istringstream is(out);
+    is >> r.ops >> r.seconds >> r.p50_ns >> r.p99_ns;
+    if (!is)
+    {
+        return false;
+    }
+
+    r.ops_per_sec = r.seconds > 0 ? r.ops / r.seconds : 0;
+
+    #if defined(__APPLE__)
+    r.peak_rss_kib = usage.ru_maxrss / 1024; // Bytes on macOS.
+    #else
+    r.peak_rss_kib = usage.ru_maxrss; // KiB on Linux and BSD.
+    #endif
+
+    return true;
+}
+
+#endif // BENCHMARK_FORK
+
+void write_json(std::ostream& os, const std::vector<result>& results)
+{
+    os << "[\n";
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        const result& r = results[i];
+        os << "  {\"benchmark\": \"" << r.name << "\""
+           << ", \"allocator\": \"" << r.allocator << "\""
+           << ", \"free_order\": \"" << r.order << "\""
+           << ", \"threads\": " << r.threads
+           << ", \"ops\": " << r.ops
+           << ", \"seconds\": " << r.seconds
+           << ", \"ops_per_sec\": " << r.ops_per_sec
+           << ", \"p50_ns\": " << r.p50_ns
+           << ", \"p99_ns\": " << r.p99_ns
+           << ", \"peak_rss_kib\": " << r.peak_rss_kib
+           << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "]\n";
+}
+
+void write_csv(std::ostream& os, const std::vector<result>& results)
+{
+    os << "benchmark,allocator,free_order,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,peak_rss_kib\n";
+    for (const result& r : results)
+    {
+        os << r.name << "," << r.allocator << "," << r.order << "," << r.threads << ","
+           << r.ops << "," << r.seconds << "," << r.ops_per_sec << ","
+           << r.p50_ns << "," << r.p99_ns << "," << r.peak_rss_kib << "\n";
+    }
+}
+
+void print_row(const result& r)
+{
+    std::cout << std::left
+              << std::setw(32) << r.name
+              << std::setw(26) << r.allocator
+              << std::setw(8) << r.order
+              << std::right
+              << std::setw(4) << r.threads
+              << std::setw(14) << std::fixed << std::setprecision(0) << r.ops_per_sec
+              << std::setw(10) << std::setprecision(0) << r.p50_ns
+              << std::setw(10) << std::setprecision(0) << r.p99_ns
+              << std::setw(12) << r.peak_rss_kib
+              << std::endl;
+}
+
+int usage(const char* argv0)
+{
+    std::cerr << "Usage: " << argv0
+              << " [--filter SUBSTRING] [--scale FACTOR] [--threads N]"
+                 " [--format json|csv] [--output FILE] [--no-fork]" << std::endl;
+    return 2;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::string filter;
+    double scale = 1.0;
+    unsigned threads = 4;
+    std::string format = "json";
+    std::string output;
+    bool fork = true;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if (arg == "--filter" && has_value)
+        {
+            filter = argv[++i];
+        }
+        else if (arg == "--scale" && has_value)
+        {
+            scale = std::atof(argv[++i]);
+        }
+        else if (arg == "--threads" && has_value)
+        {
+            threads = unsigned(std::max(1, std::atoi(argv[++i])));
+        }
+        else if (arg == "--format" && has_value)
+        {
+            format = argv[++i];
+        }
+        else if (arg == "--output" && has_value)
+        {
+            output = argv[++i];
+        }
+        else if (arg == "--no-fork")
+        {
+            fork = false;
+        }
+        else
+        {
+            return usage(argv[0]);
+        }
+    }
+
+    if (format != "json" && format != "csv")
+    {
+        return usage(argv[0]);
+    }
+
+    std::cout << std::left
+              << std::setw(32) << "benchmark"
+              << std::setw(26) << "allocator"
+              << std::setw(8) << "order"
+              << std::right
+              << std::setw(4) << "thr"
+              << std::setw(14) << "ops/sec"
+              << std::setw(10) << "p50 ns"
+              << std::setw(10) << "p99 ns"
+              << std::setw(12) << "peak KiB"
+              << std::endl;
+
+    std::vector<result> results;
+
+    for (const bench_case& c : make_cases(scale, threads))
+    {
+        if (!filter.empty() && c.name.find(filter) == std::string::npos)
+        {
+            continue;
+        }
+
+        for (const bench_variant& v : c.variants)
+        {
+            result r;
+
+            bool done = false;
+
+            #ifdef BENCHMARK_FORK
+            if (fork)
+            {
+                if (!measure_isolated(c, v, r))
+                {
+                    std::cerr << "ERROR: child process failed: " << c.name << std::endl;
+                    return 1;
+                }
+                done = true;
+            }
+            #else
+            (void)fork;
+            #endif
+
+            if (!done)
+            {
+                r = measure(c, v);
+            }
+
+            print_row(r);
+            results.push_back(r);
+        }
+    }
+
+    if (!output.empty())
+    {
+        std::ofstream os(output);
+
+        if (!os)
+        {
+            std::cerr << "ERROR: cannot open " << output << std::endl;
+            return 1;
+        }
+
+        if (format == "json")
+        {
+            write_json(os, results);
+        }
+        else
+        {
+            write_csv(os, results);
+        }
+    }
+
+    return 0;
+}
@@ -26,6 +26,11 @@ extern "C"
 
 #if defined(__linux__) || defined(__unix__)
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__GLIBC__)
+#include <execinfo.h>
+#endif
 #elif defined(_WIN32)
 #include <memoryapi.h>
 #else
@@ -34,343 +39,5536 @@ extern "C"
 
 } // extern "C"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
 
+#if defined(__GNUC__)
+#define SFL_POOL_ALLOCATOR_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define SFL_POOL_ALLOCATOR_NOINLINE __declspec(noinline)
+#else
+#define SFL_POOL_ALLOCATOR_NOINLINE
+#endif
+
 namespace sfl
 {
 
 namespace dtl
 {
 
-class bucket
+/// Maps region of `size` bytes aligned to `size` bytes. Size must be power
+/// of two and multiple of page size. Over-reserves twice the size and trims
+/// the unaligned head and tail.
+///
+/// If `commit` is false, only address space is reserved. Pages must be
+/// committed by `commit_pages` before use.
+///
+inline void* map_aligned(std::size_t size, bool commit = true)
 {
-private:
-
-    static constexpr std::size_t SFL_BUCKET_SIZE = UINT16_MAX * 2;
-
-    unsigned char* data_;
+    #if defined(__linux__) || defined(__unix__)
+    void* p = ::mmap
+    (
+        nullptr,
+        size * 2,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | (commit ? 0 : MAP_NORESERVE),
+        -1,
+        0
+    );
 
-    std::uint16_t block_size_;
-    std::uint16_t num_blocks_;
-    std::uint16_t num_used_blocks_;
-    std::uint16_t first_unused_block_;
+    if (p == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
 
-private:
+    unsigned char* first = static_cast<unsigned char*>(p);
+    unsigned char* aligned = first + (size - std::uintptr_t(first) % size) % size;
+    unsigned char* last = first + size * 2;
 
-    /// Access to node in embedded linked list.
-    /// Function does not check whether the given block is used or unused.
-    ///
-    std::uint16_t& node_in_embedded_list(std::size_t block_idx) const noexcept
+    if (aligned != first)
     {
-        // Pointer to the beginning of the block.
-        unsigned char* p = data_ + block_idx * block_size_;
-
-        return *static_cast<std::uint16_t*>
-        (
-            static_cast<void*>
-            (
-                // Pointer to node must be aligned to uint16_t.
-                std::size_t(p) % 2 == 0 ? p : p + 1
-            )
-        );
+        ::munmap(static_cast<void*>(first), aligned - first);
     }
 
-public:
-
-    void init(std::size_t block_size)
+    if (aligned + size != last)
     {
-        // We are using uint16_t as type for indices in embedded linked list.
-        // Because of that, block size cannot be less than 2 bytes.
-        block_size_ = block_size < 2 ? 2 : block_size;
+        ::munmap(static_cast<void*>(aligned + size), last - (aligned + size));
+    }
 
-        #if defined(__linux__) || defined(__unix__)
-        void* p = ::mmap
-        (
-            nullptr,
-            SFL_BUCKET_SIZE,
-            PROT_READ | PROT_WRITE,
-            MAP_PRIVATE | MAP_ANONYMOUS,
-            -1,
-            0
-        );
+    return static_cast<void*>(aligned);
+    #elif defined(_WIN32)
+    // Windows cannot release part of reserved region. Reserve twice the size
+    // to find aligned address, release, then reserve and commit exactly at
+    // that address. Another thread can take the address in between, so retry.
+    for (int attempt = 0; attempt < 16; ++attempt)
+    {
+        void* p = ::VirtualAlloc(nullptr, size * 2, MEM_RESERVE, PAGE_NOACCESS);
 
-        if (p == MAP_FAILED)
+        if (p == nullptr)
         {
             throw std::bad_alloc();
         }
-        #elif defined(_WIN32)
-        void* p = ::VirtualAlloc
+
+        unsigned char* first = static_cast<unsigned char*>(p);
+        unsigned char* aligned = first + (size - std::uintptr_t(first) % size) % size;
+
+        ::VirtualFree(p, 0, MEM_RELEASE);
+
+        p = ::VirtualAlloc
         (
-            nullptr,
-            SFL_BUCKET_SIZE,
-            MEM_RESERVE | MEM_COMMIT,
-            PAGE_READWRITE
+            static_cast<void*>(aligned),
+            size,
+            commit ? MEM_RESERVE | MEM_COMMIT : MEM_RESERVE,
+            commit ? PAGE_READWRITE : PAGE_NOACCESS
         );
 
-        if (p == nullptr)
+        if (p != nullptr)
         {
-            throw std::bad_alloc();
+            return p;
         }
-        #else
-        #error "Not implemented."
-        #endif
+    }
+
+    throw std::bad_alloc();
+    #else
+    #error "Not implemented."
+    #endif
+}
 
-        data_ = static_cast<unsigned char*>(p);
+inline void unmap_aligned(void* p, std::size_t size) noexcept
+{
+    #if defined(__linux__) || defined(__unix__)
+    ::munmap(p, size);
+    #elif defined(_WIN32)
+    (void)size;
+    ::VirtualFree(p, 0, MEM_RELEASE);
+    #else
+    #error "Not implemented."
+    #endif
+}
 
-        num_blocks_ = SFL_BUCKET_SIZE / block_size_;
+/// Makes pages in reserved region usable.
+///
+inline void commit_pages(void* p, std::size_t size)
+{
+    #if defined(__linux__) || defined(__unix__)
+    // Reserved with MAP_NORESERVE. Pages are committed on first touch.
+    (void)p;
+    (void)size;
+    #elif defined(_WIN32)
+    if (::VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    #else
+    #error "Not implemented."
+    #endif
+}
 
-        num_used_blocks_ = 0;
+/// Returns physical memory backing the pages to the operating system.
+/// Address range stays reserved. Content of pages is lost.
+///
+inline void purge_pages(void* p, std::size_t size) noexcept
+{
+    #if defined(__linux__) || defined(__unix__)
+    #if defined(MADV_FREE)
+    // Cheaper than MADV_DONTNEED: pages are reclaimed lazily, only under
+    // memory pressure. Not supported by older kernels.
+    if (::madvise(p, size, MADV_FREE) == 0)
+    {
+        return;
+    }
+    #endif
+    ::madvise(p, size, MADV_DONTNEED);
+    #elif defined(_WIN32)
+    ::VirtualFree(p, size, MEM_DECOMMIT);
+    #else
+    #error "Not implemented."
+    #endif
+}
 
-        first_unused_block_ = 0;
+/// Returns physical memory backing pages of region that is in use to the
+/// operating system. Pages stay accessible and are faulted in again on the
+/// next write. Content of pages is lost.
+///
+inline void reset_pages(void* p, std::size_t size) noexcept
+{
+    #if defined(__linux__) || defined(__unix__)
+    purge_pages(p, size);
+    #elif defined(_WIN32)
+    // Unlike MEM_DECOMMIT, pages stay committed.
+    ::VirtualAlloc(p, size, MEM_RESET, PAGE_READWRITE);
+    #else
+    #error "Not implemented."
+    #endif
+}
 
-        for (std::uint16_t i = 0; i < num_blocks_; ++i)
-        {
-            node_in_embedded_list(i) = i + 1;
-        }
+/// Returns size of page of virtual memory.
+///
+inline std::size_t page_size() noexcept
+{
+    #if defined(__linux__) || defined(__unix__)
+    static const std::size_t size = std::size_t(::sysconf(_SC_PAGESIZE));
+    return size;
+    #elif defined(_WIN32)
+    return 4096;
+    #else
+    #error "Not implemented."
+    #endif
+}
+
+/// Maps region of `size` bytes backed by explicit huge pages (MAP_HUGETLB),
+/// aligned to huge page size. Returns nullptr if that is not possible, e.g.
+/// if no huge pages are reserved in the system.
+///
+inline void* map_huge_pages(std::size_t size) noexcept
+{
+    #if defined(__linux__) && defined(MAP_HUGETLB)
+    // Without MAP_NORESERVE huge pages are reserved by mmap, so missing huge
+    // pages are reported here and not by SIGBUS on first touch.
+    void* p = ::mmap
+    (
+        nullptr,
+        size,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+        -1,
+        0
+    );
+
+    if (p == MAP_FAILED)
+    {
+        return nullptr;
     }
 
-    void release() noexcept
+    return p;
+    #else
+    (void)size;
+    return nullptr;
+    #endif
+}
+
+/// Asks the operating system to back region with transparent huge pages.
+///
+inline void advise_huge_pages(void* p, std::size_t size) noexcept
+{
+    #if defined(__linux__) && defined(MADV_HUGEPAGE)
+    ::madvise(p, size, MADV_HUGEPAGE);
+    #else
+    (void)p;
+    (void)size;
+    #endif
+}
+
+/// Sets preferred NUMA node for pages of region. Pages are allocated on
+/// that node when they are first touched. Fails silently if node does not
+/// exist (e.g. simulated node) or if NUMA is not supported.
+///
+inline void bind_to_node(void* p, std::size_t size, std::size_t node) noexcept
+{
+    #if defined(__linux__) && defined(SYS_mbind)
+    const unsigned long mask_bits = sizeof(unsigned long) * 8;
+
+    if (node >= mask_bits - 1)
     {
-        SFL_ASSERT(data_ != nullptr);
-        SFL_ASSERT(num_used_blocks_ == 0);
+        return;
+    }
 
-        #if defined(__linux__) || defined(__unix__)
-        ::munmap(static_cast<void*>(data_), SFL_BUCKET_SIZE);
-        #elif defined(_WIN32)
-        ::VirtualFree(static_cast<void*>(data_), 0, MEM_RELEASE);
+    const unsigned long mask = 1UL << node;
+
+    const int mpol_preferred = 1;
+
+    ::syscall(SYS_mbind, p, size, mpol_preferred, &mask, mask_bits, 0);
+    #else
+    (void)p;
+    (void)size;
+    (void)node;
+    #endif
+}
+
+/// Returns NUMA node (or CPU, if NUMA is simulated) on which the calling
+/// thread is running.
+///
+inline std::size_t detect_numa_node() noexcept
+{
+    #if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (::syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+    {
+        #if SFL_POOL_ALLOCATOR_NUMA_SIMULATE
+        return cpu;
         #else
-        #error "Not implemented."
+        return node;
         #endif
-
-        data_ = nullptr;
     }
+    #endif
+    return 0;
+}
 
-    void* allocate() noexcept
-    {
-        SFL_ASSERT(data_ != nullptr);
-        SFL_ASSERT(num_used_blocks_ < num_blocks_);
+static constexpr std::size_t SFL_BUCKET_SIZE = SFL_POOL_ALLOCATOR_BUCKET_SIZE;
 
-        const std::size_t block_idx = first_unused_block_;
+static_assert((SFL_BUCKET_SIZE & (SFL_BUCKET_SIZE - 1)) == 0 && SFL_BUCKET_SIZE >= 4096,
+              "SFL_POOL_ALLOCATOR_BUCKET_SIZE must be power of two not less than 4 KiB.");
 
-        first_unused_block_ = node_in_embedded_list(block_idx);
+/// Type of block indices in embedded linked lists. 16-bit indices are enough
+/// for buckets up to 128 KiB since blocks of list bucket are at least 2 bytes.
+/// Larger buckets use 32-bit indices and blocks of at least 4 bytes.
+///
+using block_index = std::conditional<SFL_BUCKET_SIZE <= 128 * 1024, std::uint16_t, std::uint32_t>::type;
 
-        ++num_used_blocks_;
+/// Minimum number of blocks per bucket of medium size class.
+static constexpr std::size_t SFL_MIN_BLOCKS_PER_BUCKET = 32;
 
-        return static_cast<void*>(data_ + block_idx * block_size_);
-    }
+/// Largest block size allocated from buckets. Larger blocks would need
+/// buckets of tens of megabytes.
+static constexpr std::size_t SFL_MAX_POOLED_BLOCK_SIZE = 1024 * 1024;
 
-    void deallocate(void* p) noexcept
+/// Returns size of buckets of size class with the given block size. That is
+/// SFL_BUCKET_SIZE, or for medium blocks the smallest larger power of two
+/// that has room for about SFL_MIN_BLOCKS_PER_BUCKET blocks. Buckets are
+/// aligned to their size, whatever it is.
+///
+inline std::size_t bucket_size_of(std::size_t block_size) noexcept
+{
+    std::size_t size = SFL_BUCKET_SIZE;
+    while (size < SFL_MIN_BLOCKS_PER_BUCKET * block_size)
     {
-        SFL_ASSERT(data_ != nullptr);
-        SFL_ASSERT(num_used_blocks_ > 0);
-        SFL_ASSERT(p >= data_ && p < data_ + SFL_BUCKET_SIZE);
+        size *= 2;
+    }
+    return size;
+}
 
-        unsigned char* q = static_cast<unsigned char*>(p);
+/// Source of memory for buckets.
+///
+/// Reserves large, contiguous, chunk-aligned ranges of address space (chunks)
+/// and carves buckets out of them. Released buckets are kept in a per-chunk
+/// cache of free slots for reuse, and their physical memory is returned to
+/// the operating system by `madvise` (or decommitted on Windows) instead of
+/// being unmapped. This avoids one mmap/munmap pair per bucket and keeps the
+/// number of memory mappings low.
+///
+/// If chunk cannot be reserved (e.g. address space is limited) or arena is
+/// disabled, buckets are mapped one by one.
+///
+/// Released buckets are first retained (still resident) in a list shared by
+/// all size classes, so that workload oscillating around bucket boundary does
+/// not return and fault in the same memory over and over again. Retained
+/// bucket can be reused for any block size. Memory of retained buckets is
+/// returned to the operating system when their number exceeds the high-water
+/// mark, when they have been retained longer than the decay time, or on
+/// demand by `trim`.
+///
+/// Buckets of medium blocks are larger than SFL_BUCKET_SIZE. They are mapped
+/// one by one, but retained in the same list as other buckets, counted by
+/// their size against the same high-water mark, and reused only for buckets
+/// of the same size.
+///
+/// If huge pages are enabled, buckets are first carved out of 2 MiB
+/// superblocks backed by explicit huge pages (MAP_HUGETLB). If the system
+/// has no free huge pages, chunks are advised to use transparent huge pages
+/// instead; buckets are carved out of chunk in address order, so consecutive
+/// buckets fill whole huge pages. Memory of explicit huge pages cannot be
+/// returned in pieces smaller than huge page, so their buckets are recycled
+/// but never purged.
+///
+/// Every chunk and every superblock belongs to one NUMA node and its memory
+/// is bound to that node. Buckets are acquired for the given node and
+/// retained buckets are reused only for the same node.
+///
+/// Shared by all pools in the process. Never destroyed, so it outlives every
+/// pool regardless of static destruction order.
+///
+class arena
+{
+private:
+
+    static constexpr std::size_t chunk_size = SFL_POOL_ALLOCATOR_ARENA_SIZE;
+
+    static_assert(chunk_size == 0 ||
+                  (chunk_size % SFL_BUCKET_SIZE == 0 && (chunk_size & (chunk_size - 1)) == 0),
+                  "SFL_POOL_ALLOCATOR_ARENA_SIZE must be zero or power of two multiple of bucket size.");
+
+    static constexpr std::size_t slots_per_chunk = chunk_size / SFL_BUCKET_SIZE;
 
-        // Alignment check.
-        SFL_ASSERT((q - data_) % block_size_ == 0);
+    static constexpr bool huge_pages = SFL_POOL_ALLOCATOR_HUGE_PAGES != 0;
 
-        const std::size_t block_idx = (q - data_) / block_size_;
+    static constexpr std::size_t superblock_size = 2 * 1024 * 1024;
 
-        #ifdef SFL_POOL_ALLOCATOR_EXTRA_CHECKS
-        for(std::uint16_t i = first_unused_block_; i < num_blocks_; i = node_in_embedded_list(i))
+    /// Zero if buckets are larger than superblock. Such buckets are backed
+    /// only by transparent huge pages.
+    static constexpr std::size_t slots_per_superblock = superblock_size / SFL_BUCKET_SIZE;
+
+    static constexpr std::size_t num_nodes = SFL_POOL_ALLOCATOR_NUMA_NODES;
+
+    /// Chunk header. Placed at the beginning of the chunk, followed by the
+    /// array of links for free slots. Header and links occupy first slots.
+    struct chunk
+    {
+        chunk* next;
+        std::size_t first_slot;          // First slot usable for buckets.
+        std::size_t num_touched_slots;   // Slots at and above this index have never been used.
+        std::size_t first_free_slot;     // Head of list of free slots. slots_per_chunk if empty.
+        std::size_t node;                // NUMA node.
+
+        std::uint32_t* links() noexcept
         {
-            // Double free check.
-            SFL_ASSERT(i != block_idx);
+            return reinterpret_cast<std::uint32_t*>(this + 1);
         }
-        #endif
 
-        node_in_embedded_list(block_idx) = first_unused_block_;
+        unsigned char* slot(std::size_t index) noexcept
+        {
+            return reinterpret_cast<unsigned char*>(this) + index * SFL_BUCKET_SIZE;
+        }
+    };
 
-        first_unused_block_ = block_idx;
+    static constexpr std::size_t header_size =
+        sizeof(chunk) + slots_per_chunk * sizeof(std::uint32_t);
 
-        --num_used_blocks_;
-    }
+    static constexpr std::size_t header_slots =
+        (header_size + SFL_BUCKET_SIZE - 1) / SFL_BUCKET_SIZE;
 
-    bool is_empty() const noexcept
+    using clock = std::chrono::steady_clock;
+
+    /// Node of list of retained buckets. Placed at the beginning of the
+    /// retained bucket's memory.
+    struct retained_bucket
     {
-        SFL_ASSERT(data_ != nullptr);
-        return num_used_blocks_ == 0;
-    }
+        retained_bucket* prev;
+        retained_bucket* next;
+        clock::time_point since;
+        std::size_t size;
+        bool huge;
+        std::size_t node;
+    };
 
-    bool is_full() const noexcept
+    /// Node of list of free slots in superblocks backed by explicit huge
+    /// pages. Placed at the beginning of the free slot.
+    struct huge_slot
     {
-        SFL_ASSERT(data_ != nullptr);
-        return num_used_blocks_ == num_blocks_;
+        huge_slot* next;
+    };
+
+    static constexpr std::size_t max_retained = SFL_POOL_ALLOCATOR_RETAINED_BUCKETS;
+
+    /// Buckets larger than SFL_BUCKET_SIZE count as several buckets.
+    static constexpr std::size_t max_bytes_retained = max_retained * SFL_BUCKET_SIZE;
+
+    std::mutex mutex_;
+
+    chunk* chunks_;
+
+    bool reserve_failed_;
+
+    /// Most recently retained bucket.
+    retained_bucket* retained_first_;
+
+    /// Least recently retained bucket.
+    retained_bucket* retained_last_;
+
+    std::size_t num_retained_;
+
+    std::size_t bytes_retained_;
+
+    std::size_t num_chunks_;
+
+    /// Free slots in superblocks backed by explicit huge pages, per node.
+    huge_slot* huge_slots_[num_nodes];
+
+    /// Set when explicit huge pages cannot be mapped. Not tried again.
+    bool huge_tlb_failed_;
+
+    std::size_t num_superblocks_;
+
+private:
+
+    arena() noexcept
+        : chunks_(nullptr)
+        , reserve_failed_(chunk_size == 0)
+        , retained_first_(nullptr)
+        , retained_last_(nullptr)
+        , num_retained_(0)
+        , bytes_retained_(0)
+        , num_chunks_(0)
+        , huge_tlb_failed_(!huge_pages || slots_per_superblock == 0)
+        , num_superblocks_(0)
+    {
+        for (std::size_t i = 0; i < num_nodes; ++i)
+        {
+            huge_slots_[i] = nullptr;
+        }
     }
 
-    bool contains(void* p) const noexcept
+    void push_huge_slot(void* p, std::size_t node) noexcept
     {
-        SFL_ASSERT(data_ != nullptr);
-        return p >= data_ && p < data_ + SFL_BUCKET_SIZE;
+        huge_slot* s = ::new (p) huge_slot;
+        s->next = huge_slots_[node];
+        huge_slots_[node] = s;
     }
-};
 
-class fixed_size_allocator
-{
-private:
+    /// Returns slot from superblock backed by explicit huge pages, or
+    /// nullptr if there is no such slot and new superblock cannot be mapped.
+    ///
+    void* acquire_huge(std::size_t node) noexcept
+    {
+        if (huge_slots_[node] == nullptr)
+        {
+            if (huge_tlb_failed_)
+            {
+                return nullptr;
+            }
 
-    std::size_t block_size_;
+            unsigned char* p = static_cast<unsigned char*>(map_huge_pages(superblock_size));
+
+            if (p == nullptr)
+            {
+                huge_tlb_failed_ = true;
+                return nullptr;
+            }
 
-    std::vector<bucket> buckets_;
+            // Mapping is aligned to huge page size.
+            SFL_ASSERT(std::uintptr_t(p) % SFL_BUCKET_SIZE == 0);
 
-    bucket* last_alloc_;
-    bucket* last_dealloc_;
-    bucket* last_empty_;
+            ++num_superblocks_;
 
-public:
+            if (num_nodes > 1)
+            {
+                bind_to_node(p, superblock_size, node);
+            }
 
-    void init(std::size_t block_size) noexcept
-    {
-        block_size_ = block_size;
-        last_alloc_ = nullptr;
-        last_dealloc_ = nullptr;
-        last_empty_ = nullptr;
+            // Hand out slots in address order.
+            for (std::size_t i = slots_per_superblock; i > 0; --i)
+            {
+                push_huge_slot(p + (i - 1) * SFL_BUCKET_SIZE, node);
+            }
+        }
+
+        huge_slot* s = huge_slots_[node];
+        huge_slots_[node] = s->next;
+        return static_cast<void*>(s);
     }
 
-    void release() noexcept
+    chunk* new_chunk(std::size_t node) noexcept
     {
-        for (auto& b : buckets_)
+        void* p;
+
+        try
+        {
+            p = map_aligned(chunk_size, false);
+
+            if (num_nodes > 1)
+            {
+                // Before the header is touched.
+                bind_to_node(p, chunk_size, node);
+            }
+
+            commit_pages(p, header_slots * SFL_BUCKET_SIZE);
+        }
+        catch (...)
+        {
+            // Do not try again. Fall back to mapping buckets one by one.
+            reserve_failed_ = true;
+            return nullptr;
+        }
+
+        if (huge_pages)
         {
-            b.release();
+            advise_huge_pages(p, chunk_size);
         }
-        buckets_.clear();
-        last_alloc_ = nullptr;
-        last_dealloc_ = nullptr;
-        last_empty_ = nullptr;
+
+        chunk* c = ::new (p) chunk;
+        c->next = chunks_;
+        c->first_slot = header_slots;
+        c->num_touched_slots = header_slots;
+        c->first_free_slot = slots_per_chunk;
+        c->node = node;
+        chunks_ = c;
+        ++num_chunks_;
+        return c;
     }
 
-    void* allocate()
+    static chunk* chunk_of(void* p) noexcept
+    {
+        return reinterpret_cast<chunk*>
+        (
+            std::uintptr_t(p) & ~std::uintptr_t(chunk_size - 1)
+        );
+    }
+
+    bool owns(void* p) const noexcept
     {
-        if (last_alloc_ == nullptr || last_alloc_->is_full())
+        for (chunk* c = chunks_; c != nullptr; c = c->next)
         {
-            auto it = buckets_.begin();
-            while (it != buckets_.end())
+            if (c == chunk_of(p))
             {
-                if (!it->is_full())
-                {
-                    break;
-                }
-                ++it;
+                return true;
             }
+        }
+        return false;
+    }
 
-            if (it != buckets_.end())
+    void* acquire_from_chunks(std::size_t node)
+    {
+        for (chunk* c = chunks_; c != nullptr; c = c->next)
+        {
+            if (c->node != node)
             {
-                last_alloc_ = std::addressof(*it);
+                continue;
             }
-            else
-            {
-                bucket b;
-                b.init(block_size_); // Can throw. No effects if throws.
 
+            if (c->first_free_slot != slots_per_chunk)
+            {
+                const std::size_t index = c->first_free_slot;
+                c->first_free_slot = c->links()[index];
+                void* p = c->slot(index);
                 try
                 {
-                    buckets_.emplace_back(b); // Can throw. No effects if throws.
+                    commit_pages(p, SFL_BUCKET_SIZE); // Can throw.
                 }
                 catch (...)
                 {
-                    b.release();
+                    c->links()[index] = std::uint32_t(c->first_free_slot);
+                    c->first_free_slot = index;
                     throw;
                 }
+                return p;
+            }
 
-                last_alloc_ = std::addressof(buckets_.back());
-                last_dealloc_ = nullptr;
-                last_empty_ = nullptr;
+            if (c->num_touched_slots != slots_per_chunk)
+            {
+                void* p = c->slot(c->num_touched_slots);
+                commit_pages(p, SFL_BUCKET_SIZE); // Can throw.
+                ++c->num_touched_slots;
+                return p;
             }
         }
+        return nullptr;
+    }
 
-        if (last_alloc_ == last_empty_)
+    /// Returns bucket memory to the operating system. Slot of superblock
+    /// backed by explicit huge pages is only recycled.
+    ///
+    void purge(void* p, std::size_t size, bool huge, std::size_t node) noexcept
+    {
+        if (size != SFL_BUCKET_SIZE)
         {
-            last_empty_ = nullptr;
+            unmap_aligned(p, size);
+        }
+        else if (huge)
+        {
+            push_huge_slot(p, node);
+        }
+        else if (chunk_size != 0 && owns(p))
+        {
+            purge_pages(p, SFL_BUCKET_SIZE);
+            chunk* c = chunk_of(p);
+            const std::size_t index =
+                (static_cast<unsigned char*>(p) - c->slot(0)) / SFL_BUCKET_SIZE;
+            c->links()[index] = std::uint32_t(c->first_free_slot);
+            c->first_free_slot = index;
+        }
+        else
+        {
+            unmap_aligned(p, SFL_BUCKET_SIZE);
         }
-
-        return last_alloc_->allocate();
     }
 
-    void deallocate(void* p) noexcept
+    void unlink_retained(retained_bucket* r) noexcept
     {
-        if (last_dealloc_ == nullptr || !last_dealloc_->contains(p))
+        if (r->prev != nullptr)
         {
-            auto it = buckets_.begin();
-            while (it != buckets_.end())
-            {
-                if (it->contains(p))
-                {
-                    break;
-                }
-                ++it;
-            }
+            r->prev->next = r->next;
+        }
+        else
+        {
+            retained_first_ = r->next;
+        }
+        if (r->next != nullptr)
+        {
+            r->next->prev = r->prev;
+        }
+        else
+        {
+            retained_last_ = r->prev;
+        }
+        --num_retained_;
+        bytes_retained_ -= r->size;
+    }
 
-            SFL_ASSERT(it != buckets_.end());
-            last_dealloc_ = std::addressof(*it);
+    /// Takes the most recently retained bucket of the given size and node.
+    ///
+    void* pop_retained(bool& huge, std::size_t size, std::size_t node) noexcept
+    {
+        retained_bucket* r = retained_first_;
+        while (r != nullptr && (r->node != node || r->size != size))
+        {
+            r = r->next;
+        }
+        if (r == nullptr)
+        {
+            return nullptr;
         }
+        huge = r->huge;
+        unlink_retained(r);
+        return static_cast<void*>(r);
+    }
+
+    void purge_last_retained() noexcept
+    {
+        retained_bucket* r = retained_last_;
+        SFL_ASSERT(r != nullptr);
+        unlink_retained(r);
+        purge(static_cast<void*>(r), r->size, r->huge, r->node);
+    }
 
-        last_dealloc_->deallocate(p);
+    /// Adds bucket into list of retained buckets, purges the least recently
+    /// retained buckets above the limit and decays the rest. Mutex must be
+    /// locked.
+    ///
+    void retain(void* p, std::size_t size, bool huge, std::size_t node) noexcept
+    {
+        const clock::time_point now = clock::now();
 
-        if (last_dealloc_->is_empty())
+        retained_bucket* r = ::new (p) retained_bucket;
+        r->prev = nullptr;
+        r->next = retained_first_;
+        r->since = now;
+        r->size = size;
+        r->huge = huge;
+        r->node = node;
+        if (retained_first_ != nullptr)
         {
-            if (last_empty_ != nullptr)
-            {
-                SFL_ASSERT(last_empty_ == std::addressof(buckets_.back()));
-                buckets_.pop_back();
-            }
+            retained_first_->prev = r;
+        }
+        else
+        {
+            retained_last_ = r;
+        }
+        retained_first_ = r;
+        ++num_retained_;
+        bytes_retained_ += size;
 
-            using std::swap;
-            swap(*last_dealloc_, buckets_.back());
-            last_alloc_ = nullptr; // TODO: Improve.
-            last_dealloc_ = std::addressof(buckets_.back());
-            last_empty_ = last_dealloc_;
+        while (bytes_retained_ > max_bytes_retained)
+        {
+            purge_last_retained();
         }
-    }
-};
 
-small_size_allocator::small_size_allocator(std::size_t max_block_size)
-    : max_block_size_(max_block_size)
-    , fixed_size_allocators_(new fixed_size_allocator[max_block_size]) // Can throw.
-{
-    for (std::size_t i = 0; i < max_block_size_; ++i)
-    {
-        fixed_size_allocators_[i].init(i + 1);
+        decay(now);
     }
-}
 
-small_size_allocator::~small_size_allocator() noexcept
-{
-    for (std::size_t i = 0; i < max_block_size_; ++i)
+    /// Purges retained buckets that have been retained longer than decay time.
+    ///
+    void decay(clock::time_point now) noexcept
     {
-        fixed_size_allocators_[i].release();
+        const auto decay_time = std::chrono::milliseconds(SFL_POOL_ALLOCATOR_RETAIN_DECAY_MS);
+
+        while (retained_last_ != nullptr && now - retained_last_->since >= decay_time)
+        {
+            purge_last_retained();
+        }
     }
 
-    delete[] fixed_size_allocators_;
-}
+public:
 
-void* small_size_allocator::allocate(std::size_t block_size)
-{
-    if (block_size > max_block_size_)
+    static arena& instance() noexcept
     {
-        return ::operator new(block_size); // Can throw.
+        // Constructed in static storage and intentionally never destroyed.
+        alignas(arena) static unsigned char storage[sizeof(arena)];
+        static arena* instance = ::new (static_cast<void*>(storage)) arena();
+        return *instance;
     }
-    else
+
+    /// Locks arena before fork. See small_size_allocator_singleton::lock_all.
+    ///
+    void lock() noexcept
     {
-        const std::size_t index = block_size - 1;
-        return fixed_size_allocators_[index].allocate(); // Can throw.
+        mutex_.lock();
     }
-}
 
-void small_size_allocator::deallocate(void* p, std::size_t block_size) noexcept
-{
-    if (block_size > max_block_size_)
+    void unlock() noexcept
     {
-        ::operator delete(p);
+        mutex_.unlock();
     }
-    else
+
+    /// Returns memory for one bucket of the given NUMA node, aligned to
+    /// bucket size. Sets `huge` if memory is backed by explicit huge pages.
+    /// The flag and the node must be passed back to `release`. Sets `dirty`
+    /// if memory is retained bucket whose pages may still be resident.
+    ///
+    void* acquire(bool& huge, bool& dirty, std::size_t node)
     {
-        const std::size_t index = block_size - 1;
-        fixed_size_allocators_[index].deallocate(p);
-    }
-}
+        SFL_ASSERT(node < num_nodes);
 
-} // namespace dtl
+        huge = false;
+        dirty = false;
+
+        if (chunk_size != 0 || max_retained != 0 || huge_pages)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            void* p = pop_retained(huge, SFL_BUCKET_SIZE, node);
+
+            if (p != nullptr)
+            {
+                dirty = true;
+                if (num_retained_ != 0)
+                {
+                    decay(clock::now());
+                }
+                return p;
+            }
+
+            p = acquire_huge(node);
+
+            if (p != nullptr)
+            {
+                huge = true;
+                return p;
+            }
+
+            p = acquire_from_chunks(node); // Can throw.
+
+            if (p == nullptr && !reserve_failed_ && new_chunk(node) != nullptr)
+            {
+                p = acquire_from_chunks(node); // Can throw.
+            }
+
+            if (p != nullptr)
+            {
+                return p;
+            }
+        }
+
+        void* p = map_aligned(SFL_BUCKET_SIZE); // Can throw.
+
+        if (num_nodes > 1)
+        {
+            bind_to_node(p, SFL_BUCKET_SIZE, node);
+        }
+
+        return p;
+    }
+
+    /// Returns bucket memory acquired by `acquire`.
+    ///
+    void release(void* p, bool huge, std::size_t node) noexcept
+    {
+        if (chunk_size == 0 && max_retained == 0 && !huge)
+        {
+            unmap_aligned(p, SFL_BUCKET_SIZE);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (max_retained == 0)
+        {
+            purge(p, SFL_BUCKET_SIZE, huge, node);
+            return;
+        }
+
+        retain(p, SFL_BUCKET_SIZE, huge, node);
+    }
+
+    /// Returns memory for one bucket larger than SFL_BUCKET_SIZE, aligned to
+    /// its size. Such buckets are not carved from chunks. They are retained
+    /// like other buckets, in the same list and under the same limit. Sets
+    /// `dirty` if memory is retained bucket whose pages may still be
+    /// resident.
+    ///
+    void* acquire_large(std::size_t size, bool& dirty, std::size_t node)
+    {
+        SFL_ASSERT(size > SFL_BUCKET_SIZE && (size & (size - 1)) == 0);
+        SFL_ASSERT(node < num_nodes);
+
+        dirty = false;
+
+        if (max_retained != 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            bool huge;
+            void* p = pop_retained(huge, size, node);
+
+            if (p != nullptr)
+            {
+                dirty = true;
+                if (num_retained_ != 0)
+                {
+                    decay(clock::now());
+                }
+                return p;
+            }
+        }
+
+        void* p = map_aligned(size); // Can throw.
+
+        if (num_nodes > 1)
+        {
+            bind_to_node(p, size, node);
+        }
+
+        if (huge_pages && size >= superblock_size)
+        {
+            advise_huge_pages(p, size);
+        }
+
+        return p;
+    }
+
+    /// Returns bucket memory acquired by `acquire_large`.
+    ///
+    void release_large(void* p, std::size_t size, std::size_t node) noexcept
+    {
+        if (max_retained == 0 || size > max_bytes_retained)
+        {
+            unmap_aligned(p, size);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        retain(p, size, false, node);
+    }
+
+    /// Number of bytes returned to the operating system when bucket of the
+    /// given size is released. Retained buckets are counted when arena is
+    /// trimmed.
+    ///
+    static constexpr std::size_t released_bytes(std::size_t size) noexcept
+    {
+        return size == SFL_BUCKET_SIZE || (max_retained != 0 && size <= max_bytes_retained) ? 0 : size;
+    }
+
+    void stats(pool_statistics& s) noexcept
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        s.num_retained_buckets = num_retained_;
+        s.bytes_retained = bytes_retained_;
+        s.bytes_reserved = num_chunks_ * chunk_size;
+        s.bytes_huge_pages = num_superblocks_ * superblock_size;
+    }
+
+    /// Returns memory of all retained buckets to the operating system.
+    /// Returns number of returned bytes. Buckets backed by explicit huge
+    /// pages are only recycled and are not counted.
+    ///
+    std::size_t trim() noexcept
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        std::size_t n = 0;
+
+        while (retained_last_ != nullptr)
+        {
+            n += retained_last_->huge ? 0 : retained_last_->size;
+            purge_last_retained();
+        }
+
+        return n;
+    }
+};
+
+/// Returns number of trailing zero bits. Value must not be zero.
+///
+inline std::size_t count_trailing_zeros(std::uint64_t x) noexcept
+{
+    SFL_ASSERT(x != 0);
+
+    #if defined(__GNUC__) || defined(__clang__)
+    return std::size_t(__builtin_ctzll(x));
+    #elif defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return index;
+    #else
+    std::size_t n = 0;
+    while ((x & 1) == 0)
+    {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+    #endif
+}
+
+/// Reports invalid deallocation and aborts.
+///
+[[noreturn]] inline void report_invalid_free(const void* p) noexcept
+{
+    std::fprintf(stderr, "sfl::pool_allocator: double free or invalid pointer %p\n", p);
+    std::abort();
+}
+
+/// Checks condition of valid deallocation. If double free checks are
+/// enabled, the check is kept in release builds.
+///
+inline void check_free(bool ok, const void* p) noexcept
+{
+    #if SFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK
+    if (!ok)
+    {
+        report_invalid_free(p);
+    }
+    #else
+    SFL_ASSERT(ok);
+    (void)ok;
+    (void)p;
+    #endif
+}
+
+/// Returns base two logarithm of power of two.
+///
+constexpr unsigned log2_of(std::size_t x) noexcept
+{
+    return x <= 1 ? 0 : 1 + log2_of(x / 2);
+}
+
+/// Maps every SFL_BUCKET_SIZE slot of address space that belongs to a live
+/// bucket to the header of that bucket. Bucket of a block, and with it block
+/// size and owner, is found from the pointer alone. Pointer that does not
+/// belong to any bucket (e.g. allocated by ::operator new) maps to nullptr.
+///
+/// Two-level radix tree indexed by slot number. Root is zero-initialized
+/// static array, leaves are mapped on first use and never unmapped. Lookup
+/// takes two loads. Buckets larger than SFL_BUCKET_SIZE take several slots.
+///
+class bucket_map
+{
+private:
+
+    static constexpr unsigned address_bits = UINTPTR_MAX > 0xFFFFFFFF ? 48 : 32;
+
+    static constexpr unsigned slot_bits = log2_of(SFL_BUCKET_SIZE);
+
+    static constexpr unsigned key_bits = address_bits - slot_bits;
+
+    static constexpr unsigned root_bits = key_bits / 2;
+
+    static constexpr unsigned leaf_bits = key_bits - root_bits;
+
+    struct leaf
+    {
+        std::atomic<bucket*> slots[std::size_t(1) << leaf_bits];
+    };
+
+    static std::atomic<leaf*> root_[std::size_t(1) << root_bits];
+
+    /// Serializes creation of leaves.
+    static std::mutex mutex_;
+
+    static leaf* get_leaf(std::uintptr_t key)
+    {
+        std::atomic<leaf*>& r = root_[key >> leaf_bits];
+
+        leaf* l = r.load(std::memory_order_acquire);
+
+        if (l == nullptr)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            l = r.load(std::memory_order_relaxed);
+
+            if (l == nullptr)
+            {
+                // Zero-filled by the operating system.
+                l = static_cast<leaf*>(map_aligned(sizeof(leaf))); // Can throw.
+                r.store(l, std::memory_order_release);
+            }
+        }
+
+        return l;
+    }
+
+    /// Writes slots of bucket of the given size. Leaves must exist.
+    ///
+    static void set(bucket* b, std::size_t size, bucket* value) noexcept
+    {
+        const std::uintptr_t first = std::uintptr_t(b) >> slot_bits;
+
+        for (std::uintptr_t key = first; key < first + (size >> slot_bits); ++key)
+        {
+            leaf* l = root_[key >> leaf_bits].load(std::memory_order_relaxed);
+            SFL_ASSERT(l != nullptr);
+            l->slots[key & ((std::uintptr_t(1) << leaf_bits) - 1)].store(value, std::memory_order_release);
+        }
+    }
+
+public:
+
+    static_assert(sizeof(leaf) % 4096 == 0, "Leaf must be whole number of pages.");
+
+    /// Returns bucket that contains the given address, or nullptr.
+    ///
+    static bucket* find(const void* p) noexcept
+    {
+        const std::uintptr_t key = std::uintptr_t(p) >> slot_bits;
+
+        if ((key >> key_bits) != 0)
+        {
+            return nullptr;
+        }
+
+        const leaf* l = root_[key >> leaf_bits].load(std::memory_order_acquire);
+
+        if (l == nullptr)
+        {
+            return nullptr;
+        }
+
+        return l->slots[key & ((std::uintptr_t(1) << leaf_bits) - 1)].load(std::memory_order_acquire);
+    }
+
+    /// Maps slots of bucket of the given size. No effects if throws.
+    ///
+    static void insert(bucket* b, std::size_t size)
+    {
+        if (((std::uintptr_t(b) + size - 1) >> address_bits) != 0)
+        {
+            // Out of range of the map. Not expected from mmap without hint.
+            throw std::bad_alloc();
+        }
+
+        // Leaves are created before any slot is written. Bucket is aligned to
+        // its size, so it spans at most the leaves of its first and last slot.
+        const std::uintptr_t first = std::uintptr_t(b) >> slot_bits;
+        get_leaf(first); // Can throw.
+        get_leaf(first + (size >> slot_bits) - 1); // Can throw.
+
+        set(b, size, b);
+    }
+
+    /// Unmaps slots of bucket of the given size.
+    ///
+    static void erase(bucket* b, std::size_t size) noexcept
+    {
+        set(b, size, nullptr);
+    }
+
+    /// Locks creation of leaves before fork. See
+    /// small_size_allocator_singleton::lock_all.
+    ///
+    static void lock() noexcept
+    {
+        mutex_.lock();
+    }
+
+    static void unlock() noexcept
+    {
+        mutex_.unlock();
+    }
+};
+
+std::atomic<bucket_map::leaf*> bucket_map::root_[std::size_t(1) << bucket_map::root_bits];
+
+std::mutex bucket_map::mutex_;
+
+/// Bucket header. It is placed at the beginning of the bucket's memory,
+/// followed by bitmaps (if any) and blocks. Buckets are aligned to their
+/// size so the header of the bucket that owns a block is found by masking
+/// the block address.
+///
+/// Free blocks of list bucket are linked in embedded list of block indices
+/// stored in blocks themselves, so blocks cannot be smaller than index
+/// (2 bytes, or 4 bytes for buckets larger than 128 KiB).
+/// Bitmap bucket is used for block sizes up to
+/// SFL_POOL_ALLOCATOR_BITMAP_BLOCK_SIZE. It tracks used blocks in bitmap
+/// with one bit per block and finds free block by counting trailing zeros,
+/// so blocks can be as small as 1 byte.
+///
+/// If double free checks are enabled, every bucket also has bitmap of live
+/// blocks (allocated by user and not yet deallocated), which makes the check
+/// constant time.
+///
+class bucket
+{
+private:
+
+    static constexpr std::size_t bits_per_word = 64;
+
+    bucket* prev_;
+    bucket* next_;
+
+    /// Size of bucket memory. SFL_BUCKET_SIZE, or more for medium blocks.
+    std::uint32_t size_;
+
+    std::uint32_t block_size_;
+    std::uint32_t data_offset_;
+    std::uint32_t num_blocks_;
+    std::uint32_t num_used_blocks_;
+    std::uint32_t first_unused_block_;
+
+    /// Blocks at and above this index have never been allocated. They are not
+    /// linked in the embedded list, so their memory is not touched until they
+    /// are handed out.
+    std::uint32_t num_touched_blocks_;
+
+    /// List bucket: blocks at and above this index and at and above
+    /// num_touched_blocks_ have clean pages. Unlike the watermark, it is not
+    /// reset when bucket becomes empty, so pages written before are purged
+    /// even if bucket is reused lightly.
+    std::uint32_t num_dirty_blocks_;
+
+    /// Bitmap bucket: bit is set if block is used. Nullptr for list bucket.
+    std::atomic<std::uint64_t>* used_;
+
+    /// Bitmap bucket: no word below this index has free block, except for
+    /// blocks freed by other threads and not yet collected.
+    std::uint32_t first_free_word_;
+
+    /// Bitmap of live blocks, if double free checks are enabled.
+    std::atomic<std::uint64_t>* live_;
+
+    std::uint8_t bin_;
+
+    /// Memory is backed by explicit huge pages.
+    bool huge_;
+
+    /// NUMA node of the pool that owns the bucket.
+    std::uint8_t node_;
+
+    /// Index of size class in the owning small_size_allocator.
+    std::uint16_t size_class_;
+
+    /// Allocator that owns the bucket.
+    fixed_size_allocator* owner_;
+
+    /// Next bucket in owner's list of buckets with remote frees.
+    bucket* remote_next_;
+
+    /// Remote free list of list bucket. Blocks deallocated by threads that
+    /// do not own the bucket are pushed here with one CAS, linked through
+    /// the embedded list. Value num_blocks_ marks the end of list.
+    std::atomic<std::uint32_t> remote_first_;
+
+    /// Number of remote frees of bitmap bucket not yet collected. Blocks are
+    /// freed in the bitmap directly.
+    std::atomic<std::uint32_t> num_remote_;
+
+private:
+
+    static std::size_t num_words(std::size_t num_bits) noexcept
+    {
+        return (num_bits + bits_per_word - 1) / bits_per_word;
+    }
+
+    /// Constructs bitmap in raw memory. Bits at and above `num_bits` are set
+    /// so that they are never taken as free.
+    ///
+    static std::atomic<std::uint64_t>* make_bitmap(unsigned char* p, std::size_t num_bits) noexcept
+    {
+        std::atomic<std::uint64_t>* words = reinterpret_cast<std::atomic<std::uint64_t>*>(p);
+
+        const std::size_t n = num_words(num_bits);
+
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            ::new (static_cast<void*>(words + i)) std::atomic<std::uint64_t>(0);
+        }
+
+        if (num_bits % bits_per_word != 0)
+        {
+            words[n - 1].store(~std::uint64_t(0) << (num_bits % bits_per_word), std::memory_order_relaxed);
+        }
+
+        return words;
+    }
+
+    bucket(std::size_t size, std::size_t block_size, std::size_t size_class, bool huge, bool dirty,
+           std::size_t node, fixed_size_allocator* owner) noexcept
+        : prev_(nullptr)
+        , next_(nullptr)
+        , size_(static_cast<std::uint32_t>(size))
+        , used_(nullptr)
+        , first_free_word_(0)
+        , live_(nullptr)
+        , bin_(0)
+        , huge_(huge)
+        , node_(static_cast<std::uint8_t>(node))
+        , size_class_(static_cast<std::uint16_t>(size_class))
+        , owner_(owner)
+        , remote_next_(nullptr)
+    {
+        const bool bitmap = block_size <= SFL_POOL_ALLOCATOR_BITMAP_BLOCK_SIZE;
+
+        // List bucket stores indices of embedded linked list in free blocks.
+        // Because of that, block cannot be smaller than index.
+        block_size_ = !bitmap && block_size < sizeof(block_index) ? sizeof(block_index) : block_size;
+
+        const std::size_t num_bitmaps = (bitmap ? 1 : 0) + (SFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK ? 1 : 0);
+
+        // Blocks start at the first offset after the header and bitmaps that
+        // is multiple of the largest power of two dividing the block size.
+        // This way every block is aligned to that power of two.
+        const std::size_t block_align = block_size_ & (~block_size_ + 1);
+
+        const auto offset = [&](std::size_t n)
+        {
+            const std::size_t end = sizeof(bucket) + num_bitmaps * num_words(n) * sizeof(std::uint64_t);
+            return (end + block_align - 1) / block_align * block_align;
+        };
+
+        // Every block takes block_size_ bytes and one bit in every bitmap.
+        std::size_t n = (size_ - sizeof(bucket)) * 8 / (8 * block_size_ + num_bitmaps);
+
+        // Value num_blocks_ marks the end of embedded list.
+        if (!bitmap && n > block_index(-1))
+        {
+            n = block_index(-1);
+        }
+
+        while (offset(n) + n * block_size_ > size_)
+        {
+            --n;
+        }
+
+        num_blocks_ = n;
+
+        data_offset_ = offset(n);
+
+        unsigned char* p = reinterpret_cast<unsigned char*>(this) + sizeof(bucket);
+
+        #if SFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK
+        live_ = make_bitmap(p, n);
+        p += num_words(n) * sizeof(std::uint64_t);
+        #endif
+
+        if (bitmap)
+        {
+            used_ = make_bitmap(p, n);
+        }
+
+        num_used_blocks_ = 0;
+
+        // Embedded list is empty. Value num_blocks_ marks the end of list.
+        first_unused_block_ = num_blocks_;
+
+        num_touched_blocks_ = 0;
+
+        // Retained bucket is reused with whatever pages it had written.
+        num_dirty_blocks_ = dirty ? num_blocks_ : 0;
+
+        remote_first_.store(num_blocks_, std::memory_order_relaxed);
+
+        num_remote_.store(0, std::memory_order_relaxed);
+    }
+
+    ~bucket() = default;
+
+    bucket(const bucket&) = delete;
+    bucket& operator=(const bucket&) = delete;
+
+    unsigned char* data() const noexcept
+    {
+        return const_cast<unsigned char*>
+        (
+            reinterpret_cast<const unsigned char*>(this)
+        ) + data_offset_;
+    }
+
+    /// Reads node in embedded linked list (index of the next block).
+    /// Function does not check whether the given block is used or unused.
+    /// Node is stored at the beginning of the block, which does not have to
+    /// be aligned to index.
+    ///
+    std::uint32_t load_node(std::size_t block_idx) const noexcept
+    {
+        block_index next;
+        std::memcpy(&next, data() + block_idx * block_size_, sizeof(next));
+        return next;
+    }
+
+    /// Writes node in embedded linked list.
+    ///
+    void store_node(std::size_t block_idx, std::uint32_t next) const noexcept
+    {
+        const block_index value = static_cast<block_index>(next);
+        std::memcpy(data() + block_idx * block_size_, &value, sizeof(value));
+    }
+
+    /// Returns index of block. Checks that pointer points to the beginning
+    /// of a block of this bucket.
+    ///
+    std::size_t index_of(void* p) const noexcept
+    {
+        unsigned char* q = static_cast<unsigned char*>(p);
+
+        check_free(contains(p) && (q - data()) % block_size_ == 0, p);
+
+        return (q - data()) / block_size_;
+    }
+
+    /// Takes free block from bitmap. There must be one.
+    ///
+    std::size_t take_free_bit() noexcept
+    {
+        for (std::size_t w = first_free_word_; ; ++w)
+        {
+            SFL_ASSERT(w < num_words(num_blocks_));
+
+            // Acquire pairs with release in push_remote. Block freed by other
+            // thread can be handed out again.
+            const std::uint64_t free_bits = ~used_[w].load(std::memory_order_acquire);
+
+            if (free_bits != 0)
+            {
+                const std::size_t bit = count_trailing_zeros(free_bits);
+                used_[w].fetch_or(std::uint64_t(1) << bit, std::memory_order_relaxed);
+                first_free_word_ = static_cast<std::uint32_t>(w);
+                return w * bits_per_word + bit;
+            }
+        }
+    }
+
+    /// Returns block into bitmap. Returns false if block was not used.
+    ///
+    bool clear_used_bit(std::size_t block_idx) noexcept
+    {
+        const std::uint64_t mask = std::uint64_t(1) << (block_idx % bits_per_word);
+
+        const std::uint64_t old = used_[block_idx / bits_per_word].fetch_and(~mask, std::memory_order_release);
+
+        return (old & mask) != 0;
+    }
+
+    /// Returns true if no block in range [first, last] of bitmap bucket is
+    /// used. Blocks freed by other threads and not yet collected are free.
+    ///
+    bool is_free_range(std::size_t first, std::size_t last) const noexcept
+    {
+        for (std::size_t w = first / bits_per_word; w <= last / bits_per_word; ++w)
+        {
+            std::uint64_t mask = ~std::uint64_t(0);
+            if (w == first / bits_per_word)
+            {
+                mask &= ~std::uint64_t(0) << (first % bits_per_word);
+            }
+            if (w == last / bits_per_word)
+            {
+                mask &= ~std::uint64_t(0) >> (bits_per_word - 1 - last % bits_per_word);
+            }
+            if ((used_[w].load(std::memory_order_acquire) & mask) != 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Sorts embedded list of `n` blocks beginning with `head` by block
+    /// index (merge sort). Returns the new head.
+    ///
+    std::uint32_t sort_unused(std::uint32_t head, std::size_t n) noexcept
+    {
+        if (n < 2)
+        {
+            return head;
+        }
+
+        // Split after the first half.
+        std::uint32_t last = head;
+        for (std::size_t i = 1; i < n / 2; ++i)
+        {
+            last = load_node(last);
+        }
+        std::uint32_t a = head;
+        std::uint32_t b = load_node(last);
+        store_node(last, num_blocks_);
+
+        a = sort_unused(a, n / 2);
+        b = sort_unused(b, n - n / 2);
+
+        // Merge.
+        head = num_blocks_;
+        std::uint32_t tail = num_blocks_;
+
+        while (a != num_blocks_ && b != num_blocks_)
+        {
+            std::uint32_t& x = a < b ? a : b;
+            const std::uint32_t next = load_node(x);
+            if (tail == num_blocks_)
+            {
+                head = x;
+            }
+            else
+            {
+                store_node(tail, x);
+            }
+            tail = x;
+            x = next;
+        }
+
+        store_node(tail, a != num_blocks_ ? a : b);
+
+        return head;
+    }
+
+    /// Sorts embedded list of list bucket, so that allocations are packed at
+    /// the beginning of the bucket, and lowers the watermark to one past the
+    /// highest used block. Unused blocks above it are removed from the list
+    /// and are handed out as never used blocks again.
+    ///
+    void lower_watermark() noexcept
+    {
+        const std::size_t num_unused = num_touched_blocks_ - num_used_blocks_;
+
+        first_unused_block_ = sort_unused(first_unused_block_, num_unused);
+
+        // Unused blocks from position k on are at the top of touched blocks
+        // if their number equals the number of blocks from the first of them
+        // to the watermark.
+        std::uint32_t prev = num_blocks_;
+        std::uint32_t i = first_unused_block_;
+
+        for (std::size_t k = 0; i != num_blocks_; ++k)
+        {
+            if (num_unused - k == num_touched_blocks_ - i)
+            {
+                if (prev == num_blocks_)
+                {
+                    first_unused_block_ = num_blocks_;
+                }
+                else
+                {
+                    store_node(prev, num_blocks_);
+                }
+                num_touched_blocks_ = i;
+                return;
+            }
+            prev = i;
+            i = load_node(i);
+        }
+    }
+
+public:
+
+    /// Maps memory for new bucket of the given size, constructs the header
+    /// in it and adds the bucket into bucket map. No effects if throws.
+    ///
+    static bucket* create(std::size_t size, std::size_t block_size, std::size_t size_class, std::size_t node,
+                          fixed_size_allocator* owner)
+    {
+        bool huge = false;
+        bool dirty = false;
+        void* p = size == SFL_BUCKET_SIZE
+                ? arena::instance().acquire(huge, dirty, node)        // Can throw.
+                : arena::instance().acquire_large(size, dirty, node); // Can throw.
+        bucket* b = ::new (p) bucket(size, block_size, size_class, huge, dirty, node, owner);
+        try
+        {
+            bucket_map::insert(b, size); // Can throw. No effects if throws.
+        }
+        catch (...)
+        {
+            b->release_memory();
+            throw;
+        }
+        return b;
+    }
+
+    /// Unmaps bucket memory. Bucket must be empty.
+    ///
+    void destroy() noexcept
+    {
+        SFL_ASSERT(num_used_blocks_ == 0);
+        SFL_ASSERT(remote_first_.load(std::memory_order_relaxed) == num_blocks_);
+        SFL_ASSERT(num_remote_.load(std::memory_order_relaxed) == 0);
+        discard();
+    }
+
+    /// Unmaps bucket memory even if some blocks are still in use.
+    ///
+    void discard() noexcept
+    {
+        bucket_map::erase(this, size_);
+        release_memory();
+    }
+
+    /// Returns bucket memory. Bucket must not be in bucket map.
+    ///
+    void release_memory() noexcept
+    {
+        const std::size_t size = size_;
+        const bool huge = huge_;
+        const std::size_t node = node_;
+        this->~bucket();
+        if (size == SFL_BUCKET_SIZE)
+        {
+            arena::instance().release(static_cast<void*>(this), huge, node);
+        }
+        else
+        {
+            arena::instance().release_large(static_cast<void*>(this), size, node);
+        }
+    }
+
+    /// Returns the bucket that contains the given block. Pointer must have
+    /// been allocated from bucket of the given size (see bucket_size_of).
+    ///
+    static bucket* from_pointer(void* p, std::size_t size) noexcept
+    {
+        return reinterpret_cast<bucket*>
+        (
+            std::uintptr_t(p) & ~std::uintptr_t(size - 1)
+        );
+    }
+
+    bucket* prev() const noexcept
+    {
+        return prev_;
+    }
+
+    bucket* next() const noexcept
+    {
+        return next_;
+    }
+
+    /// Inserts this bucket before `*head` in intrusive list.
+    ///
+    void link(bucket*& head) noexcept
+    {
+        SFL_ASSERT(prev_ == nullptr && next_ == nullptr);
+        next_ = head;
+        if (head != nullptr)
+        {
+            head->prev_ = this;
+        }
+        head = this;
+    }
+
+    /// Removes this bucket from intrusive list whose first element is `head`.
+    ///
+    void unlink(bucket*& head) noexcept
+    {
+        if (prev_ != nullptr)
+        {
+            prev_->next_ = next_;
+        }
+        else
+        {
+            SFL_ASSERT(head == this);
+            head = next_;
+        }
+        if (next_ != nullptr)
+        {
+            next_->prev_ = prev_;
+        }
+        prev_ = nullptr;
+        next_ = nullptr;
+    }
+
+    std::size_t block_size() const noexcept
+    {
+        return block_size_;
+    }
+
+    bool is_bitmap() const noexcept
+    {
+        return used_ != nullptr;
+    }
+
+    std::size_t node() const noexcept
+    {
+        return node_;
+    }
+
+    /// Size of bucket memory.
+    ///
+    std::size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    std::size_t size_class() const noexcept
+    {
+        return size_class_;
+    }
+
+    fixed_size_allocator* owner() const noexcept
+    {
+        return owner_;
+    }
+
+    bucket* remote_next() const noexcept
+    {
+        return remote_next_;
+    }
+
+    void set_remote_next(bucket* b) noexcept
+    {
+        remote_next_ = b;
+    }
+
+    std::size_t num_blocks() const noexcept
+    {
+        return num_blocks_;
+    }
+
+    std::size_t num_used_blocks() const noexcept
+    {
+        return num_used_blocks_;
+    }
+
+    /// Index of the occupancy bin in which the bucket is linked.
+    /// Maintained by the owning fixed_size_allocator.
+    ///
+    std::size_t bin() const noexcept
+    {
+        return bin_;
+    }
+
+    void set_bin(std::size_t bin) noexcept
+    {
+        bin_ = static_cast<std::uint8_t>(bin);
+    }
+
+    void* allocate() noexcept
+    {
+        SFL_ASSERT(num_used_blocks_ < num_blocks_);
+
+        std::size_t block_idx;
+
+        if (is_bitmap())
+        {
+            block_idx = take_free_bit();
+        }
+        else if (first_unused_block_ != num_blocks_)
+        {
+            // Reuse previously deallocated block.
+            block_idx = first_unused_block_;
+            first_unused_block_ = load_node(block_idx);
+        }
+        else
+        {
+            // Hand out never used block. Bump the watermark.
+            SFL_ASSERT(num_touched_blocks_ < num_blocks_);
+            block_idx = num_touched_blocks_;
+            ++num_touched_blocks_;
+        }
+
+        ++num_used_blocks_;
+
+        return static_cast<void*>(data() + block_idx * block_size_);
+    }
+
+    /// Allocates up to `n` blocks and stores them into `out`.
+    /// Returns number of allocated blocks.
+    ///
+    std::size_t allocate_bulk(std::size_t n, void** out) noexcept
+    {
+        const std::size_t k = std::min(n, std::size_t(num_blocks_ - num_used_blocks_));
+
+        std::size_t i = 0;
+
+        if (is_bitmap())
+        {
+            for (; i < k; ++i)
+            {
+                out[i] = static_cast<void*>(data() + take_free_bit() * block_size_);
+            }
+        }
+
+        // Reuse previously deallocated blocks.
+        while (i < k && first_unused_block_ != num_blocks_)
+        {
+            const std::size_t block_idx = first_unused_block_;
+            first_unused_block_ = load_node(block_idx);
+            out[i] = static_cast<void*>(data() + block_idx * block_size_);
+            ++i;
+        }
+
+        // Hand out never used blocks. Bump the watermark.
+        while (i < k)
+        {
+            SFL_ASSERT(num_touched_blocks_ < num_blocks_);
+            out[i] = static_cast<void*>(data() + num_touched_blocks_ * block_size_);
+            ++num_touched_blocks_;
+            ++i;
+        }
+
+        num_used_blocks_ += k;
+
+        return k;
+    }
+
+    void deallocate(void* p) noexcept
+    {
+        SFL_ASSERT(num_used_blocks_ > 0);
+
+        const std::size_t block_idx = index_of(p);
+
+        if (is_bitmap())
+        {
+            // Double free check is one bit test.
+            check_free(clear_used_bit(block_idx), p);
+
+            --num_used_blocks_;
+
+            if (block_idx / bits_per_word < first_free_word_)
+            {
+                first_free_word_ = static_cast<std::uint32_t>(block_idx / bits_per_word);
+            }
+
+            return;
+        }
+
+        SFL_ASSERT(block_idx < num_touched_blocks_);
+
+        --num_used_blocks_;
+
+        if (num_used_blocks_ == 0)
+        {
+            // Bucket is empty. Start again from the beginning so that future
+            // allocations are packed at the start of the bucket.
+            first_unused_block_ = num_blocks_;
+            num_dirty_blocks_ = std::max(num_dirty_blocks_, num_touched_blocks_);
+            num_touched_blocks_ = 0;
+            return;
+        }
+
+        store_node(block_idx, first_unused_block_);
+
+        first_unused_block_ = block_idx;
+    }
+
+    /// Pushes block into remote free list. Can be called by any thread,
+    /// concurrently with the owner. Returns true if the list was empty, in
+    /// which case the caller must hand the bucket over to the owner.
+    ///
+    bool push_remote(void* p) noexcept
+    {
+        const std::uint32_t block_idx = static_cast<std::uint32_t>(index_of(p));
+
+        if (is_bitmap())
+        {
+            // Block is free for the owner as soon as its bit is cleared. It
+            // stays counted as used until collected, so the bucket cannot be
+            // destroyed before the count below is incremented.
+            check_free(clear_used_bit(block_idx), p);
+
+            return num_remote_.fetch_add(1, std::memory_order_acq_rel) == 0;
+        }
+
+        std::uint32_t head = remote_first_.load(std::memory_order_relaxed);
+
+        // Acquire pairs with collect_remote, which reads remote_next_ of
+        // the bucket before the list is taken. The pusher that finds the
+        // list empty writes remote_next_ again.
+        do
+        {
+            store_node(block_idx, head);
+        }
+        while (!remote_first_.compare_exchange_weak(head, block_idx,
+                                                    std::memory_order_acq_rel,
+                                                    std::memory_order_relaxed));
+
+        return head == num_blocks_;
+    }
+
+    /// Takes all blocks from remote free list and deallocates them.
+    /// Called only by the owner. Returns number of deallocated blocks.
+    ///
+    std::size_t collect_remote() noexcept
+    {
+        if (is_bitmap())
+        {
+            const std::size_t n = num_remote_.exchange(0, std::memory_order_acq_rel);
+            num_used_blocks_ -= static_cast<std::uint32_t>(n);
+            first_free_word_ = 0;
+            return n;
+        }
+
+        std::uint32_t block_idx = remote_first_.exchange(num_blocks_, std::memory_order_acq_rel);
+
+        std::size_t n = 0;
+
+        while (block_idx != num_blocks_)
+        {
+            const std::uint32_t next = load_node(block_idx);
+            deallocate(data() + block_idx * block_size_);
+            block_idx = next;
+            ++n;
+        }
+
+        return n;
+    }
+
+    #if SFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK
+
+    /// Marks block as allocated by user.
+    ///
+    void mark_live(void* p) noexcept
+    {
+        const std::size_t block_idx = index_of(p);
+        const std::uint64_t mask = std::uint64_t(1) << (block_idx % bits_per_word);
+        const std::uint64_t old = live_[block_idx / bits_per_word].fetch_or(mask, std::memory_order_relaxed);
+        check_free((old & mask) == 0, p);
+    }
+
+    /// Marks block as deallocated by user. Aborts if it is not live.
+    ///
+    void mark_free(void* p) noexcept
+    {
+        const std::size_t block_idx = index_of(p);
+        const std::uint64_t mask = std::uint64_t(1) << (block_idx % bits_per_word);
+        const std::uint64_t old = live_[block_idx / bits_per_word].fetch_and(~mask, std::memory_order_relaxed);
+        check_free((old & mask) != 0, p);
+    }
+
+    #endif
+
+    /// Stores pointers to all used blocks into `out` in address order and
+    /// returns their number. Sorts embedded list of list bucket. Remote free
+    /// list must be empty.
+    ///
+    std::size_t used_blocks(void** out) noexcept
+    {
+        std::size_t n = 0;
+
+        if (is_bitmap())
+        {
+            for (std::size_t w = 0; w < num_words(num_blocks_); ++w)
+            {
+                std::uint64_t bits = used_[w].load(std::memory_order_acquire);
+
+                // Bits above the last block are always set.
+                if ((w + 1) * bits_per_word > num_blocks_)
+                {
+                    bits &= ~(~std::uint64_t(0) << (num_blocks_ % bits_per_word));
+                }
+
+                while (bits != 0)
+                {
+                    out[n++] = data() + (w * bits_per_word + count_trailing_zeros(bits)) * block_size_;
+                    bits &= bits - 1;
+                }
+            }
+
+            return n;
+        }
+
+        SFL_ASSERT(remote_first_.load(std::memory_order_relaxed) == num_blocks_);
+
+        first_unused_block_ = sort_unused(first_unused_block_, num_touched_blocks_ - num_used_blocks_);
+
+        std::uint32_t unused = first_unused_block_;
+
+        for (std::uint32_t i = 0; i < num_touched_blocks_; ++i)
+        {
+            if (i == unused)
+            {
+                unused = load_node(i);
+            }
+            else
+            {
+                out[n++] = data() + i * block_size_;
+            }
+        }
+
+        return n;
+    }
+
+    /// Returns physical memory of pages that hold only free blocks to the
+    /// operating system. Pages stay mapped and are faulted in again when
+    /// their blocks are allocated. Returns number of purged bytes.
+    ///
+    /// Bitmap bucket tracks free blocks outside of blocks, so every such page
+    /// is purged. List bucket links free blocks through blocks themselves,
+    /// so only pages above the lowered watermark are purged, up to the
+    /// highest block ever written. Other threads may push blocks into remote
+    /// free list meanwhile. Such blocks are still counted as used, so they
+    /// are below the watermark and their pages are not purged.
+    ///
+    /// Bucket backed by explicit huge pages is not purged.
+    ///
+    std::size_t purge_free_pages() noexcept
+    {
+        if (huge_)
+        {
+            return 0;
+        }
+
+        const std::size_t page = page_size();
+
+        const auto round_up = [page](std::uintptr_t x)
+        {
+            return (x + page - 1) / page * page;
+        };
+
+        const std::uintptr_t begin = std::uintptr_t(data());
+        const std::uintptr_t bucket_end = std::uintptr_t(this) + size_;
+
+        std::size_t n = 0;
+
+        if (!is_bitmap())
+        {
+            const std::size_t num_dirty = std::max(num_dirty_blocks_, num_touched_blocks_);
+
+            const std::uintptr_t end = std::min(round_up(begin + num_dirty * block_size_), bucket_end);
+
+            lower_watermark();
+
+            num_dirty_blocks_ = num_touched_blocks_;
+
+            const std::uintptr_t first = round_up(begin + num_touched_blocks_ * block_size_);
+
+            if (first < end)
+            {
+                reset_pages(reinterpret_cast<void*>(first), end - first);
+                n = end - first;
+            }
+
+            return n;
+        }
+
+        const std::uintptr_t end = std::min(round_up(begin + num_blocks_ * block_size_), bucket_end);
+
+        // Adjacent free pages are purged as one run.
+        std::uintptr_t run = 0;
+
+        for (std::uintptr_t a = round_up(begin); a < end; a += page)
+        {
+            const std::size_t first = (a - begin) / block_size_;
+            const std::size_t last = std::min(std::size_t(num_blocks_), (a + page - begin + block_size_ - 1) / block_size_) - 1;
+
+            const bool free = first > last || is_free_range(first, last);
+
+            if (free && run == 0)
+            {
+                run = a;
+            }
+            else if (!free && run != 0)
+            {
+                reset_pages(reinterpret_cast<void*>(run), a - run);
+                n += a - run;
+                run = 0;
+            }
+        }
+
+        if (run != 0)
+        {
+            reset_pages(reinterpret_cast<void*>(run), end - run);
+            n += end - run;
+        }
+
+        return n;
+    }
+
+    bool is_empty() const noexcept
+    {
+        return num_used_blocks_ == 0;
+    }
+
+    bool is_full() const noexcept
+    {
+        return num_used_blocks_ == num_blocks_;
+    }
+
+    bool contains(void* p) const noexcept
+    {
+        return p >= data() && p < data() + num_blocks_ * block_size_;
+    }
+};
+
+/// Sampling heap profiler of pooled allocations. See
+/// sfl::pool_start_heap_profiler.
+///
+/// Every thread counts down bytes it allocates. When the countdown drops
+/// below zero, the allocation is sampled and the next countdown is drawn
+/// from exponential distribution with mean equal to sample period, so that
+/// every allocated byte has the same chance to be sampled. Unsampled
+/// allocation costs one decrement of thread-local counter. Deallocation
+/// costs one relaxed load while no block is tracked.
+///
+/// Sampled blocks are kept in hash table with intrusive chains until they
+/// are deallocated. Mutex of profiler is the innermost lock: nothing is
+/// allocated or deallocated while it is held, so blocks can be forgotten
+/// with lock of a pool held. Recording a sample allocates, so allocations
+/// are sampled only where no lock of a pool is held.
+///
+class heap_profiler
+{
+private:
+
+    static constexpr std::size_t max_depth = 64;
+
+    /// Frames of capture_stack, record and sample are not reported.
+    static constexpr int num_skipped_frames = 3;
+
+    static constexpr std::size_t num_record_heads = std::size_t(1) << 16;
+
+    static constexpr std::size_t num_stack_heads = 4096;
+
+    /// Countdown of thread that does not sample. Thread notices that
+    /// profiler has been started after allocating this many bytes.
+    static constexpr std::ptrdiff_t idle_countdown = 1024 * 1024;
+
+    /// Allocation site with its totals.
+    struct stack_node
+    {
+        stack_node* next;
+        std::size_t hash;
+        std::size_t depth;
+        void* frames[max_depth];
+        std::uint64_t num_live;
+        std::uint64_t live_bytes;
+        std::uint64_t num_allocated;
+        std::uint64_t allocated_bytes;
+    };
+
+    /// Sampled block that is still in use.
+    struct record
+    {
+        record* next;
+        void* block;
+        std::size_t size;
+        stack_node* stack;
+    };
+
+    /// Bytes the calling thread allocates before the next sample.
+    static thread_local std::ptrdiff_t countdown_;
+
+    /// State of the calling thread's random generator. Zero until seeded.
+    static thread_local std::uint64_t random_;
+
+    /// True while the calling thread records sample. Allocations made by
+    /// profiler itself are not sampled.
+    static thread_local bool busy_;
+
+    /// Mean number of bytes between samples. Zero if profiler is stopped.
+    static std::atomic<std::size_t> period_;
+
+    /// Number of tracked blocks.
+    static std::atomic<std::size_t> num_records_;
+
+    /// Heads of chains of tracked blocks. Read without lock to find out
+    /// quickly that block is not tracked. Allocated by the first start,
+    /// published with release and never freed.
+    static std::atomic<std::atomic<record*>*> record_heads_;
+
+    std::mutex mutex_;
+
+    stack_node* stack_heads_[num_stack_heads];
+
+    std::size_t num_stacks_;
+
+    /// Records of deallocated blocks, reused by following samples.
+    record* free_records_;
+
+    heap_profiler() noexcept
+        : num_stacks_(0)
+        , free_records_(nullptr)
+    {
+        for (std::size_t i = 0; i < num_stack_heads; ++i)
+        {
+            stack_heads_[i] = nullptr;
+        }
+    }
+
+    static heap_profiler& instance() noexcept
+    {
+        alignas(heap_profiler) static unsigned char storage[sizeof(heap_profiler)];
+        static heap_profiler* instance = ::new (static_cast<void*>(storage)) heap_profiler();
+        return *instance;
+    }
+
+    static std::size_t record_hash(const void* p) noexcept
+    {
+        const std::uint64_t h = (std::uint64_t(std::uintptr_t(p)) >> 4) * 0x9E3779B97F4A7C15ULL;
+        return std::size_t(h >> 48) & (num_record_heads - 1);
+    }
+
+    static std::size_t stack_hash(void* const* frames, std::size_t depth) noexcept
+    {
+        std::uint64_t h = 0xCBF29CE484222325ULL;
+        for (std::size_t i = 0; i < depth; ++i)
+        {
+            h = (h ^ std::uint64_t(std::uintptr_t(frames[i]))) * 0x100000001B3ULL;
+        }
+        return std::size_t(h ^ (h >> 32));
+    }
+
+    /// Returns random number from exponential distribution with the given
+    /// mean, at least 1.
+    static std::ptrdiff_t next_countdown(std::size_t mean) noexcept
+    {
+        // xorshift64*
+        random_ ^= random_ >> 12;
+        random_ ^= random_ << 25;
+        random_ ^= random_ >> 27;
+        const std::uint64_t r = random_ * 0x2545F4914F6CDD1DULL;
+
+        // Uniform in (0, 1].
+        const double u = (double(r >> 11) + 1.0) * (1.0 / 9007199254740992.0);
+
+        const double x = -std::log(u) * double(mean);
+
+        return x < 1.0 ? 1 : x > double(PTRDIFF_MAX / 2) ? PTRDIFF_MAX / 2 : std::ptrdiff_t(x);
+    }
+
+    SFL_POOL_ALLOCATOR_NOINLINE
+    static std::size_t capture_stack(void** frames) noexcept
+    {
+        #if defined(__GLIBC__)
+        return std::size_t(::backtrace(frames, int(max_depth)));
+        #else
+        (void)frames;
+        return 0;
+        #endif
+    }
+
+    /// Returns heads of chains of tracked blocks, or nullptr if profiler has
+    /// never been started.
+    ///
+    static std::atomic<record*>* record_heads() noexcept
+    {
+        return record_heads_.load(std::memory_order_acquire);
+    }
+
+    /// Unlinks record of the given block. Returns nullptr if the block is
+    /// not tracked. Mutex must be locked.
+    record* unlink_record(const void* p) noexcept
+    {
+        std::atomic<record*>& head = record_heads()[record_hash(p)];
+
+        record* prev = nullptr;
+
+        for (record* r = head.load(std::memory_order_relaxed); r != nullptr; r = r->next)
+        {
+            if (r->block == p)
+            {
+                if (prev == nullptr)
+                {
+                    head.store(r->next, std::memory_order_relaxed);
+                }
+                else
+                {
+                    prev->next = r->next;
+                }
+                return r;
+            }
+            prev = r;
+        }
+
+        return nullptr;
+    }
+
+    void link_record(record* r) noexcept
+    {
+        std::atomic<record*>& head = record_heads()[record_hash(r->block)];
+        r->next = head.load(std::memory_order_relaxed);
+        head.store(r, std::memory_order_relaxed);
+    }
+
+    /// Stops tracking record. Mutex must be locked.
+    void drop_record(record* r) noexcept
+    {
+        r->stack->num_live -= 1;
+        r->stack->live_bytes -= r->size;
+        r->next = free_records_;
+        free_records_ = r;
+        num_records_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    SFL_POOL_ALLOCATOR_NOINLINE
+    void record_sample(void* p, std::size_t size) noexcept
+    {
+        void* frames[max_depth + num_skipped_frames];
+
+        std::size_t depth = capture_stack(frames);
+        std::size_t first = 0;
+
+        if (depth > std::size_t(num_skipped_frames))
+        {
+            first = num_skipped_frames;
+            depth -= num_skipped_frames;
+        }
+
+        if (depth > max_depth)
+        {
+            depth = max_depth;
+        }
+
+        const std::size_t hash = stack_hash(frames + first, depth);
+
+        stack_node* fresh = nullptr;
+        record* spare = nullptr;
+
+        // Nothing is allocated with mutex locked. Missing nodes are allocated
+        // between attempts.
+        for (;;)
+        {
+            bool need_stack = false;
+            bool need_record = false;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                if (period_.load(std::memory_order_relaxed) == 0)
+                {
+                    break;
+                }
+
+                stack_node*& head = stack_heads_[hash % num_stack_heads];
+
+                stack_node* s = head;
+
+                while (s != nullptr &&
+                       (s->hash != hash || s->depth != depth ||
+                        std::memcmp(s->frames, frames + first, depth * sizeof(void*)) != 0))
+                {
+                    s = s->next;
+                }
+
+                if (s == nullptr && fresh != nullptr)
+                {
+                    s = fresh;
+                    fresh = nullptr;
+                    s->next = head;
+                    s->hash = hash;
+                    s->depth = depth;
+                    std::memcpy(s->frames, frames + first, depth * sizeof(void*));
+                    s->num_live = 0;
+                    s->live_bytes = 0;
+                    s->num_allocated = 0;
+                    s->allocated_bytes = 0;
+                    head = s;
+                    ++num_stacks_;
+                }
+
+                record* r = free_records_;
+
+                if (r != nullptr)
+                {
+                    free_records_ = r->next;
+                }
+                else
+                {
+                    r = spare;
+                    spare = nullptr;
+                }
+
+                if (s != nullptr && r != nullptr)
+                {
+                    r->block = p;
+                    r->size = size;
+                    r->stack = s;
+                    link_record(r);
+                    num_records_.fetch_add(1, std::memory_order_relaxed);
+                    s->num_live += 1;
+                    s->live_bytes += size;
+                    s->num_allocated += 1;
+                    s->allocated_bytes += size;
+                    break;
+                }
+
+                if (r != nullptr)
+                {
+                    r->next = free_records_;
+                    free_records_ = r;
+                }
+
+                need_stack = s == nullptr;
+                need_record = r == nullptr;
+            }
+
+            if (need_stack && fresh == nullptr)
+            {
+                fresh = new (std::nothrow) stack_node;
+            }
+
+            if (need_record && spare == nullptr)
+            {
+                spare = new (std::nothrow) record;
+            }
+
+            if ((need_stack && fresh == nullptr) || (need_record && spare == nullptr))
+            {
+                // Out of memory. Sample is lost.
+                break;
+            }
+        }
+
+        delete fresh;
+        delete spare;
+    }
+
+    SFL_POOL_ALLOCATOR_NOINLINE
+    static void sample(void* p, std::size_t size) noexcept
+    {
+        const std::size_t period = period_.load(std::memory_order_relaxed);
+
+        if (period == 0 || busy_)
+        {
+            countdown_ = idle_countdown;
+            return;
+        }
+
+        if (random_ == 0)
+        {
+            // The first countdown of thread. Seeded by address of
+            // thread-local variable and time.
+            random_ = (std::uint64_t(std::uintptr_t(&random_)) * 0x9E3779B97F4A7C15ULL) ^
+                      std::uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+            if (random_ == 0)
+            {
+                random_ = 1;
+            }
+            countdown_ = next_countdown(period);
+            return;
+        }
+
+        countdown_ = next_countdown(period);
+
+        busy_ = true;
+        instance().record_sample(p, size);
+        busy_ = false;
+    }
+
+    SFL_POOL_ALLOCATOR_NOINLINE
+    static void forget(void* p) noexcept
+    {
+        std::atomic<record*>* heads = record_heads();
+
+        if (heads == nullptr || heads[record_hash(p)].load(std::memory_order_relaxed) == nullptr)
+        {
+            return;
+        }
+
+        heap_profiler& hp = instance();
+
+        std::lock_guard<std::mutex> lock(hp.mutex_);
+
+        if (record* r = hp.unlink_record(p))
+        {
+            hp.drop_record(r);
+        }
+    }
+
+public:
+
+    /// Locks profiler before fork. See small_size_allocator_singleton::lock_all.
+    ///
+    static void lock() noexcept
+    {
+        instance().mutex_.lock();
+    }
+
+    static void unlock() noexcept
+    {
+        instance().mutex_.unlock();
+    }
+
+    /// Called after block of the given requested size is allocated for user.
+    /// No lock of a pool may be held.
+    ///
+    static void on_allocate(void* p, std::size_t size) noexcept
+    {
+        #if SFL_POOL_ALLOCATOR_HEAP_PROFILER
+        countdown_ -= std::ptrdiff_t(size);
+        if (countdown_ < 0)
+        {
+            sample(p, size);
+        }
+        #else
+        (void)p;
+        (void)size;
+        #endif
+    }
+
+    /// Called before block is deallocated by user.
+    ///
+    static void on_deallocate(void* p) noexcept
+    {
+        #if SFL_POOL_ALLOCATOR_HEAP_PROFILER
+        if (num_records_.load(std::memory_order_relaxed) != 0)
+        {
+            forget(p);
+        }
+        #else
+        (void)p;
+        #endif
+    }
+
+    /// Called when compaction moves block from `from` to `to`.
+    ///
+    static void on_move(void* from, void* to) noexcept
+    {
+        if (num_records_.load(std::memory_order_relaxed) == 0 || record_heads() == nullptr)
+        {
+            return;
+        }
+
+        heap_profiler& hp = instance();
+
+        std::lock_guard<std::mutex> lock(hp.mutex_);
+
+        if (record* r = hp.unlink_record(from))
+        {
+            r->block = to;
+            hp.link_record(r);
+        }
+    }
+
+    /// Stops tracking blocks for which `owned(p)` returns true. Called
+    /// before pool releases its buckets with blocks still in use.
+    ///
+    template <typename Predicate>
+    static void on_release(Predicate owned) noexcept
+    {
+        if (num_records_.load(std::memory_order_relaxed) == 0 || record_heads() == nullptr)
+        {
+            return;
+        }
+
+        heap_profiler& hp = instance();
+
+        std::lock_guard<std::mutex> lock(hp.mutex_);
+
+        for (std::size_t i = 0; i < num_record_heads; ++i)
+        {
+            record* r = record_heads()[i].load(std::memory_order_relaxed);
+            while (r != nullptr)
+            {
+                record* next = r->next;
+                if (owned(r->block))
+                {
+                    hp.unlink_record(r->block);
+                    hp.drop_record(r);
+                }
+                r = next;
+            }
+        }
+    }
+
+    /// Starts sampling or changes sample period. Can throw std::bad_alloc.
+    ///
+    static void start(std::size_t sample_period)
+    {
+        SFL_ASSERT(sample_period > 0);
+
+        heap_profiler& hp = instance();
+
+        // Loads unwinder, which allocates, before the first sample.
+        void* frames[max_depth];
+        busy_ = true;
+        capture_stack(frames);
+        busy_ = false;
+
+        std::unique_ptr<std::atomic<record*>[]> heads;
+
+        if (record_heads() == nullptr)
+        {
+            heads.reset(new std::atomic<record*>[num_record_heads]); // Can throw.
+            for (std::size_t i = 0; i < num_record_heads; ++i)
+            {
+                heads[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(hp.mutex_);
+
+        if (record_heads() == nullptr)
+        {
+            record_heads_.store(heads.release(), std::memory_order_release);
+        }
+
+        period_.store(sample_period, std::memory_order_relaxed);
+    }
+
+    /// Stops sampling and drops all samples.
+    ///
+    static void stop() noexcept
+    {
+        heap_profiler& hp = instance();
+
+        stack_node* stacks = nullptr;
+        record* records = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(hp.mutex_);
+
+            period_.store(0, std::memory_order_relaxed);
+
+            if (record_heads() == nullptr)
+            {
+                return;
+            }
+
+            for (std::size_t i = 0; i < num_record_heads; ++i)
+            {
+                record* r = record_heads()[i].exchange(nullptr, std::memory_order_relaxed);
+                while (r != nullptr)
+                {
+                    record* next = r->next;
+                    r->next = records;
+                    records = r;
+                    r = next;
+                }
+            }
+
+            while (hp.free_records_ != nullptr)
+            {
+                record* r = hp.free_records_;
+                hp.free_records_ = r->next;
+                r->next = records;
+                records = r;
+            }
+
+            for (std::size_t i = 0; i < num_stack_heads; ++i)
+            {
+                stack_node* s = hp.stack_heads_[i];
+                while (s != nullptr)
+                {
+                    stack_node* next = s->next;
+                    s->next = stacks;
+                    stacks = s;
+                    s = next;
+                }
+                hp.stack_heads_[i] = nullptr;
+            }
+
+            hp.num_stacks_ = 0;
+            num_records_.store(0, std::memory_order_relaxed);
+        }
+
+        // Freed without lock. Profiler's own blocks are never tracked.
+        while (records != nullptr)
+        {
+            record* next = records->next;
+            delete records;
+            records = next;
+        }
+
+        while (stacks != nullptr)
+        {
+            stack_node* next = stacks->next;
+            delete stacks;
+            stacks = next;
+        }
+    }
+
+    /// Returns profile in legacy text format of pprof heap profile. Can
+    /// throw std::bad_alloc.
+    ///
+    static std::string profile()
+    {
+        heap_profiler& hp = instance();
+
+        std::vector<stack_node> stacks;
+        std::size_t period = 0;
+
+        // Snapshot is taken without allocating with mutex locked.
+        for (bool done = false; !done;)
+        {
+            std::size_t n;
+            {
+                std::lock_guard<std::mutex> lock(hp.mutex_);
+                n = hp.num_stacks_;
+            }
+
+            stacks.resize(n); // Can throw.
+
+            std::lock_guard<std::mutex> lock(hp.mutex_);
+
+            if (hp.num_stacks_ == n)
+            {
+                std::size_t k = 0;
+                for (std::size_t i = 0; i < num_stack_heads; ++i)
+                {
+                    for (const stack_node* s = hp.stack_heads_[i]; s != nullptr; s = s->next)
+                    {
+                        stacks[k++] = *s;
+                    }
+                }
+                period = period_.load(std::memory_order_relaxed);
+                done = true;
+            }
+        }
+
+        std::uint64_t num_live = 0;
+        std::uint64_t live_bytes = 0;
+        std::uint64_t num_allocated = 0;
+        std::uint64_t allocated_bytes = 0;
+
+        for (const stack_node& s : stacks)
+        {
+            num_live += s.num_live;
+            live_bytes += s.live_bytes;
+            num_allocated += s.num_allocated;
+            allocated_bytes += s.allocated_bytes;
+        }
+
+        std::ostringstream os;
+
+        os << "heap profile: " << num_live << ": " << live_bytes
+           << " [" << num_allocated << ": " << allocated_bytes << "]"
+           << " @ heap_v2/" << period << "\n";
+
+        for (const stack_node& s : stacks)
+        {
+            os << s.num_live << ": " << s.live_bytes
+               << " [" << s.num_allocated << ": " << s.allocated_bytes << "] @";
+
+            for (std::size_t i = 0; i < s.depth; ++i)
+            {
+                os << " 0x" << std::hex << std::uintptr_t(s.frames[i]) << std::dec;
+            }
+
+            os << "\n";
+        }
+
+        #if defined(__linux__)
+        // Mappings let pprof symbolize addresses of shared libraries.
+        if (std::FILE* f = std::fopen("/proc/self/maps", "r"))
+        {
+            os << "\nMAPPED_LIBRARIES:\n";
+
+            char buffer[4096];
+            std::size_t n;
+            while ((n = std::fread(buffer, 1, sizeof(buffer), f)) > 0)
+            {
+                os.write(buffer, std::streamsize(n));
+            }
+
+            std::fclose(f);
+        }
+        #endif
+
+        return os.str();
+    }
+};
+
+thread_local std::ptrdiff_t heap_profiler::countdown_ = 0;
+
+thread_local std::uint64_t heap_profiler::random_ = 0;
+
+thread_local bool heap_profiler::busy_ = false;
+
+std::atomic<std::size_t> heap_profiler::period_(0);
+
+std::atomic<std::size_t> heap_profiler::num_records_(0);
+
+std::atomic<std::atomic<heap_profiler::record*>*> heap_profiler::record_heads_{nullptr};
+
+/// Marks block as allocated by user (double free checks only).
+///
+inline void mark_live(void* p, std::size_t bucket_size) noexcept
+{
+    #if SFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK
+    bucket::from_pointer(p, bucket_size)->mark_live(p);
+    #else
+    (void)p;
+    (void)bucket_size;
+    #endif
+}
+
+/// Marks block as deallocated by user (double free checks), and stops
+/// tracking it if it was sampled by heap profiler.
+///
+inline void mark_free(void* p, std::size_t bucket_size) noexcept
+{
+    #if SFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK
+    bucket::from_pointer(p, bucket_size)->mark_free(p);
+    #else
+    (void)bucket_size;
+    #endif
+    heap_profiler::on_deallocate(p);
+}
+
+class fixed_size_allocator
+{
+private:
+
+    #if SFL_POOL_ALLOCATOR_BUCKET_POLICY == SFL_POOL_ALLOCATOR_MOST_FULL
+    static constexpr std::size_t num_bins = 8;
+    #elif SFL_POOL_ALLOCATOR_BUCKET_POLICY == SFL_POOL_ALLOCATOR_FIRST_FIT
+    static constexpr std::size_t num_bins = 1;
+    #else
+    #error "Invalid value of SFL_POOL_ALLOCATOR_BUCKET_POLICY."
+    #endif
+
+    std::size_t block_size_;
+
+    /// Index of size class in the owning small_size_allocator.
+    std::size_t size_class_;
+
+    /// Size of buckets. See bucket_size_of.
+    std::size_t bucket_size_;
+
+    std::size_t node_;
+
+    /// Bucket from which blocks are allocated. It is not linked in any list.
+    bucket* current_;
+
+    /// Empty bucket kept for future allocations. It is not linked in any list.
+    bucket* empty_;
+
+    /// List of full buckets.
+    bucket* full_;
+
+    /// Lists of partially used buckets, binned by occupancy.
+    /// Bin `i` holds buckets whose occupancy is in range
+    /// [i / num_bins, (i + 1) / num_bins).
+    bucket* bins_[num_bins];
+
+    /// Buckets with non-empty remote free lists. Pushed by any thread,
+    /// taken as a whole by the owner.
+    std::atomic<bucket*> remote_buckets_;
+
+    /// Moves live blocks during compaction. Nullptr if not registered.
+    pool_relocator relocate_;
+    void* relocate_context_;
+
+    // Statistics.
+    std::size_t num_buckets_;
+    std::size_t num_blocks_;
+    std::uint64_t num_allocations_;
+    std::uint64_t num_deallocations_;
+
+private:
+
+    static std::size_t bin_of(const bucket* b) noexcept
+    {
+        return b->num_used_blocks() * num_bins / b->num_blocks();
+    }
+
+    void link_partial(bucket* b) noexcept
+    {
+        const std::size_t bin = bin_of(b);
+        b->set_bin(bin);
+        b->link(bins_[bin]);
+    }
+
+    void unlink_partial(bucket* b) noexcept
+    {
+        b->unlink(bins_[b->bin()]);
+    }
+
+    /// Takes partially used bucket according to policy, or returns nullptr
+    /// if there is no such bucket. Most full policy takes bucket from the
+    /// highest non-empty bin. First fit policy has only one bin.
+    ///
+    bucket* take_partial() noexcept
+    {
+        for (std::size_t i = num_bins; i > 0; --i)
+        {
+            bucket* b = bins_[i - 1];
+            if (b != nullptr)
+            {
+                b->unlink(bins_[i - 1]);
+                return b;
+            }
+        }
+        return nullptr;
+    }
+
+    bucket* create_bucket()
+    {
+        bucket* b = bucket::create(bucket_size_, block_size_, size_class_, node_, this); // Can throw. No effects if throws.
+        ++num_buckets_;
+        num_blocks_ += b->num_blocks();
+        return b;
+    }
+
+    void destroy_bucket(bucket* b) noexcept
+    {
+        --num_buckets_;
+        num_blocks_ -= b->num_blocks();
+        b->destroy();
+    }
+
+    void discard_list(bucket*& head) noexcept
+    {
+        while (head != nullptr)
+        {
+            bucket* b = head;
+            b->unlink(head);
+            b->discard();
+        }
+    }
+
+    /// Returns true if there is partially used bucket to allocate from.
+    ///
+    bool has_partial() const noexcept
+    {
+        if (current_ != nullptr)
+        {
+            return true;
+        }
+        for (std::size_t i = 0; i < num_bins; ++i)
+        {
+            if (bins_[i] != nullptr)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Makes sure that there is current bucket.
+    ///
+    void ensure_current()
+    {
+        if (current_ == nullptr)
+        {
+            if (remote_buckets_.load(std::memory_order_relaxed) != nullptr)
+            {
+                collect_remote();
+            }
+
+            current_ = take_partial();
+
+            if (current_ == nullptr)
+            {
+                if (empty_ != nullptr)
+                {
+                    current_ = empty_;
+                    empty_ = nullptr;
+                }
+                else
+                {
+                    current_ = create_bucket(); // Can throw. No effects if throws.
+                }
+            }
+        }
+    }
+
+    /// Moves bucket from which blocks have been deallocated into the right
+    /// list. Bucket must not be current bucket.
+    ///
+    void relink(bucket* b, bool was_full, std::size_t old_bin) noexcept
+    {
+        if (b->is_empty())
+        {
+            if (was_full)
+            {
+                b->unlink(full_);
+            }
+            else
+            {
+                unlink_partial(b);
+            }
+
+            // Keep at most one empty bucket. Larger buckets are not kept,
+            // arena retains them for a while and they do not pin memory of
+            // idle size class.
+            if (bucket_size_ != SFL_BUCKET_SIZE)
+            {
+                destroy_bucket(b);
+            }
+            else
+            {
+                if (empty_ != nullptr)
+                {
+                    destroy_bucket(empty_);
+                }
+
+                empty_ = b;
+            }
+        }
+        else if (was_full)
+        {
+            b->unlink(full_);
+            link_partial(b);
+        }
+        else if (bin_of(b) != old_bin)
+        {
+            unlink_partial(b);
+            link_partial(b);
+        }
+    }
+
+public:
+
+    void init(std::size_t block_size, std::size_t size_class, std::size_t node) noexcept
+    {
+        block_size_ = block_size;
+        size_class_ = size_class;
+        bucket_size_ = bucket_size_of(block_size);
+        node_ = node;
+        current_ = nullptr;
+        empty_ = nullptr;
+        full_ = nullptr;
+        for (std::size_t i = 0; i < num_bins; ++i)
+        {
+            bins_[i] = nullptr;
+        }
+        remote_buckets_.store(nullptr, std::memory_order_relaxed);
+        relocate_ = nullptr;
+        relocate_context_ = nullptr;
+        num_buckets_ = 0;
+        num_blocks_ = 0;
+        num_allocations_ = 0;
+        num_deallocations_ = 0;
+    }
+
+    /// Fills bucket-level statistics. Allocations and deallocations are
+    /// counted as blocks taken from and returned into buckets.
+    ///
+    void stats(pool_size_class_stats& s) const noexcept
+    {
+        s.block_size = block_size_;
+        s.num_allocations = num_allocations_;
+        s.num_deallocations = num_deallocations_;
+        s.num_buckets = num_buckets_;
+        s.num_blocks = num_blocks_;
+        s.num_used_blocks = std::size_t(num_allocations_ - num_deallocations_);
+        s.bytes_mapped = num_buckets_ * bucket_size_;
+    }
+
+    std::size_t bucket_size() const noexcept
+    {
+        return bucket_size_;
+    }
+
+    std::uint64_t num_operations() const noexcept
+    {
+        return num_allocations_ + num_deallocations_;
+    }
+
+    bool is_empty() const noexcept
+    {
+        return num_allocations_ == num_deallocations_;
+    }
+
+    /// Returns empty buckets, including the one kept for future allocations,
+    /// and purges pages of free blocks in partially used buckets. Returns
+    /// number of bytes returned to the operating system, not counting
+    /// buckets that are retained by arena.
+    ///
+    std::size_t trim() noexcept
+    {
+        if (remote_buckets_.load(std::memory_order_relaxed) != nullptr)
+        {
+            collect_remote();
+        }
+
+        std::size_t n = 0;
+
+        const std::size_t released = arena::released_bytes(bucket_size_);
+
+        if (empty_ != nullptr)
+        {
+            destroy_bucket(empty_);
+            empty_ = nullptr;
+            n += released;
+        }
+
+        if (current_ != nullptr && current_->is_empty())
+        {
+            destroy_bucket(current_);
+            current_ = nullptr;
+            n += released;
+        }
+
+        if (current_ != nullptr)
+        {
+            n += current_->purge_free_pages();
+        }
+
+        for (std::size_t i = 0; i < num_bins; ++i)
+        {
+            for (bucket* b = bins_[i]; b != nullptr; b = b->next())
+            {
+                n += b->purge_free_pages();
+            }
+        }
+
+        return n;
+    }
+
+    /// Unmaps all buckets, including those with blocks still in use, and
+    /// resets statistics.
+    ///
+    void release() noexcept
+    {
+        if (current_ != nullptr)
+        {
+            current_->discard();
+        }
+        if (empty_ != nullptr)
+        {
+            empty_->discard();
+        }
+        discard_list(full_);
+        for (std::size_t i = 0; i < num_bins; ++i)
+        {
+            discard_list(bins_[i]);
+        }
+        const pool_relocator relocate = relocate_;
+        void* const context = relocate_context_;
+        init(block_size_, size_class_, node_);
+        set_relocator(relocate, context);
+    }
+
+    void set_relocator(pool_relocator relocate, void* context) noexcept
+    {
+        relocate_ = relocate;
+        relocate_context_ = context;
+    }
+
+    /// Moves live blocks out of partially used buckets whose occupancy is
+    /// at most `max_occupancy` into other buckets, and destroys emptied
+    /// buckets. Sparsest buckets are emptied first. When there is no other
+    /// partially used bucket, the densest remaining sparse bucket takes the
+    /// blocks; no bucket is created and the empty bucket is not used. Does
+    /// nothing if no relocator is registered.
+    ///
+    /// Vectors are scratch space shared by size classes. Returns number of
+    /// bytes returned to the operating system, not counting buckets that
+    /// are retained by arena. Can throw only before any block is moved.
+    ///
+    std::size_t compact(double max_occupancy, std::vector<bucket*>& sources, std::vector<void*>& blocks)
+    {
+        if (relocate_ == nullptr)
+        {
+            return 0;
+        }
+
+        if (remote_buckets_.load(std::memory_order_relaxed) != nullptr)
+        {
+            collect_remote();
+        }
+
+        const auto is_sparse = [max_occupancy](const bucket* b)
+        {
+            return double(b->num_used_blocks()) <= max_occupancy * double(b->num_blocks());
+        };
+
+        std::size_t num_sources = 0;
+        std::size_t max_used = 0;
+
+        const auto count = [&](const bucket* b)
+        {
+            if (is_sparse(b))
+            {
+                ++num_sources;
+                max_used = std::max(max_used, b->num_used_blocks());
+            }
+        };
+
+        if (current_ != nullptr)
+        {
+            count(current_);
+        }
+
+        for (std::size_t i = 0; i < num_bins; ++i)
+        {
+            for (bucket* b = bins_[i]; b != nullptr; b = b->next())
+            {
+                count(b);
+            }
+        }
+
+        sources.clear();
+        sources.reserve(num_sources); // Can throw.
+        blocks.resize(std::max(blocks.size(), max_used)); // Can throw.
+
+        // Nothing below throws.
+
+        // Moving blocks into empty bucket would not release anything.
+        bucket* const spare = empty_;
+        empty_ = nullptr;
+
+        if (current_ != nullptr && is_sparse(current_))
+        {
+            sources.push_back(current_);
+            current_ = nullptr;
+        }
+
+        for (std::size_t i = 0; i < num_bins; ++i)
+        {
+            bucket* b = bins_[i];
+            while (b != nullptr)
+            {
+                bucket* next = b->next();
+                if (is_sparse(b))
+                {
+                    unlink_partial(b);
+                    sources.push_back(b);
+                }
+                b = next;
+            }
+        }
+
+        std::sort
+        (
+            sources.begin(),
+            sources.end(),
+            [](const bucket* a, const bucket* b)
+            {
+                return a->num_used_blocks() < b->num_used_blocks();
+            }
+        );
+
+        std::size_t released = 0;
+
+        // Sources [i, j) are unlinked. Sources at and above j are targets.
+        std::size_t i = 0;
+        std::size_t j = sources.size();
+
+        while (i < j)
+        {
+            bucket* s = sources[i];
+
+            const std::size_t n = s->used_blocks(blocks.data());
+
+            for (std::size_t k = 0; k < n; ++k)
+            {
+                if (!has_partial())
+                {
+                    if (j - 1 == i)
+                    {
+                        break;
+                    }
+                    --j;
+                    link_partial(sources[j]);
+                }
+
+                void* p = blocks[k];
+                void* q = allocate(); // Does not throw. There is partial bucket.
+
+                mark_live(q, bucket_size_);
+                relocate_(p, q, relocate_context_);
+                heap_profiler::on_move(p, q);
+                mark_free(p, bucket_size_);
+
+                s->deallocate(p);
+                ++num_deallocations_;
+            }
+
+            if (!s->is_empty())
+            {
+                break;
+            }
+
+            destroy_bucket(s);
+            ++i;
+            released += arena::released_bytes(bucket_size_);
+        }
+
+        for (; i < j; ++i)
+        {
+            bucket* s = sources[i];
+
+            if (!s->is_empty())
+            {
+                link_partial(s);
+            }
+            else if (empty_ == nullptr && bucket_size_ == SFL_BUCKET_SIZE)
+            {
+                empty_ = s;
+            }
+            else
+            {
+                destroy_bucket(s);
+                released += arena::released_bytes(bucket_size_);
+            }
+        }
+
+        if (spare != nullptr)
+        {
+            if (empty_ == nullptr && bucket_size_ == SFL_BUCKET_SIZE)
+            {
+                empty_ = spare;
+            }
+            else
+            {
+                destroy_bucket(spare);
+                released += arena::released_bytes(bucket_size_);
+            }
+        }
+
+        return released;
+    }
+
+    void* allocate()
+    {
+        ensure_current(); // Can throw. No effects if throws.
+
+        void* p = current_->allocate();
+
+        ++num_allocations_;
+
+        if (current_->is_full())
+        {
+            current_->link(full_);
+            current_ = nullptr;
+        }
+
+        return p;
+    }
+
+    void deallocate(void* p) noexcept
+    {
+        // Constant time lookup. Buckets are aligned to their size.
+        bucket* b = bucket::from_pointer(p, bucket_size_);
+
+        SFL_ASSERT(b->owner() == this);
+
+        ++num_deallocations_;
+
+        if (b == current_)
+        {
+            b->deallocate(p);
+            return;
+        }
+
+        const bool was_full = b->is_full();
+
+        const std::size_t old_bin = was_full ? 0 : b->bin();
+
+        b->deallocate(p);
+
+        relink(b, was_full, old_bin);
+    }
+
+    /// Allocates `n` blocks and stores them into `out`. Blocks are taken
+    /// from buckets in runs, and bucket lists are updated once per run.
+    /// No effects if throws.
+    ///
+    void allocate_bulk(std::size_t n, void** out)
+    {
+        std::size_t i = 0;
+
+        try
+        {
+            while (i < n)
+            {
+                ensure_current(); // Can throw.
+
+                const std::size_t k = current_->allocate_bulk(n - i, out + i);
+
+                i += k;
+                num_allocations_ += k;
+
+                if (current_->is_full())
+                {
+                    current_->link(full_);
+                    current_ = nullptr;
+                }
+            }
+        }
+        catch (...)
+        {
+            deallocate_bulk(i, out);
+            num_allocations_ -= i;
+            num_deallocations_ -= i;
+            throw;
+        }
+    }
+
+    /// Deallocates `n` blocks. Consecutive blocks from the same bucket are
+    /// returned as one run, and bucket lists are updated once per run.
+    ///
+    void deallocate_bulk(std::size_t n, void* const* blocks) noexcept
+    {
+        num_deallocations_ += n;
+
+        std::size_t i = 0;
+
+        while (i < n)
+        {
+            bucket* b = bucket::from_pointer(blocks[i], bucket_size_);
+
+            SFL_ASSERT(b->owner() == this);
+
+            const bool is_current = b == current_;
+
+            const bool was_full = !is_current && b->is_full();
+
+            const std::size_t old_bin = (is_current || was_full) ? 0 : b->bin();
+
+            do
+            {
+                b->deallocate(blocks[i]);
+                ++i;
+            }
+            while (i < n && bucket::from_pointer(blocks[i], bucket_size_) == b);
+
+            if (!is_current)
+            {
+                relink(b, was_full, old_bin);
+            }
+        }
+    }
+
+    /// Deallocates block from thread that does not own the allocator.
+    /// Lock-free. Block is pushed into remote free list of its bucket, and
+    /// bucket is handed over to the owner when that list becomes non-empty.
+    /// Returns true if bucket was handed over.
+    ///
+    static bool deallocate_remote(void* p, std::size_t bucket_size) noexcept
+    {
+        bucket* b = bucket::from_pointer(p, bucket_size);
+
+        if (b->push_remote(p))
+        {
+            // Until this push completes the owner cannot see the block, so
+            // neither the bucket nor the owner can be destroyed meanwhile.
+            fixed_size_allocator* owner = b->owner();
+
+            bucket* head = owner->remote_buckets_.load(std::memory_order_relaxed);
+
+            do
+            {
+                b->set_remote_next(head);
+            }
+            while (!owner->remote_buckets_.compare_exchange_weak(head, b,
+                                                                 std::memory_order_release,
+                                                                 std::memory_order_relaxed));
+
+            return true;
+        }
+
+        return false;
+    }
+
+    /// Returns blocks deallocated by other threads into their buckets.
+    /// Called only by the owner.
+    ///
+    void collect_remote() noexcept
+    {
+        bucket* b = remote_buckets_.exchange(nullptr, std::memory_order_acquire);
+
+        while (b != nullptr)
+        {
+            // Read the link first. Bucket can be handed over again as soon as
+            // its remote free list is taken.
+            bucket* next = b->remote_next();
+
+            const bool is_current = b == current_;
+
+            const bool was_full = !is_current && b->is_full();
+
+            const std::size_t old_bin = (is_current || was_full) ? 0 : b->bin();
+
+            num_deallocations_ += b->collect_remote();
+
+            if (!is_current)
+            {
+                relink(b, was_full, old_bin);
+            }
+
+            b = next;
+        }
+    }
+};
+
+/// Rounds block size up to size class.
+///
+/// Sizes less than quantum are rounded up to power of two. Sizes up to
+/// `quantum * groups` are rounded up to multiple of quantum. Above that,
+/// every doubling of size is split into `groups` equally spaced classes
+/// (e.g. 64, 80, 96, 112, 128, 160, 192, ... for quantum 8 and 4 groups).
+/// If groups is zero, all sizes are rounded up to multiple of quantum.
+///
+inline std::size_t round_to_size_class(std::size_t block_size) noexcept
+{
+    constexpr std::size_t quantum = SFL_POOL_ALLOCATOR_SIZE_CLASS_QUANTUM;
+    constexpr std::size_t groups = SFL_POOL_ALLOCATOR_SIZE_CLASS_GROUPS;
+
+    static_assert(quantum > 0 && (quantum & (quantum - 1)) == 0,
+                  "SFL_POOL_ALLOCATOR_SIZE_CLASS_QUANTUM must be power of two.");
+
+    static_assert((groups & (groups - 1)) == 0,
+                  "SFL_POOL_ALLOCATOR_SIZE_CLASS_GROUPS must be zero or power of two.");
+
+    if (block_size < quantum)
+    {
+        std::size_t size = 1;
+        while (size < block_size)
+        {
+            size *= 2;
+        }
+        return size;
+    }
+
+    std::size_t step = quantum;
+
+    if (groups != 0)
+    {
+        std::size_t base = quantum * groups;
+        while (base < block_size)
+        {
+            step = base / groups;
+            base *= 2;
+        }
+    }
+
+    return (block_size + step - 1) / step * step;
+}
+
+small_size_allocator::small_size_allocator(std::size_t max_block_size, std::size_t node)
+    // Round up to size class so that every size class is fully usable.
+    : max_block_size_(round_to_size_class(std::min(max_block_size, SFL_MAX_POOLED_BLOCK_SIZE)))
+    , small_max_block_size_(std::min(max_block_size_, round_to_size_class(SFL_POOL_ALLOCATOR_MAX_BLOCK_SIZE)))
+    , node_(node)
+    , num_size_classes_(0)
+    , size_class_index_(nullptr)
+    , size_class_sizes_(nullptr)
+    , fixed_size_allocators_(nullptr)
+    , num_unpooled_allocations_(0)
+    , num_unpooled_deallocations_(0)
+    , unpooled_bytes_(0)
+{
+    for (std::size_t size = 1; size <= max_block_size_; size = round_to_size_class(size) + 1)
+    {
+        ++num_size_classes_;
+    }
+
+    SFL_ASSERT(num_size_classes_ <= UINT16_MAX);
+
+    std::unique_ptr<std::uint16_t[]> index(new std::uint16_t[small_max_block_size_ + 1]); // Can throw.
+    std::unique_ptr<std::size_t[]> sizes(new std::size_t[num_size_classes_]); // Can throw.
+    std::unique_ptr<fixed_size_allocator[]> allocators(new fixed_size_allocator[num_size_classes_]); // Can throw.
+
+    std::size_t num_classes = 0;
+
+    for (std::size_t size = 1; size <= max_block_size_; size = sizes[num_classes - 1] + 1)
+    {
+        sizes[num_classes] = round_to_size_class(size);
+        allocators[num_classes].init(sizes[num_classes], num_classes, node_);
+        ++num_classes;
+    }
+
+    SFL_ASSERT(num_classes == num_size_classes_);
+
+    // Assign size classes to small block sizes. Block size 0 uses the first
+    // class.
+    index[0] = 0;
+
+    std::size_t k = 0;
+
+    for (std::size_t block_size = 1; block_size <= small_max_block_size_; ++block_size)
+    {
+        if (sizes[k] < block_size)
+        {
+            ++k;
+        }
+
+        index[block_size] = std::uint16_t(k);
+    }
+
+    size_class_index_ = index.release();
+    size_class_sizes_ = sizes.release();
+    fixed_size_allocators_ = allocators.release();
+}
+
+small_size_allocator::~small_size_allocator() noexcept
+{
+    forget_samples();
+
+    for (std::size_t i = 0; i < num_size_classes_; ++i)
+    {
+        fixed_size_allocators_[i].release();
+    }
+
+    delete[] fixed_size_allocators_;
+    delete[] size_class_sizes_;
+    delete[] size_class_index_;
+}
+
+void small_size_allocator::forget_samples() noexcept
+{
+    heap_profiler::on_release
+    (
+        [this](const void* p)
+        {
+            return size_class_of(p) != num_size_classes_;
+        }
+    );
+}
+
+void small_size_allocator::release() noexcept
+{
+    forget_samples();
+
+    for (std::size_t i = 0; i < num_size_classes_; ++i)
+    {
+        fixed_size_allocators_[i].release();
+    }
+}
+
+void small_size_allocator::set_relocator(std::size_t index, pool_relocator relocate, void* context) noexcept
+{
+    SFL_ASSERT(index < num_size_classes_);
+    fixed_size_allocators_[index].set_relocator(relocate, context);
+}
+
+std::size_t small_size_allocator::compact(double max_occupancy)
+{
+    std::vector<bucket*> sources;
+    std::vector<void*> blocks;
+
+    std::size_t n = 0;
+
+    for (std::size_t i = 0; i < num_size_classes_; ++i)
+    {
+        n += fixed_size_allocators_[i].compact(max_occupancy, sources, blocks); // Can throw before anything is moved.
+    }
+
+    return n;
+}
+
+std::uint64_t small_size_allocator::num_bucket_operations() const noexcept
+{
+    std::uint64_t n = 0;
+    for (std::size_t i = 0; i < num_size_classes_; ++i)
+    {
+        n += fixed_size_allocators_[i].num_operations();
+    }
+    return n;
+}
+
+std::size_t small_size_allocator::trim() noexcept
+{
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < num_size_classes_; ++i)
+    {
+        n += fixed_size_allocators_[i].trim();
+    }
+    return n;
+}
+
+void small_size_allocator::allocate_bulk
+(
+    std::size_t block_size,
+    std::size_t n,
+    void** out,
+    std::size_t alignment
+)
+{
+    const std::size_t index = size_class(block_size, alignment);
+
+    if (index == num_size_classes_)
+    {
+        std::size_t i = 0;
+        try
+        {
+            for (; i < n; ++i)
+            {
+                out[i] = allocate(block_size, alignment); // Can throw.
+            }
+        }
+        catch (...)
+        {
+            deallocate_bulk(block_size, i, out, alignment);
+            throw;
+        }
+    }
+    else
+    {
+        allocate_bulk_blocks(index, n, out); // Can throw. No effects if throws.
+
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            heap_profiler::on_allocate(out[i], block_size);
+        }
+    }
+}
+
+void small_size_allocator::allocate_bulk_blocks(std::size_t index, std::size_t n, void** out)
+{
+    SFL_ASSERT(index < num_size_classes_);
+
+    fixed_size_allocator& a = fixed_size_allocators_[index];
+
+    a.allocate_bulk(n, out); // Can throw. No effects if throws.
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        mark_live(out[i], a.bucket_size());
+    }
+}
+
+void small_size_allocator::deallocate_bulk
+(
+    std::size_t block_size,
+    std::size_t n,
+    void* const* blocks,
+    std::size_t alignment
+) noexcept
+{
+    const std::size_t index = size_class(block_size, alignment);
+
+    if (index == num_size_classes_)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            deallocate(blocks[i], block_size, alignment);
+        }
+    }
+    else
+    {
+        fixed_size_allocator& a = fixed_size_allocators_[index];
+
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            mark_free(blocks[i], a.bucket_size());
+        }
+
+        a.deallocate_bulk(n, blocks);
+    }
+}
+
+bool small_size_allocator::is_empty() const noexcept
+{
+    for (std::size_t i = 0; i < num_size_classes_; ++i)
+    {
+        if (!fixed_size_allocators_[i].is_empty())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::size_t small_size_allocator::medium_size_class(std::size_t block_size) const noexcept
+{
+    SFL_ASSERT(block_size > small_max_block_size_ && block_size <= max_block_size_);
+
+    // Medium classes follow the class of the largest small block size.
+    const std::size_t* first = size_class_sizes_ + size_class_index_[small_max_block_size_] + 1;
+    const std::size_t* last = size_class_sizes_ + num_size_classes_;
+
+    return std::lower_bound(first, last, block_size) - size_class_sizes_;
+}
+
+std::size_t small_size_allocator::over_aligned_size_class
+(
+    std::size_t index,
+    std::size_t alignment
+) const noexcept
+{
+    SFL_ASSERT((alignment & (alignment - 1)) == 0);
+
+    while (index < num_size_classes_ && size_class_alignment(index) < alignment)
+    {
+        ++index;
+    }
+
+    return index;
+}
+
+/// Allocates memory that is not allocated from the pool.
+///
+inline void* allocate_unpooled(std::size_t size, std::size_t alignment)
+{
+    if (alignment <= alignof(std::max_align_t))
+    {
+        return ::operator new(size); // Can throw.
+    }
+
+    #if defined(__cpp_aligned_new)
+    return ::operator new(size, std::align_val_t(alignment)); // Can throw.
+    #elif defined(__linux__) || defined(__unix__)
+    void* p = nullptr;
+    if (::posix_memalign(&p, alignment, size) != 0)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+    #elif defined(_WIN32)
+    void* p = ::_aligned_malloc(size, alignment);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+    #else
+    #error "Not implemented."
+    #endif
+}
+
+inline void deallocate_unpooled(void* p, std::size_t alignment) noexcept
+{
+    if (alignment <= alignof(std::max_align_t))
+    {
+        ::operator delete(p);
+        return;
+    }
+
+    #if defined(__cpp_aligned_new)
+    ::operator delete(p, std::align_val_t(alignment));
+    #elif defined(__linux__) || defined(__unix__)
+    ::free(p);
+    #elif defined(_WIN32)
+    ::_aligned_free(p);
+    #else
+    #error "Not implemented."
+    #endif
+}
+
+void* small_size_allocator::allocate(std::size_t block_size, std::size_t alignment)
+{
+    const std::size_t index = size_class(block_size, alignment);
+
+    if (index == num_size_classes_)
+    {
+        void* p = allocate_unpooled(block_size, alignment); // Can throw.
+        num_unpooled_allocations_.fetch_add(1, std::memory_order_relaxed);
+        unpooled_bytes_.fetch_add(block_size, std::memory_order_relaxed);
+        return p;
+    }
+    else
+    {
+        void* p = allocate_block(index); // Can throw.
+        heap_profiler::on_allocate(p, block_size);
+        return p;
+    }
+}
+
+void* small_size_allocator::allocate_block(std::size_t index)
+{
+    SFL_ASSERT(index < num_size_classes_);
+    fixed_size_allocator& a = fixed_size_allocators_[index];
+    void* p = a.allocate(); // Can throw.
+    mark_live(p, a.bucket_size());
+    return p;
+}
+
+void small_size_allocator::deallocate(void* p, std::size_t block_size, std::size_t alignment) noexcept
+{
+    const std::size_t index = size_class(block_size, alignment);
+
+    if (index == num_size_classes_)
+    {
+        deallocate_unpooled(p, alignment);
+        num_unpooled_deallocations_.fetch_add(1, std::memory_order_relaxed);
+        unpooled_bytes_.fetch_sub(block_size, std::memory_order_relaxed);
+    }
+    else
+    {
+        fixed_size_allocator& a = fixed_size_allocators_[index];
+        mark_free(p, a.bucket_size());
+        a.deallocate(p);
+    }
+}
+
+std::size_t small_size_allocator::bucket_size_class(const bucket* b) const noexcept
+{
+    if (b == nullptr)
+    {
+        return num_size_classes_;
+    }
+
+    const std::size_t index = b->size_class();
+
+    // Bucket of another allocator can have the same index.
+    if (index < num_size_classes_ && b->owner() == &fixed_size_allocators_[index])
+    {
+        return index;
+    }
+
+    return num_size_classes_;
+}
+
+std::size_t small_size_allocator::size_class_of(const void* p) const noexcept
+{
+    return bucket_size_class(bucket_map::find(p));
+}
+
+bool small_size_allocator::deallocate(void* p) noexcept
+{
+    const std::size_t index = size_class_of(p);
+
+    if (index == num_size_classes_)
+    {
+        return false;
+    }
+
+    fixed_size_allocator& a = fixed_size_allocators_[index];
+    mark_free(p, a.bucket_size());
+    a.deallocate(p);
+    return true;
+}
+
+bool small_size_allocator::deallocate_shared(void* p, std::size_t block_size, std::size_t alignment) noexcept
+{
+    const std::size_t index = size_class(block_size, alignment);
+
+    if (index == num_size_classes_)
+    {
+        deallocate(p, block_size, alignment);
+        return false;
+    }
+
+    fixed_size_allocator& a = fixed_size_allocators_[index];
+
+    // Checked before remote push, so that double free cannot corrupt
+    // remote free list.
+    mark_free(p, a.bucket_size());
+
+    if (bucket::from_pointer(p, a.bucket_size())->owner() == &a)
+    {
+        a.deallocate(p);
+        return false;
+    }
+
+    return fixed_size_allocator::deallocate_remote(p, a.bucket_size());
+}
+
+bool small_size_allocator::deallocate_foreign(void* p, std::size_t alignment) noexcept
+{
+    const bucket* b = bucket_map::find(p);
+
+    if (b == nullptr)
+    {
+        deallocate_unpooled(p, alignment);
+        return false;
+    }
+
+    mark_free(p, b->size());
+
+    return fixed_size_allocator::deallocate_remote(p, b->size());
+}
+
+bool small_size_allocator::deallocate_bulk_shared
+(
+    std::size_t block_size,
+    std::size_t n,
+    void* const* blocks,
+    std::size_t alignment
+) noexcept
+{
+    const std::size_t index = size_class(block_size, alignment);
+
+    if (index == num_size_classes_)
+    {
+        deallocate_bulk(block_size, n, blocks, alignment);
+        return false;
+    }
+
+    bool handed_over = false;
+
+    fixed_size_allocator* local = &fixed_size_allocators_[index];
+
+    const std::size_t bucket_size = local->bucket_size();
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        mark_free(blocks[i], bucket_size);
+    }
+
+    // Runs of own blocks are deallocated in bulk.
+    std::size_t i = 0;
+
+    while (i < n)
+    {
+        std::size_t k = i;
+
+        while (k < n && bucket::from_pointer(blocks[k], bucket_size)->owner() == local)
+        {
+            ++k;
+        }
+
+        local->deallocate_bulk(k - i, blocks + i);
+
+        if (k < n)
+        {
+            handed_over |= fixed_size_allocator::deallocate_remote(blocks[k], bucket_size);
+            ++k;
+        }
+
+        i = k;
+    }
+
+    return handed_over;
+}
+
+void small_size_allocator::collect_remote() noexcept
+{
+    for (std::size_t i = 0; i < num_size_classes_; ++i)
+    {
+        fixed_size_allocators_[i].collect_remote();
+    }
+}
+
+inline double fragmentation(const pool_size_class_stats& c) noexcept
+{
+    return c.num_blocks == 0 ? 0.0 : 1.0 - double(c.num_live_blocks) / double(c.num_blocks);
+}
+
+void small_size_allocator::stats(pool_statistics& s) const
+{
+    s.size_classes.resize(num_size_classes_); // Can throw.
+
+    s.bytes_mapped = 0;
+
+    for (std::size_t i = 0; i < num_size_classes_; ++i)
+    {
+        pool_size_class_stats& c = s.size_classes[i];
+        fixed_size_allocators_[i].stats(c);
+        c.num_live_blocks = c.num_used_blocks;
+        c.num_cached_blocks = 0;
+        c.fragmentation = fragmentation(c);
+        s.bytes_mapped += c.bytes_mapped;
+    }
+
+    s.num_unpooled_allocations = num_unpooled_allocations_.load(std::memory_order_relaxed);
+    s.num_unpooled_deallocations = num_unpooled_deallocations_.load(std::memory_order_relaxed);
+    // Unpooled blocks deallocated by threads that do not own the pool are
+    // counted by the deallocating pool. Its balance can go below zero.
+    const std::size_t unpooled_bytes = unpooled_bytes_.load(std::memory_order_relaxed);
+    s.unpooled_bytes = unpooled_bytes <= SIZE_MAX / 2 ? unpooled_bytes : 0;
+
+    arena::instance().stats(s);
+}
+
+/// NUMA node of the calling thread.
+///
+class thread_node
+{
+private:
+
+    static constexpr std::size_t unknown = std::size_t(-1);
+
+    static thread_local std::size_t node_;
+
+public:
+
+    static std::size_t get() noexcept
+    {
+        if (SFL_POOL_ALLOCATOR_NUMA_NODES == 1)
+        {
+            return 0;
+        }
+
+        if (node_ == unknown)
+        {
+            node_ = detect_numa_node() % SFL_POOL_ALLOCATOR_NUMA_NODES;
+        }
+
+        return node_;
+    }
+
+    static void set(std::size_t node) noexcept
+    {
+        SFL_ASSERT(node < SFL_POOL_ALLOCATOR_NUMA_NODES);
+        node_ = node;
+    }
+};
+
+thread_local std::size_t thread_node::node_ = thread_node::unknown;
+
+std::size_t current_numa_node() noexcept
+{
+    return thread_node::get();
+}
+
+/// Returns NUMA node of pool that owns the given pooled block, allocated
+/// from bucket of the given size.
+///
+inline std::size_t node_of(void* p, std::size_t bucket_size) noexcept
+{
+    if (SFL_POOL_ALLOCATOR_NUMA_NODES == 1)
+    {
+        return 0;
+    }
+
+    return bucket::from_pointer(p, bucket_size)->node();
+}
+
+#if SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE > 0
+
+/// Per-thread cache of free blocks. Holds one magazine (small stack of free
+/// blocks) for each size class. Magazines are refilled from and flushed into
+/// the pool of the thread's NUMA node in batches so the lock is taken once
+/// per batch rather than once per allocation or deallocation.
+///
+/// Blocks in magazines are not tied to the thread that allocated them.
+/// Block deallocated by another thread goes into that thread's magazine and
+/// eventually back into the shared pool, where it is returned to the bucket
+/// it came from. Blocks that belong to pool of another NUMA node are
+/// collected in a small per-node magazine and returned to that pool in one
+/// batch.
+///
+class thread_cache
+{
+private:
+
+    static constexpr std::size_t capacity = SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE;
+
+    /// Magazine of large size class holds at most this many bytes (but at
+    /// least two blocks), so that medium blocks do not pile up in caches.
+    static constexpr std::size_t max_magazine_bytes = 64 * 1024;
+
+    using node_pool = small_size_allocator_singleton::node_pool;
+
+    struct magazine
+    {
+        std::size_t size;
+
+        /// Magazine is flushed when it holds this many blocks.
+        std::size_t limit;
+
+        /// Number of blocks moved by one refill or flush.
+        std::size_t batch_size;
+
+        /// Size of buckets of the size class.
+        std::size_t bucket_size;
+
+        void* blocks[capacity];
+
+        // Statistics. Written only by the owning thread, read by any thread.
+        std::atomic<std::uint64_t> num_allocations;
+        std::atomic<std::uint64_t> num_deallocations;
+    };
+
+    /// Block of another NUMA node waiting to be returned to its pool.
+    struct remote_block
+    {
+        void* p;
+
+        /// Size class index.
+        std::size_t index;
+    };
+
+    /// Blocks of one NUMA node other than the thread's node. Holds blocks
+    /// of any size class.
+    struct remote_magazine
+    {
+        std::size_t size;
+
+        remote_block blocks[capacity];
+    };
+
+    static constexpr std::size_t num_nodes = small_size_allocator_singleton::num_nodes;
+
+    small_size_allocator_singleton& owner_;
+
+    /// NUMA node whose pool refills and receives flushed blocks.
+    std::size_t node_;
+
+    std::size_t num_magazines_;
+
+    magazine* magazines_;
+
+    /// One magazine per NUMA node. Nullptr if there is a single node or if
+    /// there was not enough memory, then blocks are returned one by one.
+    remote_magazine* remotes_;
+
+    /// Links in owner's list of live thread caches.
+    thread_cache* prev_;
+    thread_cache* next_;
+
+    static thread_local thread_cache* current_;
+
+    static thread_local bool destroyed_;
+
+private:
+
+    explicit thread_cache(small_size_allocator_singleton& owner) noexcept
+        : owner_(owner)
+        , node_(thread_node::get())
+        , num_magazines_(owner.classes().num_size_classes())
+        , magazines_(new (std::nothrow) magazine[num_magazines_])
+        , remotes_(num_nodes > 1 ? new (std::nothrow) remote_magazine[num_nodes] : nullptr)
+        , prev_(nullptr)
+        , next_(nullptr)
+    {
+        if (magazines_ != nullptr)
+        {
+            for (std::size_t i = 0; i < num_magazines_; ++i)
+            {
+                const std::size_t block_size = owner.classes().size_class_size(i);
+                const std::size_t limit = std::min(std::size_t(capacity), std::max(std::size_t(2), max_magazine_bytes / block_size));
+                magazines_[i].size = 0;
+                magazines_[i].limit = limit;
+                magazines_[i].batch_size = limit / 2 > 0 ? limit / 2 : 1;
+                magazines_[i].bucket_size = bucket_size_of(block_size);
+                magazines_[i].num_allocations.store(0, std::memory_order_relaxed);
+                magazines_[i].num_deallocations.store(0, std::memory_order_relaxed);
+            }
+
+            if (remotes_ != nullptr)
+            {
+                for (std::size_t i = 0; i < num_nodes; ++i)
+                {
+                    remotes_[i].size = 0;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(owner_.mutex_);
+
+            next_ = owner_.thread_caches_;
+            if (next_ != nullptr)
+            {
+                next_->prev_ = this;
+            }
+            owner_.thread_caches_ = this;
+
+            current_ = this;
+        }
+    }
+
+    static void increment(std::atomic<std::uint64_t>& counter) noexcept
+    {
+        // Only the owning thread writes the counter. No need for atomic RMW.
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    thread_cache(const thread_cache&) = delete;
+    thread_cache& operator=(const thread_cache&) = delete;
+
+    node_pool& pool() noexcept
+    {
+        return *owner_.nodes_[node_];
+    }
+
+    void refill(magazine& m, std::size_t index)
+    {
+        SFL_ASSERT(m.size == 0);
+
+        node_pool& np = pool();
+
+        std::lock_guard<std::mutex> lock(np.mutex);
+
+        try
+        {
+            np.alloc.allocate_bulk_blocks(index, m.batch_size, m.blocks); // Can throw. No effects if throws.
+            m.size = m.batch_size;
+        }
+        catch (...)
+        {
+            // Not enough memory for the whole batch. Try one block.
+            m.blocks[0] = np.alloc.allocate_block(index); // Can throw.
+            m.size = 1;
+        }
+
+        // Blocks in magazine are free from the user's point of view.
+        for (std::size_t i = 0; i < m.size; ++i)
+        {
+            mark_free(m.blocks[i], m.bucket_size);
+        }
+    }
+
+    void flush(magazine& m, std::size_t index, std::size_t n) noexcept
+    {
+        SFL_ASSERT(n <= m.size);
+
+        node_pool& np = pool();
+
+        const std::size_t block_size = np.alloc.size_class_size(index);
+
+        std::lock_guard<std::mutex> lock(np.mutex);
+
+        m.size -= n;
+
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            mark_live(m.blocks[m.size + i], m.bucket_size);
+        }
+
+        np.alloc.deallocate_bulk(block_size, n, m.blocks + m.size);
+    }
+
+    /// Returns all blocks of remote magazine to pool of its node.
+    ///
+    void flush_remote(std::size_t node) noexcept
+    {
+        remote_magazine& r = remotes_[node];
+
+        // Group blocks by size class so each class is one bulk deallocation.
+        std::sort
+        (
+            r.blocks,
+            r.blocks + r.size,
+            [](const remote_block& a, const remote_block& b) { return a.index < b.index; }
+        );
+
+        void* blocks[capacity];
+
+        node_pool& np = *owner_.nodes_[node];
+
+        std::lock_guard<std::mutex> lock(np.mutex);
+
+        std::size_t i = 0;
+
+        while (i < r.size)
+        {
+            const std::size_t index = r.blocks[i].index;
+            const std::size_t bucket_size = magazines_[index].bucket_size;
+
+            std::size_t k = 0;
+
+            while (i < r.size && r.blocks[i].index == index)
+            {
+                blocks[k] = r.blocks[i].p;
+                mark_live(blocks[k], bucket_size);
+                ++k;
+                ++i;
+            }
+
+            np.alloc.deallocate_bulk(np.alloc.size_class_size(index), k, blocks);
+        }
+
+        r.size = 0;
+    }
+
+    void flush_all() noexcept
+    {
+        for (std::size_t i = 0; i < num_magazines_; ++i)
+        {
+            if (magazines_[i].size > 0)
+            {
+                flush(magazines_[i], i, magazines_[i].size);
+            }
+        }
+
+        if (remotes_ != nullptr)
+        {
+            for (std::size_t i = 0; i < num_nodes; ++i)
+            {
+                if (remotes_[i].size > 0)
+                {
+                    flush_remote(i);
+                }
+            }
+        }
+    }
+
+public:
+
+    ~thread_cache() noexcept
+    {
+        if (magazines_ != nullptr)
+        {
+            flush_all();
+
+            {
+                std::lock_guard<std::mutex> lock(owner_.mutex_);
+
+                {
+                    node_pool& np = pool();
+
+                    std::lock_guard<std::mutex> node_lock(np.mutex);
+
+                    for (std::size_t i = 0; i < num_magazines_; ++i)
+                    {
+                        np.retired_counts[2 * i] +=
+                            magazines_[i].num_allocations.load(std::memory_order_relaxed);
+                        np.retired_counts[2 * i + 1] +=
+                            magazines_[i].num_deallocations.load(std::memory_order_relaxed);
+                    }
+                }
+
+                if (prev_ != nullptr)
+                {
+                    prev_->next_ = next_;
+                }
+                else
+                {
+                    owner_.thread_caches_ = next_;
+                }
+                if (next_ != nullptr)
+                {
+                    next_->prev_ = prev_;
+                }
+            }
+
+            delete[] magazines_;
+            delete[] remotes_;
+        }
+
+        current_ = nullptr;
+        destroyed_ = true;
+    }
+
+    /// Returns the calling thread's cache, creating it on first use.
+    /// Returns nullptr if cache cannot be created or if it has already been
+    /// destroyed (i.e. during thread exit or static destruction).
+    ///
+    static thread_cache* get(small_size_allocator_singleton& owner) noexcept
+    {
+        if (current_ != nullptr)
+        {
+            return current_;
+        }
+
+        if (destroyed_)
+        {
+            return nullptr;
+        }
+
+        static thread_local thread_cache cache(owner);
+
+        return current_;
+    }
+
+    /// Returns the calling thread's cache if it exists.
+    ///
+    static thread_cache* existing() noexcept
+    {
+        return current_;
+    }
+
+    /// Returns all cached blocks to the shared pool.
+    ///
+    void flush() noexcept
+    {
+        flush_all();
+    }
+
+    /// Returns all cached blocks to the current node and switches to the
+    /// given node.
+    ///
+    void set_node(std::size_t node) noexcept
+    {
+        flush_all();
+        node_ = node;
+    }
+
+    /// Allocates block of size class with the given index.
+    ///
+    void* allocate(std::size_t index)
+    {
+        magazine& m = magazines_[index];
+
+        if (m.size == 0)
+        {
+            refill(m, index); // Can throw.
+        }
+
+        increment(m.num_allocations);
+
+        --m.size;
+        mark_live(m.blocks[m.size], m.bucket_size);
+        return m.blocks[m.size];
+    }
+
+    /// Deallocates block of size class with the given index.
+    ///
+    void deallocate(void* p, std::size_t index) noexcept
+    {
+        magazine& m = magazines_[index];
+
+        increment(m.num_deallocations);
+
+        const std::size_t node = node_of(p, m.bucket_size);
+
+        if (node != node_)
+        {
+            if (remotes_ == nullptr)
+            {
+                // Return block to pool of its node.
+                node_pool& np = *owner_.nodes_[node];
+                std::lock_guard<std::mutex> lock(np.mutex);
+                np.alloc.deallocate(p, np.alloc.size_class_size(index));
+                return;
+            }
+
+            remote_magazine& r = remotes_[node];
+
+            mark_free(p, m.bucket_size);
+
+            r.blocks[r.size].p = p;
+            r.blocks[r.size].index = index;
+            ++r.size;
+
+            if (r.size == capacity)
+            {
+                flush_remote(node);
+            }
+
+            return;
+        }
+
+        mark_free(p, m.bucket_size);
+
+        if (m.size == m.limit)
+        {
+            flush(m, index, m.batch_size);
+        }
+
+        m.blocks[m.size] = p;
+        ++m.size;
+    }
+
+    /// Adds allocation and deallocation counts to statistics.
+    /// Owner's mutex must be locked.
+    ///
+    void add_counts(pool_statistics& s) const noexcept
+    {
+        for (std::size_t i = 0; i < num_magazines_; ++i)
+        {
+            s.size_classes[i].num_allocations +=
+                magazines_[i].num_allocations.load(std::memory_order_relaxed);
+            s.size_classes[i].num_deallocations +=
+                magazines_[i].num_deallocations.load(std::memory_order_relaxed);
+        }
+    }
+
+    thread_cache* next() const noexcept
+    {
+        return next_;
+    }
+};
+
+thread_local thread_cache* thread_cache::current_ = nullptr;
+
+thread_local bool thread_cache::destroyed_ = false;
+
+#endif // SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE > 0
+
+small_size_allocator_singleton::node_pool::node_pool(std::size_t node)
+    : alloc(default_max_block_size, node) // Can throw.
+    , retired_counts(new std::uint64_t[2 * alloc.num_size_classes()]()) // Can throw.
+{}
+
+small_size_allocator_singleton::node_pool::~node_pool() noexcept
+{
+    delete[] retired_counts;
+}
+
+small_size_allocator_singleton::small_size_allocator_singleton()
+    : thread_caches_(nullptr)
+{
+    static_assert(num_nodes >= 1 && num_nodes <= UINT8_MAX,
+                  "SFL_POOL_ALLOCATOR_NUMA_NODES must be in range [1, 255].");
+
+    for (std::size_t i = 0; i < num_nodes; ++i)
+    {
+        nodes_[i] = nullptr;
+    }
+
+    try
+    {
+        for (std::size_t i = 0; i < num_nodes; ++i)
+        {
+            nodes_[i] = new node_pool(i); // Can throw.
+        }
+    }
+    catch (...)
+    {
+        for (std::size_t i = 0; i < num_nodes; ++i)
+        {
+            delete nodes_[i];
+        }
+        throw;
+    }
+}
+
+small_size_allocator_singleton::node_pool& small_size_allocator_singleton::owner_of(void* p, std::size_t index) noexcept
+{
+    return *nodes_[node_of(p, bucket_size_of(classes().size_class_size(index)))];
+}
+
+void* small_size_allocator_singleton::allocate(std::size_t block_size, std::size_t alignment)
+{
+    const std::size_t index = classes().size_class(block_size, alignment);
+
+    if (index == classes().num_size_classes())
+    {
+        // No need to lock. Dispatched to ::operator new.
+        return nodes_[0]->alloc.allocate(block_size, alignment); // Can throw.
+    }
+
+    void* p;
+
+    #if SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE > 0
+    if (thread_cache* cache = thread_cache::get(*this))
+    {
+        p = cache->allocate(index); // Can throw.
+    }
+    else
+    #endif
+    {
+        node_pool& np = *nodes_[thread_node::get()];
+        std::lock_guard<std::mutex> lock(np.mutex);
+        p = np.alloc.allocate_block(index); // Can throw.
+        ++np.retired_counts[2 * index];
+    }
+
+    // Sampled without lock. Recording sample allocates.
+    heap_profiler::on_allocate(p, block_size);
+
+    return p;
+}
+
+void small_size_allocator_singleton::deallocate(void* p, std::size_t block_size, std::size_t alignment) noexcept
+{
+    const std::size_t index = classes().size_class(block_size, alignment);
+
+    if (index == classes().num_size_classes())
+    {
+        // No need to lock. Dispatched to ::operator delete.
+        nodes_[0]->alloc.deallocate(p, block_size, alignment);
+        return;
+    }
+
+    #if SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE > 0
+    if (thread_cache* cache = thread_cache::get(*this))
+    {
+        cache->deallocate(p, index);
+        return;
+    }
+    #endif
+
+    node_pool& np = owner_of(p, index);
+    std::lock_guard<std::mutex> lock(np.mutex);
+    np.alloc.deallocate(p, block_size, alignment);
+    ++np.retired_counts[2 * index + 1];
+}
+
+bool small_size_allocator_singleton::deallocate(void* p) noexcept
+{
+    const bucket* b = bucket_map::find(p);
+
+    if (b == nullptr || b->node() >= num_nodes)
+    {
+        return false;
+    }
+
+    node_pool& np = *nodes_[b->node()];
+
+    const std::size_t index = np.alloc.bucket_size_class(b);
+
+    if (index == np.alloc.num_size_classes())
+    {
+        return false;
+    }
+
+    #if SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE > 0
+    if (thread_cache* cache = thread_cache::get(*this))
+    {
+        cache->deallocate(p, index);
+        return true;
+    }
+    #endif
+
+    std::lock_guard<std::mutex> lock(np.mutex);
+    np.alloc.deallocate(p, np.alloc.size_class_size(index));
+    ++np.retired_counts[2 * index + 1];
+    return true;
+}
+
+std::size_t small_size_allocator_singleton::allocated_size(const void* p) const noexcept
+{
+    const bucket* b = bucket_map::find(p);
+
+    if (b == nullptr || b->node() >= num_nodes)
+    {
+        return 0;
+    }
+
+    const small_size_allocator& alloc = nodes_[b->node()]->alloc;
+
+    const std::size_t index = alloc.bucket_size_class(b);
+
+    return index == alloc.num_size_classes() ? 0 : alloc.size_class_size(index);
+}
+
+void small_size_allocator_singleton::allocate_bulk
+(
+    std::size_t block_size,
+    std::size_t n,
+    void** out,
+    std::size_t alignment
+)
+{
+    const std::size_t index = classes().size_class(block_size, alignment);
+
+    if (index == classes().num_size_classes())
+    {
+        // No need to lock. Dispatched to ::operator new.
+        nodes_[0]->alloc.allocate_bulk(block_size, n, out, alignment); // Can throw.
+        return;
+    }
+
+    {
+        node_pool& np = *nodes_[thread_node::get()];
+        std::lock_guard<std::mutex> lock(np.mutex);
+        np.alloc.allocate_bulk_blocks(index, n, out); // Can throw. No effects if throws.
+        np.retired_counts[2 * index] += n;
+    }
+
+    // Sampled without lock. Recording sample allocates.
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        heap_profiler::on_allocate(out[i], block_size);
+    }
+}
+
+void small_size_allocator_singleton::deallocate_bulk
+(
+    std::size_t block_size,
+    std::size_t n,
+    void* const* blocks,
+    std::size_t alignment
+) noexcept
+{
+    const std::size_t index = classes().size_class(block_size, alignment);
+
+    if (index == classes().num_size_classes())
+    {
+        // No need to lock. Dispatched to ::operator delete.
+        nodes_[0]->alloc.deallocate_bulk(block_size, n, blocks, alignment);
+        return;
+    }
+
+    const std::size_t bucket_size = bucket_size_of(classes().size_class_size(index));
+
+    // One lock acquisition per run of blocks that belong to the same node.
+    std::size_t i = 0;
+
+    while (i < n)
+    {
+        const std::size_t node = node_of(blocks[i], bucket_size);
+
+        std::size_t k = i + 1;
+
+        while (k < n && node_of(blocks[k], bucket_size) == node)
+        {
+            ++k;
+        }
+
+        node_pool& np = *nodes_[node];
+        std::lock_guard<std::mutex> lock(np.mutex);
+        np.alloc.deallocate_bulk(block_size, k - i, blocks + i, alignment);
+        np.retired_counts[2 * index + 1] += k - i;
+
+        i = k;
+    }
+}
+
+/// Adds bucket-level statistics of one more pool.
+///
+inline void add_bucket_stats(pool_statistics& s, const pool_statistics& t) noexcept
+{
+    for (std::size_t i = 0; i < s.size_classes.size(); ++i)
+    {
+        pool_size_class_stats& c = s.size_classes[i];
+        const pool_size_class_stats& d = t.size_classes[i];
+        c.num_buckets += d.num_buckets;
+        c.num_blocks += d.num_blocks;
+        c.num_used_blocks += d.num_used_blocks;
+        c.bytes_mapped += d.bytes_mapped;
+    }
+
+    s.bytes_mapped += t.bytes_mapped;
+}
+
+pool_statistics small_size_allocator_singleton::stats()
+{
+    pool_statistics s;
+
+    pool_statistics t;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (std::size_t node = 0; node < num_nodes; ++node)
+    {
+        node_pool& np = *nodes_[node];
+
+        std::lock_guard<std::mutex> node_lock(np.mutex);
+
+        if (node == 0)
+        {
+            // Unpooled blocks are always counted by node 0.
+            np.alloc.stats(s); // Can throw.
+
+            for (auto& c : s.size_classes)
+            {
+                c.num_allocations = 0;
+                c.num_deallocations = 0;
+            }
+        }
+        else
+        {
+            np.alloc.stats(t); // Can throw.
+            add_bucket_stats(s, t);
+        }
+
+        // Blocks taken from buckets are either live or held in thread caches.
+        // Allocations and deallocations are counted as seen by the user.
+        for (std::size_t i = 0; i < s.size_classes.size(); ++i)
+        {
+            s.size_classes[i].num_allocations += np.retired_counts[2 * i];
+            s.size_classes[i].num_deallocations += np.retired_counts[2 * i + 1];
+        }
+    }
+
+    #if SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE > 0
+    for (thread_cache* c = thread_caches_; c != nullptr; c = c->next())
+    {
+        c->add_counts(s);
+    }
+    #endif
+
+    for (auto& c : s.size_classes)
+    {
+        // Counters of other threads are read while they run. Clamp to keep
+        // the snapshot self-consistent.
+        const std::uint64_t live = c.num_allocations >= c.num_deallocations
+                                 ? c.num_allocations - c.num_deallocations : 0;
+
+        c.num_live_blocks = live < c.num_used_blocks ? std::size_t(live) : c.num_used_blocks;
+        c.num_cached_blocks = c.num_used_blocks - c.num_live_blocks;
+        c.fragmentation = fragmentation(c);
+    }
+
+    return s;
+}
+
+pool_statistics small_size_allocator_singleton::node_stats(std::size_t node)
+{
+    SFL_ASSERT(node < num_nodes);
+
+    pool_statistics s;
+
+    node_pool& np = *nodes_[node];
+
+    std::lock_guard<std::mutex> lock(np.mutex);
+
+    np.alloc.stats(s); // Can throw.
+
+    return s;
+}
+
+void small_size_allocator_singleton::set_thread_node(std::size_t node) noexcept
+{
+    SFL_ASSERT(node < num_nodes);
+
+    thread_node::set(node);
+
+    #if SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE > 0
+    if (thread_cache* cache = thread_cache::existing())
+    {
+        cache->set_node(node);
+    }
+    #endif
+}
+
+std::size_t small_size_allocator_singleton::trim() noexcept
+{
+    // Caches of other threads cannot be touched. Their blocks keep pages
+    // and buckets in use.
+    #if SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE > 0
+    if (thread_cache* cache = thread_cache::existing())
+    {
+        cache->flush();
+    }
+    #endif
+
+    std::size_t n = 0;
+
+    for (std::size_t i = 0; i < num_nodes; ++i)
+    {
+        std::lock_guard<std::mutex> lock(nodes_[i]->mutex);
+        n += nodes_[i]->alloc.trim();
+    }
+
+    return n;
+}
+
+std::uint64_t small_size_allocator_singleton::num_bucket_operations() noexcept
+{
+    std::uint64_t n = 0;
+
+    for (std::size_t i = 0; i < num_nodes; ++i)
+    {
+        std::lock_guard<std::mutex> lock(nodes_[i]->mutex);
+        n += nodes_[i]->alloc.num_bucket_operations();
+    }
+
+    return n;
+}
+
+void small_size_allocator_singleton::lock_all() noexcept
+{
+    // Same order in which the locks nest during allocation.
+    mutex_.lock();
+
+    for (std::size_t i = 0; i < num_nodes; ++i)
+    {
+        nodes_[i]->mutex.lock();
+    }
+
+    heap_profiler::lock();
+    arena::instance().lock();
+    bucket_map::lock();
+}
+
+void small_size_allocator_singleton::unlock_all() noexcept
+{
+    bucket_map::unlock();
+    arena::instance().unlock();
+    heap_profiler::unlock();
+
+    for (std::size_t i = num_nodes; i-- > 0;)
+    {
+        nodes_[i]->mutex.unlock();
+    }
+
+    mutex_.unlock();
+}
+
+/// Owner of the calling thread's pool used by thread_local_small_size_allocator.
+/// Destroys the pool at thread exit if it is empty.
+///
+class thread_local_pool
+{
+private:
+
+    /// Pool of exited thread whose blocks are still in use.
+    struct orphan
+    {
+        small_size_allocator* pool;
+        orphan* next;
+    };
+
+    static thread_local small_size_allocator* current_;
+
+    static thread_local bool exited_;
+
+    /// Protects list of orphans. Nothing is allocated with mutex locked.
+    static std::mutex orphans_mutex_;
+
+    static orphan* orphans_;
+
+    static std::atomic<std::size_t> num_orphans_;
+
+    thread_local_pool() noexcept = default;
+
+    thread_local_pool(const thread_local_pool&) = delete;
+    thread_local_pool& operator=(const thread_local_pool&) = delete;
+
+    static small_size_allocator& create()
+    {
+        reclaim_orphans();
+
+        current_ = new small_size_allocator(default_max_block_size, thread_node::get()); // Can throw.
+
+        // Pool created after thread_local destructors have run (e.g. during
+        // static destruction) is never destroyed.
+        if (!exited_)
+        {
+            static thread_local thread_local_pool owner;
+            (void)owner;
+        }
+
+        return *current_;
+    }
+
+    /// Adds pool of exiting thread into list of orphans. Pool is leaked if
+    /// there is not enough memory for the list node.
+    ///
+    static void abandon(small_size_allocator* pool) noexcept
+    {
+        orphan* o = new (std::nothrow) orphan;
+
+        if (o == nullptr)
+        {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(orphans_mutex_);
+            o->pool = pool;
+            o->next = orphans_;
+            orphans_ = o;
+            num_orphans_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Blocks deallocated before the pool was listed may have been missed
+        // by threads that checked for orphans.
+        reclaim_orphans();
+    }
+
+public:
+
+    ~thread_local_pool() noexcept
+    {
+        if (current_ != nullptr)
+        {
+            current_->collect_remote();
+
+            // Blocks that are still in use keep the pool alive. Unpooled
+            // blocks do not depend on the pool.
+            if (current_->is_empty())
+            {
+                delete current_;
+            }
+            else
+            {
+                abandon(current_);
+            }
+
+            current_ = nullptr;
+        }
+        exited_ = true;
+    }
+
+    /// Collects remote frees of orphans and destroys orphans that have
+    /// become empty. Called after deallocation that handed bucket over to
+    /// its owner, so the last remote free into an orphan destroys it.
+    ///
+    static void reclaim_orphans() noexcept
+    {
+        // Pairs with the fence in abandon. Either this thread sees the new
+        // orphan, or abandon collects the bucket just handed over.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (num_orphans_.load(std::memory_order_relaxed) == 0)
+        {
+            return;
+        }
+
+        orphan* dead = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(orphans_mutex_);
+
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            for (orphan** link = &orphans_; *link != nullptr;)
+            {
+                orphan* o = *link;
+
+                o->pool->collect_remote();
+
+                if (o->pool->is_empty())
+                {
+                    *link = o->next;
+                    o->next = dead;
+                    dead = o;
+                    num_orphans_.fetch_sub(1, std::memory_order_relaxed);
+                }
+                else
+                {
+                    link = &o->next;
+                }
+            }
+        }
+
+        while (dead != nullptr)
+        {
+            orphan* next = dead->next;
+            delete dead->pool;
+            delete dead;
+            dead = next;
+        }
+    }
+
+    /// Adds bucket-level statistics of orphans to `s`.
+    ///
+    static void orphan_stats(pool_statistics& s)
+    {
+        pool_statistics t;
+
+        std::lock_guard<std::mutex> lock(orphans_mutex_);
+
+        for (orphan* o = orphans_; o != nullptr; o = o->next)
+        {
+            o->pool->collect_remote();
+            o->pool->stats(t); // Can throw.
+
+            add_bucket_stats(s, t);
+
+            for (std::size_t i = 0; i < s.size_classes.size(); ++i)
+            {
+                pool_size_class_stats& c = s.size_classes[i];
+                c.num_live_blocks += t.size_classes[i].num_live_blocks;
+                c.fragmentation = fragmentation(c);
+            }
+        }
+    }
+
+    /// Returns the calling thread's pool, creating it on first use.
+    ///
+    static small_size_allocator& get()
+    {
+        if (current_ != nullptr)
+        {
+            return *current_;
+        }
+        return create(); // Can throw.
+    }
+
+    /// Returns the calling thread's pool if it exists.
+    ///
+    static small_size_allocator* existing() noexcept
+    {
+        return current_;
+    }
+
+};
+
+thread_local small_size_allocator* thread_local_pool::current_ = nullptr;
+
+thread_local bool thread_local_pool::exited_ = false;
+
+std::mutex thread_local_pool::orphans_mutex_;
+
+thread_local_pool::orphan* thread_local_pool::orphans_ = nullptr;
+
+std::atomic<std::size_t> thread_local_pool::num_orphans_{0};
+
+void* thread_local_small_size_allocator::allocate(std::size_t block_size, std::size_t alignment)
+{
+    return thread_local_pool::get().allocate(block_size, alignment); // Can throw.
+}
+
+void thread_local_small_size_allocator::deallocate(void* p, std::size_t block_size, std::size_t alignment) noexcept
+{
+    // Block may have been allocated by another thread. Thread that has no
+    // pool finds the bucket in bucket map.
+    small_size_allocator* pool = thread_local_pool::existing();
+
+    const bool handed_over = pool != nullptr
+                           ? pool->deallocate_shared(p, block_size, alignment)
+                           : small_size_allocator::deallocate_foreign(p, alignment);
+
+    if (handed_over)
+    {
+        thread_local_pool::reclaim_orphans();
+    }
+}
+
+void thread_local_small_size_allocator::allocate_bulk
+(
+    std::size_t block_size,
+    std::size_t n,
+    void** out,
+    std::size_t alignment
+)
+{
+    thread_local_pool::get().allocate_bulk(block_size, n, out, alignment); // Can throw.
+}
+
+void thread_local_small_size_allocator::deallocate_bulk
+(
+    std::size_t block_size,
+    std::size_t n,
+    void* const* blocks,
+    std::size_t alignment
+) noexcept
+{
+    bool handed_over = false;
+
+    if (small_size_allocator* pool = thread_local_pool::existing())
+    {
+        handed_over = pool->deallocate_bulk_shared(block_size, n, blocks, alignment);
+    }
+    else
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            handed_over |= small_size_allocator::deallocate_foreign(blocks[i], alignment);
+        }
+    }
+
+    if (handed_over)
+    {
+        thread_local_pool::reclaim_orphans();
+    }
+}
+
+std::size_t trim_arena() noexcept
+{
+    return arena::instance().trim();
+}
+
+std::size_t thread_local_small_size_allocator::trim() noexcept
+{
+    thread_local_pool::reclaim_orphans();
+    small_size_allocator* pool = thread_local_pool::existing();
+    return pool != nullptr ? pool->trim() : 0;
+}
+
+pool_statistics thread_local_small_size_allocator::stats()
+{
+    pool_statistics s;
+    small_size_allocator& pool = thread_local_pool::get(); // Can throw.
+    pool.collect_remote();
+    pool.stats(s); // Can throw.
+    thread_local_pool::orphan_stats(s); // Can throw.
+    return s;
+}
+
+/// Reads unsigned integer at the beginning of file. Returns false if file
+/// cannot be read or does not begin with number (e.g. "max").
+///
+inline bool read_number(const std::string& path, std::uint64_t& value) noexcept
+{
+    std::FILE* f = std::fopen(path.c_str(), "r");
+
+    if (f == nullptr)
+    {
+        return false;
+    }
+
+    unsigned long long x = 0;
+    const bool ok = std::fscanf(f, "%llu", &x) == 1;
+    std::fclose(f);
+
+    value = x;
+    return ok;
+}
+
+/// Returns resident set size of the process, or 0 if unknown.
+///
+inline std::uint64_t resident_set_size() noexcept
+{
+    #if defined(__linux__)
+    std::FILE* f = std::fopen("/proc/self/statm", "r");
+
+    if (f == nullptr)
+    {
+        return 0;
+    }
+
+    // Total program size, then resident set size, in pages.
+    unsigned long long size = 0;
+    unsigned long long pages = 0;
+    if (std::fscanf(f, "%llu %llu", &size, &pages) != 2)
+    {
+        pages = 0;
+    }
+    std::fclose(f);
+
+    return std::uint64_t(pages) * page_size();
+    #else
+    return 0;
+    #endif
+}
+
+/// Background thread that trims the shared pool when it has been idle or
+/// when memory usage approaches limit. See sfl::pool_start_scavenger.
+///
+/// Never destroyed, so it can keep running during static destruction.
+///
+class scavenger
+{
+private:
+
+    using clock = std::chrono::steady_clock;
+
+    /// Serializes start and stop.
+    std::mutex control_mutex_;
+
+    /// Protects options and stop flag.
+    std::mutex mutex_;
+
+    std::condition_variable cv_;
+
+    pool_scavenger_options options_;
+
+    bool stop_;
+
+    std::thread thread_;
+
+    scavenger() noexcept
+        : stop_(false)
+    {}
+
+    bool under_pressure() const noexcept
+    {
+        std::uint64_t limit;
+
+        if (!read_number(options_.limit_file, limit))
+        {
+            return false;
+        }
+
+        std::uint64_t usage;
+
+        if (options_.usage_file.empty())
+        {
+            usage = resident_set_size();
+        }
+        else if (!read_number(options_.usage_file, usage))
+        {
+            return false;
+        }
+
+        return double(usage) >= options_.pressure_ratio * double(limit);
+    }
+
+    void run() noexcept
+    {
+        small_size_allocator_singleton& pool = small_size_allocator_singleton::instance();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        // Pool is idle while number of bucket operations does not change.
+        std::uint64_t last = pool.num_bucket_operations();
+        clock::time_point last_change = clock::now();
+        bool trimmed = false;
+
+        for (;;)
+        {
+            cv_.wait_for(lock, options_.interval, [this]() { return stop_; });
+
+            if (stop_)
+            {
+                return;
+            }
+
+            const clock::time_point now = clock::now();
+
+            const std::uint64_t current = pool.num_bucket_operations();
+
+            if (current != last)
+            {
+                last = current;
+                last_change = now;
+                trimmed = false;
+            }
+
+            const bool idle = options_.idle_time.count() > 0 && !trimmed &&
+                              now - last_change >= options_.idle_time;
+
+            if (idle || (!options_.limit_file.empty() && under_pressure()))
+            {
+                lock.unlock();
+                pool_trim();
+                lock.lock();
+
+                // Trim itself returns blocks of this thread's cache.
+                last = pool.num_bucket_operations();
+                trimmed = true;
+            }
+        }
+    }
+
+public:
+
+    static scavenger& instance() noexcept
+    {
+        alignas(scavenger) static unsigned char storage[sizeof(scavenger)];
+        static scavenger* instance = ::new (static_cast<void*>(storage)) scavenger();
+        return *instance;
+    }
+
+    void start(const pool_scavenger_options& options)
+    {
+        // Pool is created here, where exception can be reported.
+        small_size_allocator_singleton::instance(); // Can throw.
+
+        std::lock_guard<std::mutex> control_lock(control_mutex_);
+
+        stop_thread();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            options_ = options; // Can throw.
+            stop_ = false;
+        }
+
+        thread_ = std::thread(&scavenger::run, this); // Can throw.
+    }
+
+    void stop() noexcept
+    {
+        std::lock_guard<std::mutex> control_lock(control_mutex_);
+        stop_thread();
+    }
+
+private:
+
+    void stop_thread() noexcept
+    {
+        if (thread_.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cv_.notify_all();
+            thread_.join();
+        }
+    }
+};
+
+} // namespace dtl
+
+pool_resource::pool_resource(std::size_t max_block_size)
+    : alloc_(max_block_size, dtl::current_numa_node()) // Can throw.
+{}
+
+pool_resource::~pool_resource() noexcept
+{}
+
+void pool_resource::release() noexcept
+{
+    alloc_.release();
+}
+
+std::size_t pool_resource::trim() noexcept
+{
+    const std::size_t n = alloc_.trim();
+    return n + dtl::trim_arena();
+}
+
+bool pool_resource::set_relocator(std::size_t size, pool_relocator relocate, void* context, std::size_t alignment) noexcept
+{
+    const std::size_t index = alloc_.size_class(size, alignment);
+
+    if (index == alloc_.num_size_classes())
+    {
+        return false;
+    }
+
+    alloc_.set_relocator(index, relocate, context);
+    return true;
+}
+
+std::size_t pool_resource::compact(double max_occupancy)
+{
+    const std::size_t n = alloc_.compact(max_occupancy); // Can throw.
+    return n + trim();
+}
+
+pool_statistics pool_resource::stats() const
+{
+    pool_statistics s;
+    alloc_.stats(s); // Can throw.
+    return s;
+}
+
+std::size_t pool_trim() noexcept
+{
+    const std::size_t n = ::sfl::dtl::small_size_allocator_singleton::instance().trim();
+    return n + ::sfl::dtl::trim_arena();
+}
+
+std::size_t pool_trim(single_threaded) noexcept
+{
+    const std::size_t n = ::sfl::dtl::thread_local_small_size_allocator::trim();
+    return n + ::sfl::dtl::trim_arena();
+}
+
+void pool_start_scavenger(const pool_scavenger_options& options)
+{
+    ::sfl::dtl::scavenger::instance().start(options); // Can throw.
+}
+
+void pool_stop_scavenger() noexcept
+{
+    ::sfl::dtl::scavenger::instance().stop();
+}
+
+void pool_start_heap_profiler(std::size_t sample_period)
+{
+    ::sfl::dtl::heap_profiler::start(sample_period); // Can throw.
+}
+
+void pool_stop_heap_profiler() noexcept
+{
+    ::sfl::dtl::heap_profiler::stop();
+}
+
+std::string pool_heap_profile()
+{
+    return ::sfl::dtl::heap_profiler::profile(); // Can throw.
+}
+
+bool pool_dump_heap_profile(const std::string& path)
+{
+    const std::string profile = pool_heap_profile(); // Can throw.
+
+    std::FILE* f = std::fopen(path.c_str(), "w");
+
+    if (f == nullptr)
+    {
+        return false;
+    }
+
+    const bool ok = std::fwrite(profile.data(), 1, profile.size(), f) == profile.size();
+
+    return std::fclose(f) == 0 && ok;
+}
+
+std::size_t pool_num_nodes() noexcept
+{
+    return SFL_POOL_ALLOCATOR_NUMA_NODES;
+}
+
+void pool_set_thread_node(std::size_t node) noexcept
+{
+    ::sfl::dtl::small_size_allocator_singleton::instance().set_thread_node(node);
+}
+
+std::size_t pool_thread_node() noexcept
+{
+    return ::sfl::dtl::current_numa_node();
+}
+
+bool pool_deallocate(void* p) noexcept
+{
+    return ::sfl::dtl::small_size_allocator_singleton::instance().deallocate(p);
+}
+
+std::size_t pool_allocated_size(const void* p) noexcept
+{
+    return ::sfl::dtl::small_size_allocator_singleton::instance().allocated_size(p);
+}
+
+pool_statistics pool_stats()
+{
+    return ::sfl::dtl::small_size_allocator_singleton::instance().stats();
+}
+
+pool_statistics pool_stats(single_threaded)
+{
+    return ::sfl::dtl::thread_local_small_size_allocator::stats();
+}
+
+pool_statistics pool_node_stats(std::size_t node)
+{
+    return ::sfl::dtl::small_size_allocator_singleton::instance().node_stats(node);
+}
+
+std::string to_json(const pool_statistics& s)
+{
+    std::ostringstream os;
+
+    os << "{\"size_classes\":[";
+
+    for (std::size_t i = 0; i < s.size_classes.size(); ++i)
+    {
+        const pool_size_class_stats& c = s.size_classes[i];
+
+        os << (i == 0 ? "" : ",")
+           << "{\"block_size\":" << c.block_size
+           << ",\"num_allocations\":" << c.num_allocations
+           << ",\"num_deallocations\":" << c.num_deallocations
+           << ",\"num_live_blocks\":" << c.num_live_blocks
+           << ",\"num_cached_blocks\":" << c.num_cached_blocks
+           << ",\"num_buckets\":" << c.num_buckets
+           << ",\"num_blocks\":" << c.num_blocks
+           << ",\"num_used_blocks\":" << c.num_used_blocks
+           << ",\"bytes_mapped\":" << c.bytes_mapped
+           << ",\"fragmentation\":" << c.fragmentation
+           << "}";
+    }
+
+    os << "]"
+       << ",\"num_unpooled_allocations\":" << s.num_unpooled_allocations
+       << ",\"num_unpooled_deallocations\":" << s.num_unpooled_deallocations
+       << ",\"unpooled_bytes\":" << s.unpooled_bytes
+       << ",\"bytes_mapped\":" << s.bytes_mapped
+       << ",\"num_retained_buckets\":" << s.num_retained_buckets
+       << ",\"bytes_retained\":" << s.bytes_retained
+       << ",\"bytes_reserved\":" << s.bytes_reserved
+       << ",\"bytes_huge_pages\":" << s.bytes_huge_pages
+       << "}";
+
+    return os.str();
+}
 
 } // namespace sfl
@@ -21,15 +21,88 @@
 #ifndef SFL_POOL_ALLOCATOR_HPP
 #define SFL_POOL_ALLOCATOR_HPP
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <mutex>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<memory_resource>)
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <memory_resource>
+#endif
+#endif
+#endif
 
 #ifndef SFL_POOL_ALLOCATOR_MAX_BLOCK_SIZE
 #define SFL_POOL_ALLOCATOR_MAX_BLOCK_SIZE 128
 #endif
 
+#ifndef SFL_POOL_ALLOCATOR_MEDIUM_MAX_BLOCK_SIZE
+#define SFL_POOL_ALLOCATOR_MEDIUM_MAX_BLOCK_SIZE (32 * 1024)
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE
+#define SFL_POOL_ALLOCATOR_THREAD_CACHE_SIZE 32
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_SIZE_CLASS_QUANTUM
+#define SFL_POOL_ALLOCATOR_SIZE_CLASS_QUANTUM 8
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_SIZE_CLASS_GROUPS
+#define SFL_POOL_ALLOCATOR_SIZE_CLASS_GROUPS 4
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_BUCKET_SIZE
+#define SFL_POOL_ALLOCATOR_BUCKET_SIZE (128 * 1024)
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_BITMAP_BLOCK_SIZE
+#define SFL_POOL_ALLOCATOR_BITMAP_BLOCK_SIZE 2
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_ARENA_SIZE
+#if UINTPTR_MAX > 0xFFFFFFFF
+#define SFL_POOL_ALLOCATOR_ARENA_SIZE (1024 * 1024 * 1024)
+#else
+#define SFL_POOL_ALLOCATOR_ARENA_SIZE 0
+#endif
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_HUGE_PAGES
+#define SFL_POOL_ALLOCATOR_HUGE_PAGES 0
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_NUMA_NODES
+#define SFL_POOL_ALLOCATOR_NUMA_NODES 1
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_NUMA_SIMULATE
+#define SFL_POOL_ALLOCATOR_NUMA_SIMULATE 0
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_RETAINED_BUCKETS
+#define SFL_POOL_ALLOCATOR_RETAINED_BUCKETS 16
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_RETAIN_DECAY_MS
+#define SFL_POOL_ALLOCATOR_RETAIN_DECAY_MS 10000
+#endif
+
+#define SFL_POOL_ALLOCATOR_FIRST_FIT 1
+#define SFL_POOL_ALLOCATOR_MOST_FULL 2
+
+#ifndef SFL_POOL_ALLOCATOR_BUCKET_POLICY
+#define SFL_POOL_ALLOCATOR_BUCKET_POLICY SFL_POOL_ALLOCATOR_MOST_FULL
+#endif
+
 #if 0
 #define SFL_POOL_ALLOCATOR_EXTRA_CHECKS
 #endif
@@ -40,48 +113,395 @@
 #endif
 #endif
 
+#ifndef SFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK
+#ifdef SFL_POOL_ALLOCATOR_EXTRA_CHECKS
+#define SFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK 1
+#else
+#define SFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK 0
+#endif
+#endif
+
+#ifndef SFL_POOL_ALLOCATOR_HEAP_PROFILER
+#define SFL_POOL_ALLOCATOR_HEAP_PROFILER 1
+#endif
+
 #define SFL_ASSERT(x) assert(x)
 
 namespace sfl
 {
 
+/// Statistics of one size class.
+///
+struct pool_size_class_stats
+{
+    /// Block size of size class.
+    std::size_t block_size;
+
+    /// Number of allocations and deallocations of blocks of this size class.
+    std::uint64_t num_allocations;
+    std::uint64_t num_deallocations;
+
+    /// Number of allocated and not yet deallocated blocks.
+    std::size_t num_live_blocks;
+
+    /// Number of free blocks held in thread caches.
+    std::size_t num_cached_blocks;
+
+    /// Number of buckets and total number of blocks in them.
+    std::size_t num_buckets;
+    std::size_t num_blocks;
+
+    /// Number of blocks taken from buckets (live or cached).
+    std::size_t num_used_blocks;
+
+    /// Memory occupied by buckets of this size class.
+    std::size_t bytes_mapped;
+
+    /// Fraction of blocks in buckets that are not live (0 to 1).
+    double fragmentation;
+};
+
+/// Snapshot of pool statistics.
+///
+struct pool_statistics
+{
+    std::vector<pool_size_class_stats> size_classes;
+
+    /// Allocations dispatched to ::operator new because they are too large
+    /// (or over-aligned) to be allocated from the pool.
+    std::uint64_t num_unpooled_allocations;
+    std::uint64_t num_unpooled_deallocations;
+    std::size_t unpooled_bytes;
+
+    /// Memory occupied by buckets of all size classes.
+    std::size_t bytes_mapped;
+
+    /// Empty buckets retained for reuse and memory occupied by them.
+    /// Shared by all pools in the process.
+    std::size_t num_retained_buckets;
+    std::size_t bytes_retained;
+
+    /// Address space reserved for arena. Shared by all pools in the process.
+    std::size_t bytes_reserved;
+
+    /// Part of arena backed by explicit huge pages (MAP_HUGETLB).
+    /// Shared by all pools in the process.
+    std::size_t bytes_huge_pages;
+};
+
+/// Function that moves object from block `from` into uninitialized block
+/// `to` of the same size class and updates every pointer to the object.
+/// Called by compaction (see sfl::pool_resource::compact) with `context`
+/// given at registration. Must not throw and must not use the pool.
+///
+using pool_relocator = void (*)(void* from, void* to, void* context);
+
 namespace dtl
 {
 
+class bucket;
+
 class fixed_size_allocator;
 
+/// Largest block size allocated from the shared pool, and default for pool
+/// resources. Small blocks are pooled up to SFL_POOL_ALLOCATOR_MAX_BLOCK_SIZE,
+/// medium blocks up to SFL_POOL_ALLOCATOR_MEDIUM_MAX_BLOCK_SIZE.
+///
+constexpr std::size_t default_max_block_size =
+    SFL_POOL_ALLOCATOR_MEDIUM_MAX_BLOCK_SIZE > SFL_POOL_ALLOCATOR_MAX_BLOCK_SIZE
+        ? SFL_POOL_ALLOCATOR_MEDIUM_MAX_BLOCK_SIZE
+        : SFL_POOL_ALLOCATOR_MAX_BLOCK_SIZE;
+
 class small_size_allocator
 {
 private:
 
+    /// Largest pooled block size.
     const std::size_t max_block_size_;
+
+    /// Largest small block size. Size class of small block is found by table
+    /// lookup, size class of medium block by binary search.
+    const std::size_t small_max_block_size_;
+
+    /// NUMA node to which memory of buckets is bound.
+    const std::size_t node_;
+
+    /// Number of size classes. One fixed_size_allocator per size class.
+    std::size_t num_size_classes_;
+
+    /// Maps block size (0 to small_max_block_size_) to index of size class.
+    std::uint16_t* size_class_index_;
+
+    /// Block size of each size class.
+    std::size_t* size_class_sizes_;
+
     fixed_size_allocator* fixed_size_allocators_;
 
+    std::atomic<std::uint64_t> num_unpooled_allocations_;
+    std::atomic<std::uint64_t> num_unpooled_deallocations_;
+    std::atomic<std::size_t> unpooled_bytes_;
+
+private:
+
+    std::size_t medium_size_class(std::size_t block_size) const noexcept;
+
+    std::size_t over_aligned_size_class(std::size_t index, std::size_t alignment) const noexcept;
+
+    /// Stops heap profiler from tracking blocks of this allocator.
+    void forget_samples() noexcept;
+
 public:
 
-    small_size_allocator(std::size_t max_block_size);
+    small_size_allocator(std::size_t max_block_size, std::size_t node = 0);
 
     ~small_size_allocator() noexcept;
 
-    void* allocate(std::size_t block_size);
+    small_size_allocator(const small_size_allocator&) = delete;
+    small_size_allocator& operator=(const small_size_allocator&) = delete;
+
+    std::size_t max_block_size() const noexcept
+    {
+        return max_block_size_;
+    }
+
+    std::size_t num_size_classes() const noexcept
+    {
+        return num_size_classes_;
+    }
+
+    std::size_t node() const noexcept
+    {
+        return node_;
+    }
+
+    /// Returns index of size class for block of the given size and alignment,
+    /// or num_size_classes() if such block is not allocated from the pool.
+    ///
+    /// Blocks of size class are aligned to the largest power of two dividing
+    /// the class size. If that is not enough, the first larger size class
+    /// with sufficient alignment is used.
+    ///
+    std::size_t size_class(std::size_t block_size, std::size_t alignment = 1) const noexcept
+    {
+        if (block_size > max_block_size_)
+        {
+            return num_size_classes_;
+        }
+
+        const std::size_t index = block_size <= small_max_block_size_
+                                ? size_class_index_[block_size]
+                                : medium_size_class(block_size);
+
+        if (alignment <= size_class_alignment(index))
+        {
+            return index;
+        }
+
+        return over_aligned_size_class(index, alignment);
+    }
+
+    /// Returns block size of size class with the given index.
+    ///
+    std::size_t size_class_size(std::size_t index) const noexcept
+    {
+        SFL_ASSERT(index < num_size_classes_);
+        return size_class_sizes_[index];
+    }
+
+    /// Returns guaranteed alignment of blocks in size class with the given
+    /// index. That is the largest power of two dividing the class size.
+    ///
+    std::size_t size_class_alignment(std::size_t index) const noexcept
+    {
+        SFL_ASSERT(index < num_size_classes_);
+        return size_class_sizes_[index] & (~size_class_sizes_[index] + 1);
+    }
+
+    /// Allocates block of the given size aligned to the given alignment
+    /// (power of two). Blocks that are not allocated from the pool are
+    /// allocated by ::operator new, or by aligned ::operator new if
+    /// alignment is greater than alignof(std::max_align_t).
+    ///
+    void* allocate(std::size_t block_size, std::size_t alignment = 1);
+
+    /// Allocates block of size class with the given index. Unlike allocate,
+    /// the allocation is not sampled by heap profiler, so it can be called
+    /// with lock of the pool held.
+    ///
+    void* allocate_block(std::size_t index);
+
+    /// Deallocates block. Size and alignment must be the same as those
+    /// passed to allocate.
+    ///
+    void deallocate(void* p, std::size_t block_size, std::size_t alignment = 1) noexcept;
+
+    /// Returns index of size class of the given bucket if the bucket belongs
+    /// to this allocator, otherwise num_size_classes().
+    ///
+    std::size_t bucket_size_class(const bucket* b) const noexcept;
+
+    /// Returns index of size class of pooled block of this allocator, or
+    /// num_size_classes() if the block does not belong to this allocator
+    /// (e.g. it was allocated by ::operator new or by another pool).
+    /// Needs only the pointer. Bucket is found in bucket map.
+    ///
+    std::size_t size_class_of(const void* p) const noexcept;
+
+    /// Deallocates pooled block without its size and alignment. Returns
+    /// false and does nothing if the block does not belong to this allocator.
+    ///
+    bool deallocate(void* p) noexcept;
+
+    /// Allocates `n` blocks of the given size and alignment and stores them
+    /// into `out`. Blocks are taken from buckets in runs. No effects if throws.
+    ///
+    void allocate_bulk(std::size_t block_size, std::size_t n, void** out, std::size_t alignment = 1);
+
+    /// Allocates `n` blocks of size class with the given index. Unlike
+    /// allocate_bulk, the allocations are not sampled by heap profiler, so it
+    /// can be called with lock of the pool held. No effects if throws.
+    ///
+    void allocate_bulk_blocks(std::size_t index, std::size_t n, void** out);
+
+    /// Deallocates `n` blocks. Size and alignment must be the same as those
+    /// passed to allocate. Consecutive blocks from the same bucket are
+    /// returned as one run.
+    ///
+    void deallocate_bulk(std::size_t block_size, std::size_t n, void* const* blocks, std::size_t alignment = 1) noexcept;
+
+    /// Deallocates block that may belong to another small_size_allocator
+    /// owned by another thread. Block of such allocator is pushed into
+    /// lock-free remote free list of its bucket, without blocking the owner.
+    /// The owner returns it into the bucket when it runs out of free blocks.
+    /// Unpooled blocks are counted by this allocator. Returns true if bucket
+    /// was handed over to its owner because its remote free list had been
+    /// empty.
+    ///
+    bool deallocate_shared(void* p, std::size_t block_size, std::size_t alignment = 1) noexcept;
+
+    /// Bulk version of deallocate_shared.
+    ///
+    bool deallocate_bulk_shared(std::size_t block_size, std::size_t n, void* const* blocks, std::size_t alignment = 1) noexcept;
 
-    void deallocate(void* p, std::size_t block_size) noexcept;
+    /// Deallocates block by thread that has no small_size_allocator. Pooled
+    /// block is found in bucket map and pushed into remote free list of its
+    /// bucket. Other blocks are deallocated by ::operator delete and are not
+    /// counted by any allocator. Never allocates. Returns true if bucket was
+    /// handed over to its owner.
+    ///
+    static bool deallocate_foreign(void* p, std::size_t alignment = 1) noexcept;
+
+    /// Returns blocks deallocated by other threads (see deallocate_shared)
+    /// into their buckets. Must be called by the owner.
+    ///
+    void collect_remote() noexcept;
+
+    /// Unmaps all buckets at once, including blocks that are still in use.
+    /// Blocks that are not allocated from the pool are not affected.
+    ///
+    void release() noexcept;
+
+    /// Returns empty buckets, including those kept for future allocations,
+    /// and purges pages of free blocks in partially used buckets. Empty
+    /// buckets go to the arena, where they are retained until arena is
+    /// trimmed. Returns number of bytes returned to the operating system.
+    /// Must be called by the owner.
+    ///
+    std::size_t trim() noexcept;
+
+    /// Registers function that moves live blocks of size class with the given
+    /// index during compaction. Nullptr unregisters it.
+    ///
+    void set_relocator(std::size_t index, pool_relocator relocate, void* context) noexcept;
+
+    /// Moves live blocks of size classes with registered relocator out of
+    /// buckets whose occupancy is at most `max_occupancy` into denser
+    /// buckets, and destroys emptied buckets. Returns number of bytes
+    /// returned to the operating system, not counting buckets that are
+    /// retained by arena. Every used block must be live (no thread caches).
+    /// Must be called by the owner. Can throw std::bad_alloc; size classes
+    /// compacted before that stay compacted.
+    ///
+    std::size_t compact(double max_occupancy);
+
+    /// Returns number of blocks taken from and returned into buckets so far.
+    /// Blocks cached by threads are not counted until they reach buckets.
+    ///
+    std::uint64_t num_bucket_operations() const noexcept;
+
+    /// Returns true if no block of buckets is in use.
+    ///
+    bool is_empty() const noexcept;
+
+    /// Fills statistics snapshot.
+    ///
+    void stats(pool_statistics& s) const;
 };
 
+/// Returns memory of retained empty buckets of the arena (shared by all
+/// pools) to the operating system. Returns number of returned bytes.
+///
+std::size_t trim_arena() noexcept;
+
+/// Returns NUMA node of the calling thread. It is set by
+/// sfl::pool_set_thread_node, or detected on first use.
+///
+std::size_t current_numa_node() noexcept;
+
+class thread_cache;
+
 class small_size_allocator_singleton
 {
 private:
 
+    friend class thread_cache;
+
+    /// Pool of one NUMA node.
+    struct node_pool
+    {
+        std::mutex mutex;
+
+        small_size_allocator alloc;
+
+        /// Per size class: number of allocations and deallocations performed
+        /// without thread cache, plus those of thread caches that were
+        /// destroyed.
+        std::uint64_t* retired_counts;
+
+        explicit node_pool(std::size_t node);
+
+        ~node_pool() noexcept;
+
+        node_pool(const node_pool&) = delete;
+        node_pool& operator=(const node_pool&) = delete;
+    };
+
+    static constexpr std::size_t num_nodes = SFL_POOL_ALLOCATOR_NUMA_NODES;
+
+    node_pool* nodes_[num_nodes];
+
+    /// Protects list of live thread caches. Locked before mutex of any node.
     std::mutex mutex_;
-    small_size_allocator alloc_;
+
+    /// List of live thread caches.
+    thread_cache* thread_caches_;
 
 private:
 
-    small_size_allocator_singleton()
-        : alloc_(SFL_POOL_ALLOCATOR_MAX_BLOCK_SIZE)
-    {}
+    /// Size classes are the same in all nodes.
+    const small_size_allocator& classes() const noexcept
+    {
+        return nodes_[0]->alloc;
+    }
+
+    /// Returns pool of node that owns the given pooled block of size class
+    /// with the given index.
+    node_pool& owner_of(void* p, std::size_t index) noexcept;
 
-    ~small_size_allocator_singleton() = default;
+    small_size_allocator_singleton();
+
+    /// Never destroyed. See instance().
+    ~small_size_allocator_singleton() = delete;
 
     small_size_allocator_singleton(const small_size_allocator_singleton&) = delete;
     small_size_allocator_singleton(small_size_allocator_singleton&&) = delete;
@@ -93,55 +513,387 @@ public:
 
     static small_size_allocator_singleton& instance()
     {
-        // Meyers singleton. Thread safe in C++11.
-        static small_size_allocator_singleton instance;
-        return instance;
+        // Constructed in static storage and intentionally never destroyed,
+        // so that blocks can be deallocated during and after static
+        // destruction (e.g. by free() of the malloc replacement library).
+        // Initialization is thread safe in C++11.
+        alignas(small_size_allocator_singleton) static unsigned char storage[sizeof(small_size_allocator_singleton)];
+        static small_size_allocator_singleton* instance =
+            ::new (static_cast<void*>(storage)) small_size_allocator_singleton(); // Can throw.
+        return *instance;
     }
 
-    void* allocate(std::size_t block_size)
+    /// Returns the largest pooled block size.
+    ///
+    std::size_t max_block_size() const noexcept
     {
-        std::lock_guard<std::mutex> lock(mutex_);
-        return alloc_.allocate(block_size);
+        return classes().max_block_size();
     }
 
-    void deallocate(void* p, std::size_t block_size) noexcept
+    /// Allocates block from the calling thread's cache. The cache is refilled
+    /// from the shared pool when it runs dry. Falls back to locked allocation
+    /// from the shared pool if thread cache is disabled or not available.
+    ///
+    void* allocate(std::size_t block_size, std::size_t alignment = 1);
+
+    /// Returns block into the calling thread's cache. The cache is flushed
+    /// into the shared pool when it is full. Block can be deallocated by any
+    /// thread, not only by the thread that allocated it.
+    ///
+    void deallocate(void* p, std::size_t block_size, std::size_t alignment = 1) noexcept;
+
+    /// Deallocates block without its size. Returns false and does nothing if
+    /// the block was not allocated from the shared pool (e.g. it was
+    /// allocated by ::operator new). Costs one lookup in bucket map more than
+    /// the sized version.
+    ///
+    bool deallocate(void* p) noexcept;
+
+    /// Returns usable size of block allocated from the shared pool (block
+    /// size of its size class), or 0 if the block was not allocated from
+    /// the shared pool.
+    ///
+    std::size_t allocated_size(const void* p) const noexcept;
+
+    /// Returns true if block of the given size and alignment is allocated
+    /// from the shared pool.
+    ///
+    bool is_pooled(std::size_t block_size, std::size_t alignment = 1) const noexcept
     {
-        std::lock_guard<std::mutex> lock(mutex_);
-        alloc_.deallocate(p, block_size);
+        return classes().size_class(block_size, alignment) != classes().num_size_classes();
+    }
+
+    /// Allocates `n` blocks from the shared pool under one lock acquisition.
+    /// Thread cache is bypassed. No effects if throws.
+    ///
+    void allocate_bulk(std::size_t block_size, std::size_t n, void** out, std::size_t alignment = 1);
+
+    /// Deallocates `n` blocks into the shared pool under one lock acquisition
+    /// per NUMA node. Thread cache is bypassed.
+    ///
+    void deallocate_bulk(std::size_t block_size, std::size_t n, void* const* blocks, std::size_t alignment = 1) noexcept;
+
+    pool_statistics stats();
+
+    /// Returns bucket-level statistics of pool of the given NUMA node.
+    ///
+    pool_statistics node_stats(std::size_t node);
+
+    /// Sets NUMA node of the calling thread.
+    ///
+    void set_thread_node(std::size_t node) noexcept;
+
+    /// Flushes the calling thread's cache and trims pools of all nodes.
+    /// Blocks in caches of other threads stay cached. Returns number of
+    /// bytes returned to the operating system.
+    ///
+    std::size_t trim() noexcept;
+
+    /// Returns number of blocks taken from and returned into buckets of all
+    /// nodes so far.
+    ///
+    std::uint64_t num_bucket_operations() noexcept;
+
+    /// Locks every mutex of the pool and of the structures it shares with
+    /// other pools (arena, bucket map, heap profiler) in fixed order. Called
+    /// before fork, so that the child does not inherit mutex locked by
+    /// another thread.
+    ///
+    void lock_all() noexcept;
+
+    /// Unlocks mutexes locked by lock_all. Called in the parent and in the
+    /// child after fork.
+    ///
+    void unlock_all() noexcept;
+};
+
+/// Pool private to the calling thread. Used by sfl::pool_allocator with
+/// policy sfl::single_threaded. No locks, no thread caches.
+///
+/// Blocks deallocated by other threads are pushed into remote free lists of
+/// their buckets and collected by the owning thread when its current bucket
+/// runs out of free blocks.
+///
+/// Pool is created on the first allocation in the thread. Thread that only
+/// deallocates does not create pool. At thread exit the pool is destroyed if
+/// all its blocks have been deallocated, otherwise it is abandoned: other
+/// threads keep deallocating its blocks remotely, and the pool is destroyed
+/// by the thread whose deallocation (or trim, or creation of new pool) finds
+/// it empty.
+///
+class thread_local_small_size_allocator
+{
+public:
+
+    static void* allocate(std::size_t block_size, std::size_t alignment = 1);
+
+    static void deallocate(void* p, std::size_t block_size, std::size_t alignment = 1) noexcept;
+
+    static void allocate_bulk(std::size_t block_size, std::size_t n, void** out, std::size_t alignment = 1);
+
+    static void deallocate_bulk(std::size_t block_size, std::size_t n, void* const* blocks, std::size_t alignment = 1) noexcept;
+
+    /// Returns statistics of the calling thread's pool, plus bucket-level
+    /// statistics of abandoned pools whose blocks are still in use.
+    ///
+    static pool_statistics stats();
+
+    /// Trims the calling thread's pool, if it exists, and destroys abandoned
+    /// pools that have become empty.
+    ///
+    static std::size_t trim() noexcept;
+};
+
+} // namespace dtl
+
+/// Threading policy of sfl::pool_allocator. All threads share one pool.
+/// Blocks can be deallocated by any thread.
+///
+struct multi_threaded {};
+
+/// Threading policy of sfl::pool_allocator. Every thread has its own pool,
+/// without locks or thread caches. Blocks can be deallocated by any thread;
+/// blocks of another thread's pool are returned to it through lock-free
+/// remote free lists.
+///
+struct single_threaded {};
+
+namespace dtl
+{
+
+template <typename ThreadingPolicy>
+struct pool_backend;
+
+template <>
+struct pool_backend<multi_threaded>
+{
+    static void init()
+    {
+        // Call member function instance() to make sure that singleton is
+        // created before any container using this allocator is created.
+        // Singleton is never destroyed, so containers that are global or
+        // static objects can be destroyed in any order.
+        small_size_allocator_singleton::instance(); // Can throw.
+    }
+
+    static void* allocate(std::size_t block_size, std::size_t alignment)
+    {
+        return small_size_allocator_singleton::instance().allocate(block_size, alignment); // Can throw.
+    }
+
+    static void deallocate(void* p, std::size_t block_size, std::size_t alignment) noexcept
+    {
+        small_size_allocator_singleton::instance().deallocate(p, block_size, alignment);
+    }
+
+    static void allocate_bulk(std::size_t block_size, std::size_t n, void** out, std::size_t alignment)
+    {
+        small_size_allocator_singleton::instance().allocate_bulk(block_size, n, out, alignment); // Can throw.
+    }
+
+    static void deallocate_bulk(std::size_t block_size, std::size_t n, void* const* blocks, std::size_t alignment) noexcept
+    {
+        small_size_allocator_singleton::instance().deallocate_bulk(block_size, n, blocks, alignment);
+    }
+};
+
+template <>
+struct pool_backend<single_threaded>
+{
+    static void init() noexcept
+    {
+        // Nothing to do. Pool of thread is never destroyed while it has
+        // blocks in use.
+    }
+
+    static void* allocate(std::size_t block_size, std::size_t alignment)
+    {
+        return thread_local_small_size_allocator::allocate(block_size, alignment); // Can throw.
+    }
+
+    static void deallocate(void* p, std::size_t block_size, std::size_t alignment) noexcept
+    {
+        thread_local_small_size_allocator::deallocate(p, block_size, alignment);
+    }
+
+    static void allocate_bulk(std::size_t block_size, std::size_t n, void** out, std::size_t alignment)
+    {
+        thread_local_small_size_allocator::allocate_bulk(block_size, n, out, alignment); // Can throw.
+    }
+
+    static void deallocate_bulk(std::size_t block_size, std::size_t n, void* const* blocks, std::size_t alignment) noexcept
+    {
+        thread_local_small_size_allocator::deallocate_bulk(block_size, n, blocks, alignment);
     }
 };
 
 } // namespace dtl
 
-template <typename T>
+/// Returns memory that the pool used by sfl::pool_allocator does not need
+/// to the operating system: empty buckets (including one bucket per size
+/// class kept for future allocations), pages of partially used buckets that
+/// hold only free blocks, and retained empty buckets of the arena. The
+/// calling thread's cache is flushed first. Returns number of bytes
+/// returned to the operating system.
+///
+std::size_t pool_trim() noexcept;
+
+/// Trims the calling thread's pool used by sfl::pool_allocator with policy
+/// sfl::single_threaded, and retained empty buckets of the arena.
+///
+std::size_t pool_trim(single_threaded) noexcept;
+
+/// Options of background scavenger. See sfl::pool_start_scavenger.
+///
+struct pool_scavenger_options
+{
+    /// How often scavenger wakes up.
+    std::chrono::milliseconds interval = std::chrono::milliseconds(1000);
+
+    /// Pool is trimmed once no bucket has been taken from or returned to
+    /// the pool for this long. Zero disables trimming on idle.
+    std::chrono::milliseconds idle_time = std::chrono::milliseconds(10000);
+
+    /// File that holds memory limit in bytes, e.g. cgroup v2 file
+    /// "/sys/fs/cgroup/memory.high". Value "max" means no limit. Empty path
+    /// disables trimming on memory pressure.
+    std::string limit_file;
+
+    /// File that holds current memory usage in bytes, e.g. cgroup v2 file
+    /// "/sys/fs/cgroup/memory.current". If empty, resident set size of the
+    /// process is used.
+    std::string usage_file;
+
+    /// Pool is trimmed on every wake up while usage is at least this
+    /// fraction of limit.
+    double pressure_ratio = 0.9;
+};
+
+/// Starts background thread that calls sfl::pool_trim() when the pool has
+/// been idle or when memory usage approaches limit. Scavenger that is
+/// already running is stopped first. Throws std::system_error if thread
+/// cannot be started.
+///
+void pool_start_scavenger(const pool_scavenger_options& options = pool_scavenger_options());
+
+/// Stops background scavenger and waits for its thread to finish. No
+/// effects if scavenger is not running.
+///
+void pool_stop_scavenger() noexcept;
+
+/// Starts sampling heap profiler of pooled allocations of all pools. On
+/// average one allocation per `sample_period` allocated bytes is sampled:
+/// its stack trace and requested size are recorded and the block is tracked
+/// until it is deallocated. Profiler that is already running keeps its
+/// samples and continues with the new period. `sample_period` must be
+/// greater than zero. Can throw std::bad_alloc.
+///
+void pool_start_heap_profiler(std::size_t sample_period = 512 * 1024);
+
+/// Stops heap profiler and drops its samples. No effects if profiler is not
+/// running.
+///
+void pool_stop_heap_profiler() noexcept;
+
+/// Returns heap profile of sampled blocks in legacy text format of pprof
+/// heap profile ("heap_v2"), which can be read by `pprof` and `go tool
+/// pprof`. Can throw std::bad_alloc.
+///
+std::string pool_heap_profile();
+
+/// Writes heap profile (see sfl::pool_heap_profile) into file. Returns false
+/// if the file cannot be written. Can throw std::bad_alloc.
+///
+bool pool_dump_heap_profile(const std::string& path);
+
+/// Returns number of NUMA nodes for which the pool has separate pools.
+///
+std::size_t pool_num_nodes() noexcept;
+
+/// Binds the calling thread to the given NUMA node (less than
+/// pool_num_nodes()). Following allocations of the thread come from pool of
+/// that node. Blocks in the thread's cache are returned to the previous node.
+///
+void pool_set_thread_node(std::size_t node) noexcept;
+
+/// Returns NUMA node of the calling thread.
+///
+std::size_t pool_thread_node() noexcept;
+
+/// Deallocates block allocated by sfl::pool_allocator (policy
+/// sfl::multi_threaded) without its size. Returns false and does nothing if
+/// the block was not allocated from the pool, e.g. it was too large and was
+/// allocated by ::operator new, or it was allocated by another allocator.
+///
+bool pool_deallocate(void* p) noexcept;
+
+/// Returns usable size of block allocated by sfl::pool_allocator (policy
+/// sfl::multi_threaded), or 0 if the block was not allocated from the pool.
+///
+std::size_t pool_allocated_size(const void* p) noexcept;
+
+/// Returns snapshot of statistics of the pool used by sfl::pool_allocator.
+/// Counters of different threads are read without stopping them, so the
+/// snapshot is consistent only when there is no concurrent activity.
+///
+pool_statistics pool_stats();
+
+/// Returns snapshot of statistics of the calling thread's pool used by
+/// sfl::pool_allocator with policy sfl::single_threaded.
+///
+pool_statistics pool_stats(single_threaded);
+
+/// Returns bucket-level statistics of pool of the given NUMA node used by
+/// sfl::pool_allocator. Allocations and deallocations are counted as blocks
+/// taken from and returned into buckets of that node.
+///
+pool_statistics pool_node_stats(std::size_t node);
+
+/// Calls `callback(const pool_size_class_stats&)` for every size class of
+/// the pool used by sfl::pool_allocator.
+///
+template <typename Callback>
+void pool_stats(Callback callback)
+{
+    const pool_statistics s = pool_stats();
+    for (const auto& c : s.size_classes)
+    {
+        callback(c);
+    }
+}
+
+/// Returns statistics in JSON format.
+///
+std::string to_json(const pool_statistics& s);
+
+template <typename T, typename ThreadingPolicy = multi_threaded>
 class pool_allocator
 {
+private:
+
+    using backend = ::sfl::dtl::pool_backend<ThreadingPolicy>;
+
 public:
 
     using value_type = T;
 
     pool_allocator()
     {
-        // Call member function instance() to make sure that singleton is
-        // created before any container using this allocator is created.
-        // This guarantees that singleton's destructor is executed after
-        // the last container's destructor is executed, even if some of
-        // containers is global or static object.
-        ::sfl::dtl::small_size_allocator_singleton::instance(); // Can throw.
+        backend::init(); // Can throw.
     }
 
     pool_allocator(const pool_allocator&) noexcept
     {}
 
     template <typename U>
-    pool_allocator(const pool_allocator<U>&) noexcept
+    pool_allocator(const pool_allocator<U, ThreadingPolicy>&) noexcept
     {}
 
     pool_allocator(pool_allocator&&) noexcept
     {}
 
     template <typename U>
-    pool_allocator(pool_allocator<U>&&) noexcept
+    pool_allocator(pool_allocator<U, ThreadingPolicy>&&) noexcept
     {}
 
     ~pool_allocator() noexcept
@@ -159,9 +911,7 @@ public:
 
     T* allocate(std::size_t n, const void* = nullptr)
     {
-        void* p = ::sfl::dtl::small_size_allocator_singleton::instance().allocate(
-            n * sizeof(T)
-        );
+        void* p = backend::allocate(n * sizeof(T), alignof(T)); // Can throw.
 
         // Alignment check
         SFL_ASSERT(std::size_t(p) % alignof(T) == 0);
@@ -171,24 +921,440 @@ public:
 
     void deallocate(T* p, std::size_t n) noexcept
     {
-        ::sfl::dtl::small_size_allocator_singleton::instance().deallocate(
-            static_cast<void*>(p), n * sizeof(T)
-        );
+        backend::deallocate(static_cast<void*>(p), n * sizeof(T), alignof(T));
+    }
+
+    /// Allocates `count` separate blocks, each for one object of type T,
+    /// and stores them into `out`. No effects if throws.
+    ///
+    void allocate_bulk(std::size_t count, T** out)
+    {
+        backend::allocate_bulk(sizeof(T), count, reinterpret_cast<void**>(out), alignof(T)); // Can throw.
+    }
+
+    /// Deallocates `count` blocks allocated by allocate_bulk or by
+    /// allocate(1).
+    ///
+    void deallocate_bulk(std::size_t count, T* const* blocks) noexcept
+    {
+        backend::deallocate_bulk(sizeof(T), count, reinterpret_cast<void* const*>(blocks), alignof(T));
     }
 };
 
-template <typename T1, typename T2>
-bool operator==(const pool_allocator<T1>&, const pool_allocator<T2>&) noexcept
+template <typename T1, typename T2, typename ThreadingPolicy>
+bool operator==(const pool_allocator<T1, ThreadingPolicy>&, const pool_allocator<T2, ThreadingPolicy>&) noexcept
 {
     return true;
 }
 
-template <typename T1, typename T2>
-bool operator!=(const pool_allocator<T1>&, const pool_allocator<T2>&) noexcept
+template <typename T1, typename T2, typename ThreadingPolicy>
+bool operator!=(const pool_allocator<T1, ThreadingPolicy>&, const pool_allocator<T2, ThreadingPolicy>&) noexcept
 {
     return false;
 }
 
+/// Memory pool owned by the user, independent of the pool used by
+/// sfl::pool_allocator. It has its own buckets, so allocations from
+/// different pools do not fragment each other's buckets.
+///
+/// Pool is not thread safe. It has no lock and no thread caches. It is meant
+/// to be used by one thread at a time (e.g. per-request pool owned by the
+/// thread that handles the request).
+///
+/// Destructor and release() return all buckets at once, without
+/// deallocating blocks one by one.
+///
+class pool_resource
+{
+private:
+
+    dtl::small_size_allocator alloc_;
+
+public:
+
+    explicit pool_resource(std::size_t max_block_size = ::sfl::dtl::default_max_block_size);
+
+    ~pool_resource() noexcept;
+
+    pool_resource(const pool_resource&) = delete;
+    pool_resource& operator=(const pool_resource&) = delete;
+
+    std::size_t max_block_size() const noexcept
+    {
+        return alloc_.max_block_size();
+    }
+
+    /// Allocates block of the given size aligned to the given alignment
+    /// (power of two). Blocks larger than max_block_size() are allocated
+    /// by ::operator new.
+    ///
+    void* allocate(std::size_t size, std::size_t alignment = 1)
+    {
+        return alloc_.allocate(size, alignment); // Can throw.
+    }
+
+    /// Deallocates block. Size and alignment must be the same as those
+    /// passed to allocate.
+    ///
+    void deallocate(void* p, std::size_t size, std::size_t alignment = 1) noexcept
+    {
+        alloc_.deallocate(p, size, alignment);
+    }
+
+    /// Deallocates block without its size and alignment. Returns false and
+    /// does nothing if the block was not allocated from this pool (e.g. it
+    /// is larger than max_block_size() and was allocated by ::operator new).
+    ///
+    bool deallocate(void* p) noexcept
+    {
+        return alloc_.deallocate(p);
+    }
+
+    /// Returns usable size of block allocated from this pool (block size of
+    /// its size class), or 0 if the block was not allocated from this pool.
+    ///
+    std::size_t allocated_size(const void* p) const noexcept
+    {
+        const std::size_t index = alloc_.size_class_of(p);
+        return index == alloc_.num_size_classes() ? 0 : alloc_.size_class_size(index);
+    }
+
+    /// Allocates `n` blocks of the given size and alignment and stores them
+    /// into `out`. No effects if throws.
+    ///
+    void allocate_bulk(std::size_t size, std::size_t n, void** out, std::size_t alignment = 1)
+    {
+        alloc_.allocate_bulk(size, n, out, alignment); // Can throw.
+    }
+
+    /// Deallocates `n` blocks. Size and alignment must be the same as those
+    /// passed to allocate.
+    ///
+    void deallocate_bulk(std::size_t size, std::size_t n, void* const* blocks, std::size_t alignment = 1) noexcept
+    {
+        alloc_.deallocate_bulk(size, n, blocks, alignment);
+    }
+
+    /// Returns memory of all buckets, including blocks that are still in
+    /// use. Blocks larger than max_block_size() are not released; they must
+    /// be deallocated one by one.
+    ///
+    void release() noexcept;
+
+    /// Returns empty buckets and purges pages of free blocks in partially
+    /// used buckets, then returns retained buckets of the arena (shared by
+    /// all pools) to the operating system. Returns number of bytes returned.
+    ///
+    std::size_t trim() noexcept;
+
+    /// Registers function that moves live blocks of the given size and
+    /// alignment during compaction. Registration applies to the whole size
+    /// class, so it must be able to move every block of that class, e.g.
+    /// when the pool is dedicated to one type or one container. Nullptr
+    /// unregisters it. Returns false if such blocks are not allocated from
+    /// the pool.
+    ///
+    bool set_relocator(std::size_t size, pool_relocator relocate, void* context, std::size_t alignment = 1) noexcept;
+
+    /// Moves live blocks of size classes with registered relocator out of
+    /// partially used buckets whose occupancy is at most `max_occupancy`
+    /// into denser buckets, releases emptied buckets and trims the pool.
+    /// Returns number of bytes returned to the operating system. Can throw
+    /// std::bad_alloc; size classes compacted before that stay compacted.
+    ///
+    std::size_t compact(double max_occupancy = 0.25);
+
+    /// Returns snapshot of statistics of this pool.
+    ///
+    pool_statistics stats() const;
+};
+
+/// Stateful allocator that allocates from the given sfl::pool_resource.
+///
+/// Instances compare equal if they use the same pool. Allocator propagates
+/// on container copy assignment, move assignment and swap, so memory is
+/// always deallocated into the pool it was allocated from.
+///
+template <typename T>
+class pool_resource_allocator
+{
+private:
+
+    template <typename U>
+    friend class pool_resource_allocator;
+
+    pool_resource* resource_;
+
+public:
+
+    using value_type = T;
+
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    pool_resource_allocator(pool_resource& resource) noexcept
+        : resource_(&resource)
+    {}
+
+    pool_resource_allocator(const pool_resource_allocator&) noexcept = default;
+
+    template <typename U>
+    pool_resource_allocator(const pool_resource_allocator<U>& other) noexcept
+        : resource_(other.resource_)
+    {}
+
+    pool_resource_allocator& operator=(const pool_resource_allocator&) noexcept = default;
+
+    pool_resource* resource() const noexcept
+    {
+        return resource_;
+    }
+
+    T* allocate(std::size_t n, const void* = nullptr)
+    {
+        void* p = resource_->allocate(n * sizeof(T), alignof(T)); // Can throw.
+
+        // Alignment check
+        SFL_ASSERT(std::size_t(p) % alignof(T) == 0);
+
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        resource_->deallocate(static_cast<void*>(p), n * sizeof(T), alignof(T));
+    }
+};
+
+template <typename T1, typename T2>
+bool operator==(const pool_resource_allocator<T1>& x, const pool_resource_allocator<T2>& y) noexcept
+{
+    return x.resource() == y.resource();
+}
+
+template <typename T1, typename T2>
+bool operator!=(const pool_resource_allocator<T1>& x, const pool_resource_allocator<T2>& y) noexcept
+{
+    return !(x == y);
+}
+
+#if defined(__cpp_lib_memory_resource)
+
+namespace pmr
+{
+
+/// Implementation of std::pmr::memory_resource that allocates from its own
+/// pool. Thread safe. Every allocation and deallocation locks the mutex,
+/// except those of blocks larger than max_block_size(), which are allocated
+/// by ::operator new.
+///
+class synchronized_pool_resource : public std::pmr::memory_resource
+{
+private:
+
+    mutable std::mutex mutex_;
+    ::sfl::dtl::small_size_allocator alloc_;
+
+public:
+
+    explicit synchronized_pool_resource(std::size_t max_block_size = ::sfl::dtl::default_max_block_size)
+        : alloc_(max_block_size, ::sfl::dtl::current_numa_node()) // Can throw.
+    {}
+
+    synchronized_pool_resource(const synchronized_pool_resource&) = delete;
+    synchronized_pool_resource& operator=(const synchronized_pool_resource&) = delete;
+
+    std::size_t max_block_size() const noexcept
+    {
+        return alloc_.max_block_size();
+    }
+
+    /// Returns memory of all buckets, including blocks that are still in
+    /// use. Blocks larger than max_block_size() are not released.
+    ///
+    void release() noexcept
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        alloc_.release();
+    }
+
+    /// Returns memory this pool does not need to the operating system.
+    /// See sfl::pool_trim.
+    ///
+    std::size_t trim() noexcept
+    {
+        std::size_t n;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            n = alloc_.trim();
+        }
+        return n + ::sfl::dtl::trim_arena();
+    }
+
+    /// See sfl::pool_resource::set_relocator.
+    ///
+    bool set_relocator(std::size_t size, pool_relocator relocate, void* context, std::size_t alignment = 1) noexcept
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const std::size_t index = alloc_.size_class(size, alignment);
+        if (index == alloc_.num_size_classes())
+        {
+            return false;
+        }
+        alloc_.set_relocator(index, relocate, context);
+        return true;
+    }
+
+    /// See sfl::pool_resource::compact. Relocator is called with the pool
+    /// locked.
+    ///
+    std::size_t compact(double max_occupancy = 0.25)
+    {
+        std::size_t n;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            n = alloc_.compact(max_occupancy); // Can throw.
+        }
+        return n + trim();
+    }
+
+    /// Returns snapshot of statistics of this pool.
+    ///
+    pool_statistics stats() const
+    {
+        pool_statistics s;
+        std::lock_guard<std::mutex> lock(mutex_);
+        alloc_.stats(s); // Can throw.
+        return s;
+    }
+
+protected:
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        if (alloc_.size_class(bytes, alignment) == alloc_.num_size_classes())
+        {
+            // No need to lock. Dispatched to ::operator new.
+            return alloc_.allocate(bytes, alignment); // Can throw.
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        return alloc_.allocate(bytes, alignment); // Can throw.
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+    {
+        if (alloc_.size_class(bytes, alignment) == alloc_.num_size_classes())
+        {
+            // No need to lock. Dispatched to ::operator delete.
+            alloc_.deallocate(p, bytes, alignment);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        alloc_.deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+/// Implementation of std::pmr::memory_resource that allocates from its own
+/// pool. Not thread safe, it has no lock.
+///
+class unsynchronized_pool_resource : public std::pmr::memory_resource
+{
+private:
+
+    ::sfl::dtl::small_size_allocator alloc_;
+
+public:
+
+    explicit unsynchronized_pool_resource(std::size_t max_block_size = ::sfl::dtl::default_max_block_size)
+        : alloc_(max_block_size, ::sfl::dtl::current_numa_node()) // Can throw.
+    {}
+
+    unsynchronized_pool_resource(const unsynchronized_pool_resource&) = delete;
+    unsynchronized_pool_resource& operator=(const unsynchronized_pool_resource&) = delete;
+
+    std::size_t max_block_size() const noexcept
+    {
+        return alloc_.max_block_size();
+    }
+
+    /// Returns memory of all buckets, including blocks that are still in
+    /// use. Blocks larger than max_block_size() are not released.
+    ///
+    void release() noexcept
+    {
+        alloc_.release();
+    }
+
+    /// Returns memory this pool does not need to the operating system.
+    /// See sfl::pool_trim.
+    ///
+    std::size_t trim() noexcept
+    {
+        const std::size_t n = alloc_.trim();
+        return n + ::sfl::dtl::trim_arena();
+    }
+
+    /// See sfl::pool_resource::set_relocator.
+    ///
+    bool set_relocator(std::size_t size, pool_relocator relocate, void* context, std::size_t alignment = 1) noexcept
+    {
+        const std::size_t index = alloc_.size_class(size, alignment);
+        if (index == alloc_.num_size_classes())
+        {
+            return false;
+        }
+        alloc_.set_relocator(index, relocate, context);
+        return true;
+    }
+
+    /// See sfl::pool_resource::compact.
+    ///
+    std::size_t compact(double max_occupancy = 0.25)
+    {
+        const std::size_t n = alloc_.compact(max_occupancy); // Can throw.
+        return n + trim();
+    }
+
+    /// Returns snapshot of statistics of this pool.
+    ///
+    pool_statistics stats() const
+    {
+        pool_statistics s;
+        alloc_.stats(s); // Can throw.
+        return s;
+    }
+
+protected:
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return alloc_.allocate(bytes, alignment); // Can throw.
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+    {
+        alloc_.deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+} // namespace pmr
+
+#endif // defined(__cpp_lib_memory_resource)
+
 } // namespace sfl
 
 #ifndef SFL_POOL_ALLOCATOR_DO_NOT_UNDEF_MACROS
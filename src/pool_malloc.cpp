@@ -0,0 +1,638 @@
+//
+// Copyright (c) 2022 Slaven Falandys
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+
+//
+// Replacement of malloc, free and global operator new and delete. Built as
+// shared library `libsfl_pool_malloc.so` and loaded by LD_PRELOAD:
+//
+//     $ LD_PRELOAD=./libsfl_pool_malloc.so ./program
+//
+// Small and medium requests are allocated from the shared pool of
+// sfl::pool_allocator. Larger or over-aligned requests go to the system
+// allocator (GNU C library). Blocks carry no header; free() asks the pool
+// whether the pointer lies in one of its buckets.
+//
+// Locks of the pool are taken before fork and released in the parent and
+// in the child, so that the child can allocate even if another thread of
+// the parent was inside the pool.
+//
+
+#include "pool_allocator.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if !defined(__GLIBC__)
+#error "Malloc replacement requires GNU C library."
+#endif
+
+extern "C"
+{
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// System allocator. Exported by GNU C library and not interposed.
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t n, std::size_t size);
+void* __libc_realloc(void* p, std::size_t size);
+void* __libc_memalign(std::size_t alignment, std::size_t size);
+void __libc_free(void* p);
+
+} // extern "C"
+
+#define SFL_EXPORT __attribute__((visibility("default")))
+
+namespace sfl
+{
+
+namespace dtl
+{
+
+/// Alignment of blocks returned by malloc, calloc and realloc.
+///
+static constexpr std::size_t malloc_alignment = alignof(std::max_align_t);
+
+/// Set while the calling thread is inside the pool. Allocations made by the
+/// pool itself (creation of the pool or of thread cache) go to the system
+/// allocator, so the pool is never entered recursively.
+///
+static thread_local bool in_pool __attribute__((tls_model("initial-exec"))) = false;
+
+class pool_guard
+{
+private:
+
+    const bool old_;
+
+public:
+
+    pool_guard() noexcept
+        : old_(in_pool)
+    {
+        in_pool = true;
+    }
+
+    ~pool_guard() noexcept
+    {
+        in_pool = old_;
+    }
+
+    pool_guard(const pool_guard&) = delete;
+    pool_guard& operator=(const pool_guard&) = delete;
+};
+
+/// Returns usable size of block of the system allocator.
+///
+inline std::size_t system_usable_size(void* p) noexcept
+{
+    using function_type = std::size_t (*)(void*);
+
+    static std::atomic<function_type> function{nullptr};
+
+    function_type f = function.load(std::memory_order_acquire);
+
+    if (f == nullptr)
+    {
+        f = reinterpret_cast<function_type>(::dlsym(RTLD_NEXT, "malloc_usable_size"));
+        function.store(f, std::memory_order_release);
+    }
+
+    return f != nullptr ? f(p) : 0;
+}
+
+inline void* from_system(std::size_t size, std::size_t alignment, bool zero) noexcept
+{
+    if (alignment <= malloc_alignment)
+    {
+        return zero ? __libc_calloc(1, size) : __libc_malloc(size);
+    }
+
+    void* p = __libc_memalign(alignment, size);
+
+    if (zero && p != nullptr)
+    {
+        std::memset(p, 0, size);
+    }
+
+    return p;
+}
+
+/// Allocates block of `size` bytes aligned to `alignment` (power of two).
+/// Returns nullptr if there is not enough memory.
+///
+/// Pooled blocks carry no header. free() finds their size class through
+/// the bucket map of the pool.
+///
+inline void* pool_malloc(std::size_t size, std::size_t alignment, bool zero = false) noexcept
+{
+    if (size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4)
+    {
+        return nullptr;
+    }
+
+    if (!in_pool)
+    {
+        pool_guard guard;
+
+        try
+        {
+            small_size_allocator_singleton& pool = small_size_allocator_singleton::instance(); // Can throw.
+
+            // Every call must return a unique pointer, even for zero size.
+            const std::size_t block_size = size != 0 ? size : 1;
+
+            if (pool.is_pooled(block_size, alignment))
+            {
+                void* p = pool.allocate(block_size, alignment); // Can throw.
+                if (zero)
+                {
+                    std::memset(p, 0, size);
+                }
+                return p;
+            }
+        }
+        catch (...)
+        {
+            // Pool is out of memory. Try system allocator.
+        }
+    }
+
+    return from_system(size, alignment, zero);
+}
+
+/// Returns the pool if `p` is a pooled block, otherwise nullptr.
+///
+inline small_size_allocator_singleton* pool_of(void* p) noexcept
+{
+    // The pool itself only deallocates blocks of the system allocator.
+    if (p == nullptr || in_pool)
+    {
+        return nullptr;
+    }
+
+    pool_guard guard;
+
+    try
+    {
+        return &small_size_allocator_singleton::instance(); // Can throw.
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+inline void pool_free(void* p) noexcept
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+
+    if (small_size_allocator_singleton* pool = pool_of(p))
+    {
+        pool_guard guard;
+        if (pool->deallocate(p))
+        {
+            return;
+        }
+    }
+
+    __libc_free(p);
+}
+
+inline std::size_t pool_usable_size(void* p) noexcept
+{
+    if (p == nullptr)
+    {
+        return 0;
+    }
+
+    if (small_size_allocator_singleton* pool = pool_of(p))
+    {
+        if (const std::size_t size = pool->allocated_size(p))
+        {
+            return size;
+        }
+    }
+
+    return system_usable_size(p);
+}
+
+inline void* pool_realloc(void* p, std::size_t size) noexcept
+{
+    if (p == nullptr)
+    {
+        return pool_malloc(size, malloc_alignment);
+    }
+
+    if (size == 0)
+    {
+        pool_free(p);
+        return nullptr;
+    }
+
+    if (size > SIZE_MAX / 2)
+    {
+        return nullptr;
+    }
+
+    small_size_allocator_singleton* pool = pool_of(p);
+
+    const std::size_t old_size = pool != nullptr ? pool->allocated_size(p) : 0;
+
+    if (old_size == 0)
+    {
+        // Block of system allocator. Large blocks are resized by the system
+        // allocator, which can grow them in place.
+        if (pool == nullptr || !pool->is_pooled(size, malloc_alignment))
+        {
+            return __libc_realloc(p, size);
+        }
+
+        void* q = pool_malloc(size, malloc_alignment);
+
+        if (q != nullptr)
+        {
+            const std::size_t n = system_usable_size(p);
+            std::memcpy(q, p, size < n ? size : n);
+            __libc_free(p);
+        }
+
+        return q;
+    }
+
+    // Shrink in place unless more than half of the block would be wasted.
+    if (size <= old_size && size >= old_size / 2)
+    {
+        return p;
+    }
+
+    void* q = pool_malloc(size, malloc_alignment);
+
+    if (q != nullptr)
+    {
+        std::memcpy(q, p, size < old_size ? size : old_size);
+        pool_free(p);
+    }
+
+    return q;
+}
+
+/// Allocation function of operator new. Calls new handler until allocation
+/// succeeds. Throws std::bad_alloc if there is no new handler.
+///
+inline void* pool_new(std::size_t size, std::size_t alignment)
+{
+    for (;;)
+    {
+        void* p = pool_malloc(size, alignment);
+
+        if (p != nullptr)
+        {
+            return p;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        handler(); // Can throw.
+    }
+}
+
+inline void* pool_new_nothrow(std::size_t size, std::size_t alignment) noexcept
+{
+    try
+    {
+        return pool_new(size, alignment);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+/// Pool locked around fork. Nullptr if handlers are not registered.
+///
+static small_size_allocator_singleton* fork_pool = nullptr;
+
+static void lock_before_fork() noexcept
+{
+    fork_pool->lock_all();
+}
+
+static void unlock_after_fork() noexcept
+{
+    fork_pool->unlock_all();
+}
+
+/// Creates the pool when the library is loaded and registers fork handlers.
+///
+__attribute__((constructor))
+static void register_fork_handlers() noexcept
+{
+    pool_guard guard;
+
+    try
+    {
+        fork_pool = &small_size_allocator_singleton::instance(); // Can throw.
+    }
+    catch (...)
+    {
+        return;
+    }
+
+    ::pthread_atfork(&lock_before_fork, &unlock_after_fork, &unlock_after_fork);
+}
+
+inline bool is_valid_alignment(std::size_t alignment) noexcept
+{
+    return alignment != 0 && (alignment & (alignment - 1)) == 0;
+}
+
+/// Rounds alignment of memalign up to power of two, as GNU C library does.
+/// Returns 0 if there is no such power of two.
+///
+inline std::size_t memalign_alignment(std::size_t alignment) noexcept
+{
+    if (alignment <= malloc_alignment)
+    {
+        return malloc_alignment;
+    }
+
+    if (alignment > SIZE_MAX / 2 + 1)
+    {
+        return 0;
+    }
+
+    std::size_t a = malloc_alignment;
+
+    while (a < alignment)
+    {
+        a *= 2;
+    }
+
+    return a;
+}
+
+inline std::size_t page_size() noexcept
+{
+    static const std::size_t size = std::size_t(::sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+inline void* set_errno(void* p) noexcept
+{
+    if (p == nullptr)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+} // namespace dtl
+
+} // namespace sfl
+
+//
+// C functions
+//
+
+extern "C"
+{
+
+SFL_EXPORT void* malloc(std::size_t size)
+{
+    return sfl::dtl::set_errno(sfl::dtl::pool_malloc(size, sfl::dtl::malloc_alignment));
+}
+
+SFL_EXPORT void free(void* p)
+{
+    sfl::dtl::pool_free(p);
+}
+
+SFL_EXPORT void* calloc(std::size_t n, std::size_t size)
+{
+    if (size != 0 && n > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return sfl::dtl::set_errno(sfl::dtl::pool_malloc(n * size, sfl::dtl::malloc_alignment, true));
+}
+
+SFL_EXPORT void* realloc(void* p, std::size_t size)
+{
+    void* q = sfl::dtl::pool_realloc(p, size);
+    return size == 0 ? q : sfl::dtl::set_errno(q);
+}
+
+SFL_EXPORT void* reallocarray(void* p, std::size_t n, std::size_t size)
+{
+    if (size != 0 && n > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(p, n * size);
+}
+
+SFL_EXPORT int posix_memalign(void** out, std::size_t alignment, std::size_t size)
+{
+    if (!sfl::dtl::is_valid_alignment(alignment) || alignment % sizeof(void*) != 0)
+    {
+        return EINVAL;
+    }
+    void* p = sfl::dtl::pool_malloc(size, alignment);
+    if (p == nullptr)
+    {
+        return ENOMEM;
+    }
+    *out = p;
+    return 0;
+}
+
+SFL_EXPORT void* aligned_alloc(std::size_t alignment, std::size_t size)
+{
+    if (!sfl::dtl::is_valid_alignment(alignment))
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return sfl::dtl::set_errno(sfl::dtl::pool_malloc(size, alignment));
+}
+
+SFL_EXPORT void* memalign(std::size_t alignment, std::size_t size)
+{
+    // Unlike aligned_alloc, alignment that is not power of two is rounded up.
+    alignment = sfl::dtl::memalign_alignment(alignment);
+    if (alignment == 0)
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return sfl::dtl::set_errno(sfl::dtl::pool_malloc(size, alignment));
+}
+
+SFL_EXPORT void* valloc(std::size_t size)
+{
+    return sfl::dtl::set_errno(sfl::dtl::pool_malloc(size, sfl::dtl::page_size()));
+}
+
+SFL_EXPORT void* pvalloc(std::size_t size)
+{
+    const std::size_t page_size = sfl::dtl::page_size();
+    if (size > SIZE_MAX - page_size)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    // Zero size is rounded up to one page.
+    const std::size_t n = size != 0 ? (size + page_size - 1) / page_size * page_size : page_size;
+    return sfl::dtl::set_errno(sfl::dtl::pool_malloc(n, page_size));
+}
+
+SFL_EXPORT std::size_t malloc_usable_size(void* p)
+{
+    return sfl::dtl::pool_usable_size(p);
+}
+
+} // extern "C"
+
+//
+// Global operator new and delete
+//
+
+SFL_EXPORT void* operator new(std::size_t size)
+{
+    return sfl::dtl::pool_new(size, sfl::dtl::malloc_alignment); // Can throw.
+}
+
+SFL_EXPORT void* operator new[](std::size_t size)
+{
+    return sfl::dtl::pool_new(size, sfl::dtl::malloc_alignment); // Can throw.
+}
+
+SFL_EXPORT void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return sfl::dtl::pool_new_nothrow(size, sfl::dtl::malloc_alignment);
+}
+
+SFL_EXPORT void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return sfl::dtl::pool_new_nothrow(size, sfl::dtl::malloc_alignment);
+}
+
+SFL_EXPORT void operator delete(void* p) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+SFL_EXPORT void operator delete[](void* p) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+SFL_EXPORT void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+SFL_EXPORT void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+// Size is not needed. Pool finds it through the bucket map.
+
+SFL_EXPORT void operator delete(void* p, std::size_t) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+SFL_EXPORT void operator delete[](void* p, std::size_t) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+#if defined(__cpp_aligned_new)
+
+SFL_EXPORT void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return sfl::dtl::pool_new(size, std::size_t(alignment)); // Can throw.
+}
+
+SFL_EXPORT void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return sfl::dtl::pool_new(size, std::size_t(alignment)); // Can throw.
+}
+
+SFL_EXPORT void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return sfl::dtl::pool_new_nothrow(size, std::size_t(alignment));
+}
+
+SFL_EXPORT void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return sfl::dtl::pool_new_nothrow(size, std::size_t(alignment));
+}
+
+SFL_EXPORT void operator delete(void* p, std::align_val_t) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+SFL_EXPORT void operator delete[](void* p, std::align_val_t) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+SFL_EXPORT void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+SFL_EXPORT void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+SFL_EXPORT void operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+SFL_EXPORT void operator delete[](void* p, std::size_t, std::align_val_t) noexcept
+{
+    sfl::dtl::pool_free(p);
+}
+
+#endif // defined(__cpp_aligned_new)
@@ -0,0 +1,81 @@
+//
+// DESCRIPTION:
+// Checks that blocks allocated by sfl::pool_allocator<T> are aligned to
+// alignof(T), including over-aligned types.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_alignment.cpp -o test_alignment
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_alignment.cpp -o test_alignment -DNDEBUG
+//
+
+#include <iostream>
+#include <list>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+struct alignas(32) avx_payload
+{
+    float data[8];
+};
+
+struct alignas(64) cache_line_payload
+{
+    char data[40];
+};
+
+struct alignas(128) large_payload
+{
+    char data[8];
+};
+
+template <typename T>
+void check_alignment(const char* name)
+{
+    sfl::pool_allocator<T> alloc;
+
+    std::vector<std::pair<T*, std::size_t>> blocks;
+
+    for (std::size_t n = 1; n <= 64; ++n)
+    {
+        for (int i = 0; i < 100; ++i)
+        {
+            T* p = alloc.allocate(n);
+
+            CHECK(std::size_t(p) % alignof(T) == 0);
+
+            blocks.emplace_back(p, n);
+        }
+    }
+
+    for (auto& b : blocks)
+    {
+        alloc.deallocate(b.first, b.second);
+    }
+
+    std::list<T, sfl::pool_allocator<T>> l(1000);
+
+    for (const auto& x : l)
+    {
+        CHECK(std::size_t(&x) % alignof(T) == 0);
+    }
+
+    std::cout << name << ": OK" << std::endl;
+}
+
+int main()
+{
+    check_alignment<char>("char");
+    check_alignment<short>("short");
+    check_alignment<int>("int");
+    check_alignment<double>("double");
+    check_alignment<long double>("long double");
+    check_alignment<avx_payload>("avx_payload");
+    check_alignment<cache_line_payload>("cache_line_payload");
+    check_alignment<large_payload>("large_payload");
+
+    std::cout << "THE END" << std::endl;
+}
@@ -0,0 +1,150 @@
+//
+// DESCRIPTION:
+// Checks bulk allocation and deallocation: blocks are distinct, aligned
+// and writable, blocks can be deallocated in any order, mixed with single
+// deallocations, and statistics count every block.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_bulk.cpp -o test_bulk
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_bulk.cpp -o test_bulk -DNDEBUG
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+template <std::size_t Size>
+struct payload
+{
+    unsigned char data[Size];
+};
+
+std::size_t num_live_blocks(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_live_blocks;
+    }
+    return n;
+}
+
+template <typename T, typename Allocator>
+void check_blocks(Allocator& alloc, std::size_t n, std::mt19937& gen)
+{
+    std::vector<T*> blocks(n);
+
+    alloc.allocate_bulk(n, blocks.data());
+
+    std::set<T*> unique(blocks.begin(), blocks.end());
+    CHECK(unique.size() == n);
+
+    for (T* p : blocks)
+    {
+        CHECK(std::size_t(p) % alignof(T) == 0);
+        std::memset(static_cast<void*>(p), 0xAB, sizeof(T));
+    }
+
+    std::shuffle(blocks.begin(), blocks.end(), gen);
+
+    // Deallocate half one by one, the rest in bulk.
+    for (std::size_t i = 0; i < n / 2; ++i)
+    {
+        alloc.deallocate(blocks[i], 1);
+    }
+
+    alloc.deallocate_bulk(n - n / 2, blocks.data() + n / 2);
+}
+
+template <typename Policy>
+void test_pool_allocator(const char* name)
+{
+    std::mt19937 gen(42);
+
+    sfl::pool_allocator<payload<8>, Policy> a8;
+    sfl::pool_allocator<payload<24>, Policy> a24;
+    sfl::pool_allocator<payload<100>, Policy> a100;
+    sfl::pool_allocator<payload<1000>, Policy> a1000;
+
+    for (std::size_t n : {0, 1, 7, 1000, 100000})
+    {
+        check_blocks<payload<8>>(a8, n, gen);
+        check_blocks<payload<24>>(a24, n, gen);
+        check_blocks<payload<100>>(a100, n, gen);
+        check_blocks<payload<1000>>(a1000, n / 10, gen);
+    }
+
+    std::cout << name << ": OK" << std::endl;
+}
+
+void test_pool_resource()
+{
+    sfl::pool_resource r;
+
+    std::vector<void*> blocks(50000);
+
+    r.allocate_bulk(48, blocks.size(), blocks.data(), 16);
+
+    for (void* p : blocks)
+    {
+        CHECK(std::size_t(p) % 16 == 0);
+    }
+
+    CHECK(num_live_blocks(r.stats()) == blocks.size());
+
+    r.deallocate_bulk(48, blocks.size(), blocks.data(), 16);
+
+    CHECK(num_live_blocks(r.stats()) == 0);
+
+    std::cout << "pool_resource: OK" << std::endl;
+}
+
+void test_shared_pool_threads()
+{
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back
+        (
+            [t]()
+            {
+                std::mt19937 gen(t);
+                sfl::pool_allocator<payload<32>> alloc;
+                for (int k = 0; k < 20; ++k)
+                {
+                    check_blocks<payload<32>>(alloc, 10000, gen);
+                }
+            }
+        );
+    }
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    CHECK(num_live_blocks(sfl::pool_stats()) == 0);
+
+    std::cout << "shared pool threads: OK" << std::endl;
+}
+
+int main()
+{
+    test_pool_allocator<sfl::multi_threaded>("multi_threaded");
+    test_pool_allocator<sfl::single_threaded>("single_threaded");
+    test_pool_resource();
+    test_shared_pool_threads();
+
+    std::cout << "THE END" << std::endl;
+}
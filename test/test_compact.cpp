@@ -0,0 +1,257 @@
+//
+// DESCRIPTION:
+// Checks compaction: live blocks of sparse buckets are moved by registered
+// relocator into other buckets, emptied buckets are returned, moved objects
+// keep their values and every pointer to them is updated. Size classes
+// without relocator are left alone.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_compact.cpp -o test_compact
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_compact.cpp -o test_compact -DNDEBUG
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+std::size_t num_buckets(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_buckets;
+    }
+    return n;
+}
+
+/// Object that knows the only pointer to itself.
+///
+struct node
+{
+    node** handle;
+    std::size_t value;
+    char payload[32];
+};
+
+void relocate_node(void* from, void* to, void* /*context*/)
+{
+    std::memcpy(to, from, sizeof(node));
+    node* n = static_cast<node*>(to);
+    *n->handle = n;
+}
+
+template <typename Resource>
+void check_nodes(Resource& r)
+{
+    CHECK(r.set_relocator(sizeof(node), &relocate_node, nullptr, alignof(node)));
+
+    const std::size_t count = 200000;
+
+    std::vector<node*> handles(count);
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        node* n = static_cast<node*>(r.allocate(sizeof(node), alignof(node)));
+        n->handle = &handles[i];
+        n->value = i;
+        std::memset(n->payload, int(i % 251), sizeof(n->payload));
+        handles[i] = n;
+    }
+
+    // Keep every 32nd object.
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if (i % 32 != 0)
+        {
+            r.deallocate(handles[i], sizeof(node), alignof(node));
+            handles[i] = nullptr;
+        }
+    }
+
+    const std::size_t buckets = num_buckets(r.stats());
+
+    CHECK(r.compact() > 0);
+
+    // Every 32nd object fits into a few buckets.
+    CHECK(num_buckets(r.stats()) <= std::max<std::size_t>(1, buckets / 8));
+
+    std::set<node*> unique;
+
+    for (std::size_t i = 0; i < count; i += 32)
+    {
+        node* n = handles[i];
+        CHECK(n->handle == &handles[i]);
+        CHECK(n->value == i);
+        for (char c : n->payload)
+        {
+            CHECK(c == char(i % 251));
+        }
+        CHECK(unique.insert(n).second);
+    }
+
+    // Compacted pool allocates and deallocates as usual.
+    for (std::size_t i = 1; i < count; i += 32)
+    {
+        node* n = static_cast<node*>(r.allocate(sizeof(node), alignof(node)));
+        CHECK(unique.insert(n).second);
+        n->handle = &handles[i];
+        n->value = i;
+        handles[i] = n;
+    }
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if (handles[i] != nullptr)
+        {
+            CHECK(handles[i]->value == i);
+            r.deallocate(handles[i], sizeof(node), alignof(node));
+        }
+    }
+
+    r.trim();
+
+    CHECK(num_buckets(r.stats()) == 0);
+}
+
+void test_list_buckets()
+{
+    sfl::pool_resource r;
+    check_nodes(r);
+
+    std::cout << "list buckets: OK" << std::endl;
+}
+
+/// Pointers to blocks by block address.
+///
+using block_map = std::unordered_map<void*, void**>;
+
+void relocate_short(void* from, void* to, void* context)
+{
+    block_map& map = *static_cast<block_map*>(context);
+    std::memcpy(to, from, sizeof(short));
+    void** handle = map.at(from);
+    *handle = to;
+    map.erase(from);
+    map.emplace(to, handle);
+}
+
+void test_bitmap_buckets()
+{
+    sfl::pool_resource r;
+
+    block_map map;
+    CHECK(r.set_relocator(sizeof(short), &relocate_short, &map, alignof(short)));
+
+    const std::size_t count = 1000000;
+
+    std::vector<void*> handles(count);
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        short* p = static_cast<short*>(r.allocate(sizeof(short), alignof(short)));
+        *p = short(i);
+        handles[i] = p;
+    }
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if (i % 100 == 0)
+        {
+            map.emplace(handles[i], &handles[i]);
+        }
+        else
+        {
+            r.deallocate(handles[i], sizeof(short), alignof(short));
+            handles[i] = nullptr;
+        }
+    }
+
+    const std::size_t buckets = num_buckets(r.stats());
+
+    CHECK(r.compact() > 0);
+
+    CHECK(num_buckets(r.stats()) < buckets);
+
+    for (std::size_t i = 0; i < count; i += 100)
+    {
+        CHECK(*static_cast<short*>(handles[i]) == short(i));
+        CHECK(map.at(handles[i]) == &handles[i]);
+        r.deallocate(handles[i], sizeof(short), alignof(short));
+    }
+
+    std::cout << "bitmap buckets: OK" << std::endl;
+}
+
+void test_without_relocator()
+{
+    sfl::pool_resource r;
+
+    // Not pooled.
+    CHECK(!r.set_relocator(r.max_block_size() + 1, &relocate_node, nullptr));
+
+    std::vector<void*> blocks;
+    for (int i = 0; i < 100000; ++i)
+    {
+        blocks.push_back(r.allocate(24));
+    }
+
+    std::vector<void*> kept;
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+    {
+        if (i % 100 == 0)
+        {
+            kept.push_back(blocks[i]);
+        }
+        else
+        {
+            r.deallocate(blocks[i], 24);
+        }
+    }
+
+    r.trim();
+
+    const std::size_t buckets = num_buckets(r.stats());
+
+    r.compact();
+
+    CHECK(num_buckets(r.stats()) == buckets);
+
+    for (void* p : kept)
+    {
+        r.deallocate(p, 24);
+    }
+
+    std::cout << "without relocator: OK" << std::endl;
+}
+
+void test_pmr()
+{
+#if defined(__cpp_lib_memory_resource)
+    sfl::pmr::unsynchronized_pool_resource u;
+    check_nodes(u);
+
+    sfl::pmr::synchronized_pool_resource s;
+    check_nodes(s);
+
+    std::cout << "pmr: OK" << std::endl;
+#endif
+}
+
+int main()
+{
+    test_list_buckets();
+    test_bitmap_buckets();
+    test_without_relocator();
+    test_pmr();
+
+    std::cout << "THE END" << std::endl;
+}
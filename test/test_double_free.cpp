@@ -0,0 +1,170 @@
+//
+// DESCRIPTION:
+// Checks bitmap buckets for tiny blocks and double free checks, which are
+// kept in release builds. Every invalid deallocation runs in child process
+// that must be aborted.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_double_free.cpp -o test_double_free -DSFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK=1
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_double_free.cpp -o test_double_free -DSFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK=1 -DNDEBUG
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+#if SFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK == 0
+#error "Compile with -DSFL_POOL_ALLOCATOR_DOUBLE_FREE_CHECK=1."
+#endif
+
+/// Runs function in child process. Returns true if child was aborted.
+///
+template <typename Function>
+bool aborts(Function f)
+{
+    std::cout.flush();
+
+    const pid_t pid = ::fork();
+    CHECK(pid >= 0);
+
+    if (pid == 0)
+    {
+        f();
+        std::_Exit(0);
+    }
+
+    int status = 0;
+    CHECK(::waitpid(pid, &status, 0) == pid);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+void test_tiny_blocks()
+{
+    sfl::pool_allocator<char> alloc;
+
+    std::vector<char*> blocks;
+    for (int i = 0; i < 100000; ++i)
+    {
+        blocks.push_back(alloc.allocate(1));
+        *blocks.back() = char(i);
+    }
+
+    CHECK(std::set<char*>(blocks.begin(), blocks.end()).size() == blocks.size());
+
+    for (int i = 0; i < 100000; ++i)
+    {
+        CHECK(*blocks[i] == char(i));
+    }
+
+    // One-byte blocks are not rounded up to two bytes.
+    const sfl::pool_statistics s = sfl::pool_stats();
+    CHECK(s.size_classes[0].block_size == 1);
+    CHECK(s.size_classes[0].num_blocks > s.size_classes[0].bytes_mapped / 2);
+
+    for (char* p : blocks)
+    {
+        alloc.deallocate(p, 1);
+    }
+
+    std::cout << "tiny blocks: OK" << std::endl;
+}
+
+template <typename Policy, typename T>
+void test_policy(const char* name)
+{
+    sfl::pool_allocator<T, Policy> alloc;
+
+    // Valid use does not abort.
+    CHECK(!aborts([&alloc]()
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            std::vector<T*> v;
+            for (int i = 0; i < 1000; ++i)
+            {
+                v.push_back(alloc.allocate(1));
+            }
+            for (T* p : v)
+            {
+                alloc.deallocate(p, 1);
+            }
+        }
+    }));
+
+    // Double free right away.
+    CHECK(aborts([&alloc]()
+    {
+        T* p = alloc.allocate(1);
+        alloc.deallocate(p, 1);
+        alloc.deallocate(p, 1);
+    }));
+
+    // Double free after the block has gone back into its bucket.
+    CHECK(aborts([&alloc]()
+    {
+        std::vector<T*> v;
+        for (int i = 0; i < 1000; ++i)
+        {
+            v.push_back(alloc.allocate(1));
+        }
+        for (T* p : v)
+        {
+            alloc.deallocate(p, 1);
+        }
+        alloc.deallocate(v[500], 1);
+    }));
+
+    // Double free by another thread.
+    CHECK(aborts([&alloc]()
+    {
+        T* p = alloc.allocate(1);
+        std::thread([p]() { sfl::pool_allocator<T, Policy>().deallocate(p, 1); }).join();
+        std::thread([p]() { sfl::pool_allocator<T, Policy>().deallocate(p, 1); }).join();
+    }));
+
+    // Pointer into the middle of a block.
+    CHECK(aborts([&alloc]()
+    {
+        T* p = alloc.allocate(1);
+        alloc.deallocate(reinterpret_cast<T*>(reinterpret_cast<char*>(p) + 1), 1);
+    }));
+
+    // Double free in bulk.
+    CHECK(aborts([&alloc]()
+    {
+        std::vector<T*> v(100);
+        alloc.allocate_bulk(v.size(), v.data());
+        v.push_back(v[10]);
+        alloc.deallocate_bulk(v.size(), v.data());
+    }));
+
+    std::cout << name << ": OK" << std::endl;
+}
+
+struct node
+{
+    long value;
+    node* next;
+};
+
+int main()
+{
+    test_tiny_blocks();
+    test_policy<sfl::multi_threaded, node>("multi_threaded");
+    test_policy<sfl::single_threaded, node>("single_threaded");
+    test_policy<sfl::multi_threaded, short>("multi_threaded bitmap bucket");
+    test_policy<sfl::single_threaded, short>("single_threaded bitmap bucket");
+
+    std::cout << "THE END" << std::endl;
+}
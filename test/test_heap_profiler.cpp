@@ -0,0 +1,438 @@
+//
+// DESCRIPTION:
+// Checks sampling heap profiler: sampled blocks are tracked until they are
+// deallocated (by any thread, with or without size, or by release of their
+// pool) and follow blocks moved by compaction, bulk allocations are sampled, number of samples matches
+// sample period, stack traces point to allocating function, and profile is
+// written in pprof heap profile format.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_heap_profiler.cpp -o test_heap_profiler
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_heap_profiler.cpp -o test_heap_profiler -DNDEBUG
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+#if !SFL_POOL_ALLOCATOR_HEAP_PROFILER
+#error "Heap profiler must be enabled."
+#endif
+
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+struct sample
+{
+    unsigned long long num_live;
+    unsigned long long live_bytes;
+    unsigned long long num_allocated;
+    unsigned long long allocated_bytes;
+    std::vector<std::uintptr_t> frames;
+};
+
+struct profile
+{
+    sample total;
+    unsigned long long period;
+    std::vector<sample> samples;
+    bool has_mappings;
+};
+
+profile parse(const std::string& text)
+{
+    profile p;
+    p.has_mappings = false;
+
+    std::istringstream is(text);
+    std::string line;
+
+    CHECK(std::getline(is, line));
+    CHECK(std::sscanf(line.c_str(), "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu",
+                      &p.total.num_live, &p.total.live_bytes,
+                      &p.total.num_allocated, &p.total.allocated_bytes, &p.period) == 5);
+
+    while (std::getline(is, line) && !line.empty())
+    {
+        sample s;
+        int n = 0;
+        CHECK(std::sscanf(line.c_str(), "%llu: %llu [%llu: %llu] @%n",
+                          &s.num_live, &s.live_bytes,
+                          &s.num_allocated, &s.allocated_bytes, &n) == 4);
+        std::istringstream frames(line.substr(n));
+        std::string frame;
+        while (frames >> frame)
+        {
+            CHECK(frame.compare(0, 2, "0x") == 0);
+            s.frames.push_back(std::uintptr_t(std::strtoull(frame.c_str() + 2, nullptr, 16)));
+        }
+        p.samples.push_back(s);
+    }
+
+    if (std::getline(is, line))
+    {
+        CHECK(line == "MAPPED_LIBRARIES:");
+        p.has_mappings = true;
+    }
+
+    return p;
+}
+
+unsigned long long num_live_samples()
+{
+    return parse(sfl::pool_heap_profile()).total.num_live;
+}
+
+/// Allocates enough to start countdown of the calling thread with the
+/// current sample period.
+///
+void warm_up()
+{
+    sfl::pool_resource r;
+    for (int i = 0; i < 4096; ++i)
+    {
+        r.deallocate(r.allocate(1000), 1000);
+    }
+}
+
+NOINLINE void* allocate_here(sfl::pool_resource& r, std::size_t size)
+{
+    // Not a tail call, so that the function has its frame.
+    void* p = r.allocate(size);
+    std::memset(p, 0xAB, size);
+    return p;
+}
+
+/// Returns true if any frame is return address in allocate_here.
+///
+bool from_here(const sample& s)
+{
+    const std::uintptr_t first = reinterpret_cast<std::uintptr_t>(&allocate_here);
+    for (std::uintptr_t frame : s.frames)
+    {
+        if (frame > first && frame < first + 256)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void test_tracking()
+{
+    // Every allocation is sampled.
+    sfl::pool_start_heap_profiler(1);
+    warm_up();
+
+    CHECK(num_live_samples() == 0);
+
+    sfl::pool_resource r;
+
+    std::vector<void*> blocks;
+    for (int i = 0; i < 1000; ++i)
+    {
+        blocks.push_back(allocate_here(r, 48));
+    }
+
+    const profile p = parse(sfl::pool_heap_profile());
+
+    CHECK(p.period == 1);
+    CHECK(p.total.num_live == 1000);
+    CHECK(p.total.live_bytes == 1000 * 48);
+
+    bool found = false;
+    for (const sample& s : p.samples)
+    {
+        if (s.num_live == 1000)
+        {
+            CHECK(s.live_bytes == 1000 * 48);
+            CHECK(s.frames.empty() || from_here(s));
+            found = true;
+        }
+    }
+    CHECK(found);
+
+    #if defined(__linux__)
+    CHECK(p.has_mappings);
+    #endif
+
+    // Sized and unsized deallocation.
+    for (std::size_t i = 0; i < 500; ++i)
+    {
+        if (i % 2 == 0)
+        {
+            r.deallocate(blocks[i], 48);
+        }
+        else
+        {
+            CHECK(r.deallocate(blocks[i]));
+        }
+    }
+
+    CHECK(num_live_samples() == 500);
+
+    // Blocks of released pool are not live.
+    r.release();
+
+    const profile q = parse(sfl::pool_heap_profile());
+    CHECK(q.total.num_live == 0);
+    CHECK(q.total.num_allocated >= 1000);
+
+    sfl::pool_stop_heap_profiler();
+
+    std::cout << "tracking: OK" << std::endl;
+}
+
+void test_sample_period()
+{
+    const std::size_t period = 64 * 1024;
+    const std::size_t bytes = 32 * 1024 * 1024;
+    const std::size_t size = 64;
+
+    sfl::pool_start_heap_profiler(period);
+    warm_up();
+
+    // Shared pool, allocated from thread cache.
+    sfl::pool_allocator<char> a;
+
+    std::vector<char*> blocks;
+    for (std::size_t i = 0; i < bytes / size; ++i)
+    {
+        blocks.push_back(a.allocate(size));
+    }
+
+    const unsigned long long n = num_live_samples();
+
+    // Expected bytes / period = 512 samples.
+    CHECK(n > 512 * 6 / 10 && n < 512 * 14 / 10);
+
+    for (char* p : blocks)
+    {
+        a.deallocate(p, size);
+    }
+
+    CHECK(num_live_samples() == 0);
+
+    sfl::pool_stop_heap_profiler();
+
+    std::cout << "sample period: OK" << std::endl;
+}
+
+void test_threads()
+{
+    sfl::pool_start_heap_profiler(4096);
+
+    std::vector<std::thread> threads;
+
+    std::vector<std::vector<int*>> blocks(4);
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back
+        (
+            [t, &blocks]()
+            {
+                sfl::pool_allocator<int> a;
+                sfl::pool_allocator<int, sfl::single_threaded> b;
+
+                for (int k = 0; k < 100000; ++k)
+                {
+                    blocks[t].push_back(a.allocate(1 + k % 20));
+                    b.deallocate(b.allocate(1 + k % 20), 1 + k % 20);
+                }
+            }
+        );
+    }
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    CHECK(num_live_samples() > 0);
+
+    // Blocks are deallocated by another thread.
+    std::thread
+    (
+        [&blocks]()
+        {
+            sfl::pool_allocator<int> a;
+            for (const auto& v : blocks)
+            {
+                for (std::size_t k = 0; k < v.size(); ++k)
+                {
+                    a.deallocate(v[k], 1 + k % 20);
+                }
+            }
+        }
+    ).join();
+
+    const profile p = parse(sfl::pool_heap_profile());
+    CHECK(p.total.num_live == 0);
+    CHECK(p.total.live_bytes == 0);
+    CHECK(p.total.num_allocated > 0);
+
+    sfl::pool_stop_heap_profiler();
+
+    std::cout << "threads: OK" << std::endl;
+}
+
+struct object
+{
+    char data[48];
+};
+
+template <typename Allocator>
+void check_bulk(Allocator& a)
+{
+    std::vector<object*> blocks(1000);
+
+    a.allocate_bulk(blocks.size(), blocks.data());
+
+    CHECK(num_live_samples() == blocks.size());
+
+    a.deallocate_bulk(blocks.size(), blocks.data());
+
+    CHECK(num_live_samples() == 0);
+}
+
+void test_bulk()
+{
+    sfl::pool_start_heap_profiler(1);
+    warm_up();
+
+    sfl::pool_allocator<object> a;
+    check_bulk(a);
+
+    sfl::pool_allocator<object, sfl::single_threaded> b;
+    check_bulk(b);
+
+    sfl::pool_resource r;
+    std::vector<void*> blocks(1000);
+    r.allocate_bulk(48, blocks.size(), blocks.data());
+    CHECK(num_live_samples() == blocks.size());
+    r.deallocate_bulk(48, blocks.size(), blocks.data());
+    CHECK(num_live_samples() == 0);
+
+    sfl::pool_stop_heap_profiler();
+
+    std::cout << "bulk: OK" << std::endl;
+}
+
+void relocate(void* from, void* to, void* context)
+{
+    std::memcpy(to, from, 48);
+    void** handles = static_cast<void**>(context);
+    handles[*static_cast<std::size_t*>(to)] = to;
+}
+
+void test_compact()
+{
+    sfl::pool_start_heap_profiler(1);
+    warm_up();
+
+    sfl::pool_resource r;
+
+    std::vector<void*> handles(20000);
+
+    CHECK(r.set_relocator(48, &relocate, handles.data()));
+
+    for (std::size_t i = 0; i < handles.size(); ++i)
+    {
+        handles[i] = r.allocate(48);
+        *static_cast<std::size_t*>(handles[i]) = i;
+    }
+
+    for (std::size_t i = 0; i < handles.size(); ++i)
+    {
+        if (i % 50 != 0)
+        {
+            r.deallocate(handles[i], 48);
+        }
+    }
+
+    CHECK(num_live_samples() == handles.size() / 50);
+
+    r.compact();
+
+    // Samples follow moved blocks.
+    CHECK(num_live_samples() == handles.size() / 50);
+
+    for (std::size_t i = 0; i < handles.size(); i += 50)
+    {
+        r.deallocate(handles[i], 48);
+    }
+
+    CHECK(num_live_samples() == 0);
+
+    sfl::pool_stop_heap_profiler();
+
+    std::cout << "compact: OK" << std::endl;
+}
+
+void test_stop_and_dump()
+{
+    sfl::pool_start_heap_profiler(1);
+    warm_up();
+
+    sfl::pool_resource r;
+    void* p = r.allocate(100);
+
+    CHECK(num_live_samples() == 1);
+
+    const char* path = "test_heap_profiler.heap";
+
+    CHECK(sfl::pool_dump_heap_profile(path));
+
+    std::FILE* f = std::fopen(path, "r");
+    CHECK(f != nullptr);
+    char line[256];
+    CHECK(std::fgets(line, sizeof(line), f) != nullptr);
+    CHECK(std::strncmp(line, "heap profile: 1: 100 [", 22) == 0);
+    std::fclose(f);
+    std::remove(path);
+
+    CHECK(!sfl::pool_dump_heap_profile("no/such/directory/profile.heap"));
+
+    // Stopped profiler drops samples and does not sample.
+    sfl::pool_stop_heap_profiler();
+    sfl::pool_stop_heap_profiler();
+
+    const profile q = parse(sfl::pool_heap_profile());
+    CHECK(q.period == 0);
+    CHECK(q.samples.empty());
+
+    void* s = r.allocate(100);
+    CHECK(num_live_samples() == 0);
+
+    r.deallocate(p, 100);
+    r.deallocate(s, 100);
+
+    std::cout << "stop and dump: OK" << std::endl;
+}
+
+int main()
+{
+    test_tracking();
+    test_sample_period();
+    test_threads();
+    test_bulk();
+    test_compact();
+    test_stop_and_dump();
+
+    std::cout << "THE END" << std::endl;
+}
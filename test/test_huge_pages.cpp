@@ -0,0 +1,82 @@
+//
+// DESCRIPTION:
+// Checks that pool works when buckets are backed by huge pages, and
+// reports how much of the process memory is backed by explicit and
+// transparent huge pages. Huge pages are optional; if the system has none,
+// the pool falls back to regular pages.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_huge_pages.cpp -o test_huge_pages -DSFL_POOL_ALLOCATOR_HUGE_PAGES=1
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_huge_pages.cpp -o test_huge_pages -DSFL_POOL_ALLOCATOR_HUGE_PAGES=1 -DNDEBUG
+//
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <string>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+#if SFL_POOL_ALLOCATOR_HUGE_PAGES == 0
+#error "Compile with -DSFL_POOL_ALLOCATOR_HUGE_PAGES=1."
+#endif
+
+/// Returns value of the given field of /proc/self/smaps_rollup in KiB,
+/// or -1 if not available.
+///
+long smaps_field(const std::string& name)
+{
+    std::ifstream is("/proc/self/smaps_rollup");
+    std::string key;
+    long value;
+    std::string unit;
+    while (is >> key)
+    {
+        if (key == name + ":")
+        {
+            is >> value;
+            return value;
+        }
+        std::getline(is, unit);
+    }
+    return -1;
+}
+
+int main()
+{
+    using list_type = std::list<std::size_t, sfl::pool_allocator<std::size_t>>;
+
+    for (int k = 0; k < 3; ++k)
+    {
+        list_type l;
+
+        // About 64 MiB of nodes.
+        for (std::size_t i = 0; i < 2 * 1024 * 1024; ++i)
+        {
+            l.push_back(i);
+        }
+
+        std::size_t i = 0;
+        for (std::size_t x : l)
+        {
+            CHECK(x == i);
+            ++i;
+        }
+
+        if (k == 0)
+        {
+            const sfl::pool_statistics s = sfl::pool_stats();
+
+            std::cout << "Explicit huge pages: " << s.bytes_huge_pages / 1024 << " KiB" << std::endl;
+            std::cout << "AnonHugePages:       " << smaps_field("AnonHugePages") << " KiB" << std::endl;
+        }
+    }
+
+    sfl::pool_trim();
+
+    std::cout << "THE END" << std::endl;
+}
@@ -0,0 +1,374 @@
+//
+// DESCRIPTION:
+// Checks malloc replacement library. Must run with the library preloaded.
+// Checks that malloc, calloc, realloc, aligned allocation functions and
+// global operator new and delete are replaced, that blocks are writable,
+// aligned and keep their contents, that blocks can be freed by any thread,
+// and that child process can allocate after fork while other threads of the
+// parent allocate.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -shared -fPIC -fvisibility=hidden -I ../src ../src/pool_allocator.cpp ../src/pool_malloc.cpp -o libsfl_pool_malloc.so -ldl
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread test_malloc_shim.cpp -o test_malloc_shim -ldl
+// LD_PRELOAD=./libsfl_pool_malloc.so ./test_malloc_shim
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -shared -fPIC -fvisibility=hidden -I ../src ../src/pool_allocator.cpp ../src/pool_malloc.cpp -o libsfl_pool_malloc.so -ldl -DNDEBUG
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread test_malloc_shim.cpp -o test_malloc_shim -ldl -DNDEBUG
+// LD_PRELOAD=./libsfl_pool_malloc.so ./test_malloc_shim
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "common.hpp"
+
+void test_preloaded()
+{
+    Dl_info info;
+    CHECK(dladdr(dlsym(RTLD_DEFAULT, "malloc"), &info) != 0);
+    CHECK(std::strstr(info.dli_fname, "sfl_pool_malloc") != nullptr);
+
+    std::cout << "preloaded: OK" << std::endl;
+}
+
+void test_malloc()
+{
+    std::vector<std::pair<unsigned char*, std::size_t>> blocks;
+
+    for (std::size_t size = 0; size <= 100000; size = size * 9 / 8 + 1)
+    {
+        unsigned char* p = static_cast<unsigned char*>(std::malloc(size));
+        CHECK(p != nullptr);
+        CHECK(std::uintptr_t(p) % alignof(std::max_align_t) == 0);
+        CHECK(malloc_usable_size(p) >= size);
+        std::memset(p, int(size % 256), malloc_usable_size(p));
+        blocks.emplace_back(p, size);
+    }
+
+    for (const auto& b : blocks)
+    {
+        for (std::size_t i = 0; i < b.second; ++i)
+        {
+            CHECK(b.first[i] == b.second % 256);
+        }
+        std::free(b.first);
+    }
+
+    std::free(nullptr);
+
+    // Freed memory is not zero, calloc must clear it.
+    for (std::size_t size : {24, 1000, 100000})
+    {
+        void* p = std::malloc(size);
+        std::memset(p, 0xFF, size);
+        std::free(p);
+
+        unsigned char* q = static_cast<unsigned char*>(std::calloc(size / 8, 8));
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            CHECK(q[i] == 0);
+        }
+        std::free(q);
+    }
+
+    // Overflow of n * size.
+    volatile std::size_t n = SIZE_MAX / 2;
+    CHECK(std::calloc(n, 4) == nullptr);
+
+    // Allocated internally by C library.
+    char* s = strdup("hello");
+    CHECK(std::strcmp(s, "hello") == 0);
+    std::free(s);
+
+    std::cout << "malloc: OK" << std::endl;
+}
+
+void test_realloc()
+{
+    // Grows from pooled to system blocks and back.
+    unsigned char* p = nullptr;
+    std::size_t size = 0;
+
+    for (std::size_t new_size : {1, 10, 100, 1000, 10000, 100000, 1000000, 100, 1})
+    {
+        p = static_cast<unsigned char*>(std::realloc(p, new_size));
+        CHECK(p != nullptr);
+        for (std::size_t i = 0; i < size && i < new_size; ++i)
+        {
+            CHECK(p[i] == i % 251);
+        }
+        for (std::size_t i = 0; i < new_size; ++i)
+        {
+            p[i] = static_cast<unsigned char>(i % 251);
+        }
+        size = new_size;
+    }
+
+    std::free(p);
+
+    std::cout << "realloc: OK" << std::endl;
+}
+
+void test_aligned()
+{
+    for (std::size_t alignment = sizeof(void*); alignment <= 8192; alignment *= 2)
+    {
+        for (std::size_t size : {1, 24, 100, 5000, 100000})
+        {
+            void* p = nullptr;
+            CHECK(posix_memalign(&p, alignment, size) == 0);
+            CHECK(std::uintptr_t(p) % alignment == 0);
+            std::memset(p, 0xAB, size);
+            std::free(p);
+
+            p = aligned_alloc(alignment, size);
+            CHECK(std::uintptr_t(p) % alignment == 0);
+            std::memset(p, 0xAB, size);
+            std::free(p);
+
+            p = memalign(alignment, size);
+            CHECK(std::uintptr_t(p) % alignment == 0);
+            std::memset(p, 0xAB, size);
+            std::free(p);
+        }
+    }
+
+    void* p = nullptr;
+    CHECK(posix_memalign(&p, 3, 8) != 0);
+
+    // Alignment of memalign that is not power of two is rounded up.
+    p = memalign(48, 100);
+    CHECK(p != nullptr);
+    CHECK(std::uintptr_t(p) % 64 == 0);
+    std::free(p);
+
+    errno = 0;
+    CHECK(memalign(SIZE_MAX, 8) == nullptr);
+    CHECK(errno == EINVAL);
+
+    const std::size_t page_size = std::size_t(sysconf(_SC_PAGESIZE));
+
+    p = valloc(100);
+    CHECK(std::uintptr_t(p) % page_size == 0);
+    std::free(p);
+
+    // Size of pvalloc is rounded up to whole pages, zero to one page.
+    for (std::size_t size : {std::size_t(0), std::size_t(1), page_size + 1})
+    {
+        p = pvalloc(size);
+        CHECK(p != nullptr);
+        CHECK(std::uintptr_t(p) % page_size == 0);
+        const std::size_t n = size == 0 ? page_size : (size + page_size - 1) / page_size * page_size;
+        CHECK(malloc_usable_size(p) >= n);
+        std::memset(p, 0xAB, n);
+        std::free(p);
+    }
+
+    std::cout << "aligned: OK" << std::endl;
+}
+
+void test_new()
+{
+    int* x = new int(42);
+    CHECK(*x == 42);
+    delete x;
+
+    int* a = new int[1000];
+    a[999] = 1;
+    delete[] a;
+
+    void* p = ::operator new(100, std::nothrow);
+    CHECK(p != nullptr);
+    ::operator delete(p);
+
+    std::map<int, std::string> m;
+    for (int i = 0; i < 100000; ++i)
+    {
+        m[i] = std::to_string(i) + " is a string long enough to be allocated";
+    }
+    for (int i = 0; i < 100000; ++i)
+    {
+        CHECK(m[i].compare(0, std::to_string(i).size(), std::to_string(i)) == 0);
+    }
+
+    std::cout << "new: OK" << std::endl;
+}
+
+void test_threads()
+{
+    // Blocks allocated by one thread are freed by another.
+    std::mutex mutex;
+    std::vector<void*> shared;
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back
+        (
+            [t, &mutex, &shared]()
+            {
+                for (int k = 0; k < 100000; ++k)
+                {
+                    const std::size_t size = (k * 37 + t) % 3000;
+                    void* p = std::malloc(size);
+                    std::memset(p, t, size);
+
+                    void* q = nullptr;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        shared.push_back(p);
+                        if (shared.size() > 100)
+                        {
+                            q = shared.front();
+                            shared.erase(shared.begin());
+                        }
+                    }
+                    std::free(q);
+                }
+            }
+        );
+    }
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    for (void* p : shared)
+    {
+        std::free(p);
+    }
+
+    std::cout << "threads: OK" << std::endl;
+}
+
+/// Waits for child process. Kills it and returns false if it does not exit
+/// in time (e.g. it is deadlocked).
+///
+bool wait_for_child(pid_t pid, int& status)
+{
+    for (int i = 0; i < 1000; ++i)
+    {
+        if (waitpid(pid, &status, WNOHANG) == pid)
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return false;
+}
+
+void test_fork()
+{
+    std::atomic<bool> stop{false};
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back
+        (
+            [t, &stop]()
+            {
+                // Batches larger than thread cache, so that threads often
+                // hold locks of the shared pool.
+                std::vector<void*> blocks(2000, nullptr);
+                for (std::size_t k = 0; !stop.load(std::memory_order_relaxed); ++k)
+                {
+                    for (void*& p : blocks)
+                    {
+                        p = std::malloc((k * 997 + t * 131 + 1) % 32768);
+                    }
+                    for (void* p : blocks)
+                    {
+                        std::free(p);
+                    }
+                }
+            }
+        );
+    }
+
+    for (int i = 0; i < 50; ++i)
+    {
+        const pid_t pid = fork();
+        CHECK(pid >= 0);
+
+        if (pid == 0)
+        {
+            // More blocks of every size class than thread cache holds, so
+            // that the child takes them from the shared pool.
+            std::vector<void*> blocks;
+            for (std::size_t size = 1; size <= 32768; size = size * 9 / 8 + 1)
+            {
+                for (int k = 0; k < 40; ++k)
+                {
+                    void* p = std::malloc(size);
+                    if (p == nullptr)
+                    {
+                        _exit(1);
+                    }
+                    std::memset(p, 0xAB, size);
+                    blocks.push_back(p);
+                }
+            }
+            for (void* p : blocks)
+            {
+                std::free(p);
+            }
+            _exit(0);
+        }
+
+        int status = 0;
+        CHECK(wait_for_child(pid, status));
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    stop = true;
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    std::cout << "fork: OK" << std::endl;
+}
+
+int main()
+{
+    test_preloaded();
+    test_malloc();
+    test_realloc();
+    test_aligned();
+    test_new();
+    test_threads();
+    test_fork();
+
+    std::cout << "THE END" << std::endl;
+}
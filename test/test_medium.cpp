@@ -0,0 +1,214 @@
+//
+// DESCRIPTION:
+// Checks medium blocks (larger than SFL_POOL_ALLOCATOR_MAX_BLOCK_SIZE, up to
+// SFL_POOL_ALLOCATOR_MEDIUM_MAX_BLOCK_SIZE): vectors and strings of a few
+// hundred bytes to 32 KiB are allocated from the pool, their buckets hold
+// many blocks, and thread caches do not hold more than a few of them.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_medium.cpp -o test_medium
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_medium.cpp -o test_medium -DNDEBUG
+//
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+#if SFL_POOL_ALLOCATOR_MEDIUM_MAX_BLOCK_SIZE < 32 * 1024
+#error "Medium blocks must be enabled up to 32 KiB."
+#endif
+
+template <typename T>
+using vector_type = std::vector<T, sfl::pool_allocator<T>>;
+
+using string_type = std::basic_string<char, std::char_traits<char>, sfl::pool_allocator<char>>;
+
+std::size_t num_live_blocks(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_live_blocks;
+    }
+    return n;
+}
+
+void test_containers()
+{
+    const std::uint64_t unpooled = sfl::pool_stats().num_unpooled_allocations;
+
+    {
+        std::vector<vector_type<int>> vectors;
+        std::vector<string_type> strings;
+
+        for (std::size_t size = 129; size <= 32 * 1024; size = size * 5 / 4)
+        {
+            vector_type<int> v(size / sizeof(int));
+            for (std::size_t i = 0; i < v.size(); ++i)
+            {
+                v[i] = int(i);
+            }
+            vectors.push_back(std::move(v));
+
+            strings.push_back(string_type(size - 1, 'x'));
+        }
+
+        CHECK(num_live_blocks(sfl::pool_stats()) >= vectors.size() + strings.size());
+
+        for (const auto& v : vectors)
+        {
+            for (std::size_t i = 0; i < v.size(); ++i)
+            {
+                CHECK(v[i] == int(i));
+            }
+        }
+
+        for (const auto& s : strings)
+        {
+            CHECK(s.find_first_not_of('x') == string_type::npos);
+        }
+    }
+
+    CHECK(sfl::pool_stats().num_unpooled_allocations == unpooled);
+
+    // Larger blocks are still allocated by ::operator new.
+    {
+        vector_type<char> v(SFL_POOL_ALLOCATOR_MEDIUM_MAX_BLOCK_SIZE + 1);
+        CHECK(sfl::pool_stats().num_unpooled_allocations == unpooled + 1);
+    }
+
+    std::cout << "containers: OK" << std::endl;
+}
+
+void test_buckets()
+{
+    sfl::pool_resource r;
+
+    CHECK(r.max_block_size() >= 32 * 1024);
+
+    std::vector<void*> blocks;
+
+    for (std::size_t size = 129; size <= 32 * 1024; size *= 2)
+    {
+        for (int i = 0; i < 100; ++i)
+        {
+            void* p = r.allocate(size, 16);
+            CHECK(std::size_t(p) % 16 == 0);
+            std::memset(p, 0xAB, size);
+            blocks.push_back(p);
+        }
+    }
+
+    const sfl::pool_statistics s = r.stats();
+
+    CHECK(s.num_unpooled_allocations == 0);
+
+    for (const auto& c : s.size_classes)
+    {
+        if (c.num_buckets > 0)
+        {
+            // Buckets of large size classes are larger, not emptier.
+            CHECK(c.num_blocks >= 16 * c.num_buckets);
+            CHECK(c.bytes_mapped >= c.num_blocks * c.block_size);
+        }
+    }
+
+    std::size_t k = 0;
+
+    for (std::size_t size = 129; size <= 32 * 1024; size *= 2)
+    {
+        for (int i = 0; i < 100; ++i)
+        {
+            r.deallocate(blocks[k++], size, 16);
+        }
+    }
+
+    CHECK(num_live_blocks(r.stats()) == 0);
+
+    std::cout << "buckets: OK" << std::endl;
+}
+
+/// Waits until `count` threads arrive.
+///
+void wait_for(std::atomic<int>& arrived, int count)
+{
+    ++arrived;
+    while (arrived.load() < count)
+    {
+        std::this_thread::yield();
+    }
+}
+
+void test_threads()
+{
+    std::vector<std::thread> threads;
+
+    // Statistics are exact only when no thread allocates or deallocates.
+    std::atomic<int> done(0);
+    std::atomic<int> checked(0);
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back
+        (
+            [t, &done, &checked]()
+            {
+                std::mt19937 gen(t);
+                std::uniform_int_distribution<std::size_t> dist(129, 32 * 1024);
+
+                std::vector<vector_type<unsigned char>> live(64);
+
+                for (int k = 0; k < 20000; ++k)
+                {
+                    vector_type<unsigned char>& v = live[gen() % live.size()];
+                    v = vector_type<unsigned char>(dist(gen), static_cast<unsigned char>(k));
+                    CHECK(v.front() == static_cast<unsigned char>(k));
+                    CHECK(v.back() == static_cast<unsigned char>(k));
+                }
+
+                wait_for(done, 4);
+
+                // Cached bytes per size class are bounded. Statistics count
+                // caches of all four threads and of the main thread, which
+                // keeps blocks of test_containers.
+                for (const auto& c : sfl::pool_stats().size_classes)
+                {
+                    if (c.block_size >= 4096)
+                    {
+                        CHECK(c.num_cached_blocks * c.block_size <= 5 * 64 * 1024);
+                    }
+                }
+
+                wait_for(checked, 4);
+            }
+        );
+    }
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    CHECK(num_live_blocks(sfl::pool_stats()) == 0);
+
+    std::cout << "threads: OK" << std::endl;
+}
+
+int main()
+{
+    test_containers();
+    test_buckets();
+    test_threads();
+
+    std::cout << "THE END" << std::endl;
+}
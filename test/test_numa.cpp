@@ -0,0 +1,217 @@
+//
+// DESCRIPTION:
+// Checks NUMA-aware shared pool: threads bound to different nodes allocate
+// from separate pools, blocks freed by threads of other nodes return to
+// the pool that allocated them, and rebinding a thread moves its cached
+// blocks back to the previous node.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_numa.cpp -o test_numa -DSFL_POOL_ALLOCATOR_NUMA_NODES=4
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_numa.cpp -o test_numa -DSFL_POOL_ALLOCATOR_NUMA_NODES=4 -DNDEBUG
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+#if SFL_POOL_ALLOCATOR_NUMA_NODES != 4
+#error "Compile with -DSFL_POOL_ALLOCATOR_NUMA_NODES=4."
+#endif
+
+using list_type = std::list<long, sfl::pool_allocator<long>>;
+
+std::size_t num_buckets(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_buckets;
+    }
+    return n;
+}
+
+std::size_t num_used_blocks(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_used_blocks;
+    }
+    return n;
+}
+
+std::size_t num_live_blocks(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_live_blocks;
+    }
+    return n;
+}
+
+void test_separate_pools()
+{
+    CHECK(sfl::pool_num_nodes() == 4);
+
+    std::vector<list_type> lists(4);
+
+    // Every thread fills one list from the pool of its node.
+    {
+        std::vector<std::thread> threads;
+
+        for (std::size_t t = 0; t < 4; ++t)
+        {
+            threads.emplace_back
+            (
+                [t, &lists]()
+                {
+                    sfl::pool_set_thread_node(t);
+                    CHECK(sfl::pool_thread_node() == t);
+
+                    for (long i = 0; i < 10000 * long(t + 1); ++i)
+                    {
+                        lists[t].push_back(i);
+                    }
+                }
+            );
+        }
+
+        for (auto& th : threads)
+        {
+            th.join();
+        }
+    }
+
+    for (std::size_t k = 0; k < 4; ++k)
+    {
+        // Blocks cached by exited threads were returned to their node.
+        const sfl::pool_statistics s = sfl::pool_node_stats(k);
+        CHECK(num_buckets(s) > 0);
+        CHECK(num_used_blocks(s) == 10000 * (k + 1));
+    }
+
+    CHECK(num_live_blocks(sfl::pool_stats()) == 100000);
+
+    // Every thread frees list filled on another node.
+    {
+        std::vector<std::thread> threads;
+
+        for (std::size_t t = 0; t < 4; ++t)
+        {
+            threads.emplace_back
+            (
+                [t, &lists]()
+                {
+                    sfl::pool_set_thread_node(t);
+                    lists[(t + 1) % 4].clear();
+                }
+            );
+        }
+
+        for (auto& th : threads)
+        {
+            th.join();
+        }
+    }
+
+    for (std::size_t k = 0; k < 4; ++k)
+    {
+        CHECK(num_used_blocks(sfl::pool_node_stats(k)) == 0);
+    }
+
+    CHECK(num_live_blocks(sfl::pool_stats()) == 0);
+
+    std::cout << "separate pools: OK" << std::endl;
+}
+
+void test_rebind()
+{
+    std::thread th
+    (
+        []()
+        {
+            sfl::pool_set_thread_node(1);
+
+            const std::size_t used0 = num_used_blocks(sfl::pool_node_stats(0));
+            const std::size_t used1 = num_used_blocks(sfl::pool_node_stats(1));
+
+            list_type l;
+            for (long i = 0; i < 1000; ++i)
+            {
+                l.push_back(i);
+            }
+
+            // Allocated on node 1, some blocks held in thread cache.
+            CHECK(num_used_blocks(sfl::pool_node_stats(1)) >= used1 + 1000);
+
+            // Blocks freed after rebind go back to node 1 in batches. The
+            // last few wait in thread cache until it is flushed.
+            sfl::pool_set_thread_node(0);
+            l.clear();
+
+            CHECK(num_used_blocks(sfl::pool_node_stats(1)) < used1 + 1000);
+
+            sfl::pool_trim();
+
+            CHECK(num_used_blocks(sfl::pool_node_stats(1)) == used1);
+
+            // New blocks come from node 0.
+            l.resize(1000);
+            CHECK(num_used_blocks(sfl::pool_node_stats(0)) >= used0 + 1000);
+            CHECK(num_used_blocks(sfl::pool_node_stats(1)) == used1);
+        }
+    );
+
+    th.join();
+
+    CHECK(num_live_blocks(sfl::pool_stats()) == 0);
+
+    std::cout << "rebind: OK" << std::endl;
+}
+
+void test_bulk()
+{
+    sfl::pool_allocator<long> alloc;
+
+    std::vector<long*> blocks(4000);
+
+    // Blocks from all nodes deallocated in one call.
+    for (std::size_t k = 0; k < 4; ++k)
+    {
+        sfl::pool_set_thread_node(k);
+        alloc.allocate_bulk(1000, blocks.data() + 1000 * k);
+    }
+
+    for (std::size_t k = 0; k < 4; ++k)
+    {
+        CHECK(num_used_blocks(sfl::pool_node_stats(k)) >= 1000);
+    }
+
+    alloc.deallocate_bulk(blocks.size(), blocks.data());
+
+    sfl::pool_set_thread_node(0);
+
+    for (std::size_t k = 0; k < 4; ++k)
+    {
+        CHECK(num_used_blocks(sfl::pool_node_stats(k)) == 0);
+    }
+
+    std::cout << "bulk: OK" << std::endl;
+}
+
+int main()
+{
+    test_separate_pools();
+    test_rebind();
+    test_bulk();
+
+    std::cout << "THE END" << std::endl;
+}
@@ -0,0 +1,142 @@
+//
+// DESCRIPTION:
+// Checks sfl::pmr::synchronized_pool_resource and
+// sfl::pmr::unsynchronized_pool_resource with std::pmr containers, with
+// over-aligned allocations and as upstream of
+// std::pmr::monotonic_buffer_resource. Requires C++17.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++17 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_pmr.cpp -o test_pmr
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++17 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_pmr.cpp -o test_pmr -DNDEBUG
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+#if !defined(__cpp_lib_memory_resource)
+#error "std::pmr::memory_resource is not available."
+#endif
+
+std::size_t num_live_blocks(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_live_blocks;
+    }
+    return n;
+}
+
+template <typename Resource>
+void test_containers(const char* name)
+{
+    Resource r;
+
+    {
+        std::pmr::list<int> l(&r);
+        std::pmr::map<int, std::pmr::string> m(&r);
+
+        for (int i = 0; i < 10000; ++i)
+        {
+            l.push_back(i);
+            m.emplace(i, "x");
+        }
+
+        CHECK(num_live_blocks(r.stats()) >= 20000);
+
+        int i = 0;
+        for (int x : l)
+        {
+            CHECK(x == i);
+            ++i;
+        }
+    }
+
+    CHECK(num_live_blocks(r.stats()) == 0);
+
+    // Alignment argument is honored, for pooled and unpooled blocks.
+    for (std::size_t alignment = 1; alignment <= 256; alignment *= 2)
+    {
+        for (std::size_t size = alignment; size <= 1024; size += alignment)
+        {
+            void* p = r.allocate(size, alignment);
+            CHECK(std::size_t(p) % alignment == 0);
+            r.deallocate(p, size, alignment);
+        }
+    }
+
+    CHECK(num_live_blocks(r.stats()) == 0);
+
+    // Upstream of monotonic buffer resource.
+    {
+        std::pmr::monotonic_buffer_resource mono(64, &r);
+        std::pmr::vector<int> v(&mono);
+        for (int i = 0; i < 10000; ++i)
+        {
+            v.push_back(i);
+        }
+        CHECK(num_live_blocks(r.stats()) > 0);
+    }
+
+    CHECK(num_live_blocks(r.stats()) == 0);
+
+    Resource other;
+    CHECK(r.is_equal(r));
+    CHECK(!r.is_equal(other));
+
+    std::cout << name << ": OK" << std::endl;
+}
+
+void test_synchronized_threads()
+{
+    sfl::pmr::synchronized_pool_resource r;
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back
+        (
+            [&r, t]()
+            {
+                for (int k = 0; k < 20; ++k)
+                {
+                    std::pmr::list<int> l(&r);
+                    for (int i = 0; i < 10000; ++i)
+                    {
+                        l.push_back(t * 10000 + i);
+                    }
+                }
+            }
+        );
+    }
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    CHECK(num_live_blocks(r.stats()) == 0);
+
+    std::cout << "synchronized threads: OK" << std::endl;
+}
+
+int main()
+{
+    test_containers<sfl::pmr::synchronized_pool_resource>("synchronized_pool_resource");
+    test_containers<sfl::pmr::unsynchronized_pool_resource>("unsynchronized_pool_resource");
+    test_synchronized_threads();
+
+    std::cout << "THE END" << std::endl;
+}
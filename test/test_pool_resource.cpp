@@ -0,0 +1,176 @@
+//
+// DESCRIPTION:
+// Checks sfl::pool_resource and sfl::pool_resource_allocator: pools are
+// independent of each other and of the pool used by sfl::pool_allocator,
+// allocator propagates with container, and release() returns all buckets.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_pool_resource.cpp -o test_pool_resource
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_pool_resource.cpp -o test_pool_resource -DNDEBUG
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+template <typename T>
+using list_type = std::list<T, sfl::pool_resource_allocator<T>>;
+
+std::size_t num_buckets(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_buckets;
+    }
+    return n;
+}
+
+std::size_t num_live_blocks(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_live_blocks;
+    }
+    return n;
+}
+
+void test_independent_pools()
+{
+    const std::size_t global_buckets = num_buckets(sfl::pool_stats());
+
+    sfl::pool_resource r1;
+    sfl::pool_resource r2;
+
+    CHECK(sfl::pool_resource_allocator<int>(r1) == sfl::pool_resource_allocator<double>(r1));
+    CHECK(sfl::pool_resource_allocator<int>(r1) != sfl::pool_resource_allocator<int>(r2));
+
+    {
+        list_type<int> l1(r1);
+        list_type<int> l2(r2);
+
+        for (int i = 0; i < 10000; ++i)
+        {
+            l1.push_back(i);
+        }
+
+        CHECK(num_live_blocks(r1.stats()) == 10000);
+        CHECK(num_live_blocks(r2.stats()) == 0);
+        CHECK(num_buckets(r2.stats()) == 0);
+        CHECK(num_buckets(sfl::pool_stats()) == global_buckets);
+
+        // Propagates on move assignment. Nodes stay in pool r1.
+        l2 = std::move(l1);
+        CHECK(l2.get_allocator() == sfl::pool_resource_allocator<int>(r1));
+        CHECK(l2.size() == 10000);
+
+        // Propagates on copy assignment.
+        list_type<int> l3(r2);
+        l3 = l2;
+        CHECK(l3.get_allocator() == sfl::pool_resource_allocator<int>(r1));
+        CHECK(num_live_blocks(r1.stats()) == 20000);
+
+        // Propagates on swap.
+        list_type<int> l4(r2);
+        l4.push_back(42);
+        l4.swap(l3);
+        CHECK(l3.get_allocator() == sfl::pool_resource_allocator<int>(r2));
+        CHECK(l3.size() == 1 && l3.front() == 42);
+        CHECK(l4.size() == 10000);
+    }
+
+    CHECK(num_live_blocks(r1.stats()) == 0);
+    CHECK(num_live_blocks(r2.stats()) == 0);
+
+    std::cout << "independent pools: OK" << std::endl;
+}
+
+void test_release()
+{
+    sfl::pool_resource r;
+
+    std::map<int, int, std::less<int>, sfl::pool_resource_allocator<std::pair<const int, int>>>* m =
+        new std::map<int, int, std::less<int>, sfl::pool_resource_allocator<std::pair<const int, int>>>(
+            sfl::pool_resource_allocator<std::pair<const int, int>>(r)
+        );
+
+    for (int i = 0; i < 100000; ++i)
+    {
+        (*m)[i] = i;
+    }
+
+    CHECK(num_buckets(r.stats()) > 0);
+
+    // Drop all nodes at once without destroying them one by one.
+    ::operator delete(static_cast<void*>(m));
+    r.release();
+
+    CHECK(num_buckets(r.stats()) == 0);
+    CHECK(num_live_blocks(r.stats()) == 0);
+
+    // Pool is usable after release.
+    list_type<long> l(r);
+    l.resize(1000);
+    CHECK(num_live_blocks(r.stats()) == 1000);
+
+    std::cout << "release: OK" << std::endl;
+}
+
+void test_thread_private_pools()
+{
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back
+        (
+            [t]()
+            {
+                sfl::pool_resource r;
+
+                for (int k = 0; k < 20; ++k)
+                {
+                    list_type<int> l(r);
+                    for (int i = 0; i < 10000; ++i)
+                    {
+                        l.push_back(t * 10000 + i);
+                    }
+
+                    int i = 0;
+                    for (int x : l)
+                    {
+                        CHECK(x == t * 10000 + i);
+                        ++i;
+                    }
+                }
+
+                CHECK(num_live_blocks(r.stats()) == 0);
+            }
+        );
+    }
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    std::cout << "thread private pools: OK" << std::endl;
+}
+
+int main()
+{
+    test_independent_pools();
+    test_release();
+    test_thread_private_pools();
+
+    std::cout << "THE END" << std::endl;
+}
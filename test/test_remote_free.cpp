@@ -0,0 +1,280 @@
+//
+// DESCRIPTION:
+// Checks lock-free remote frees of sfl::pool_allocator with policy
+// sfl::single_threaded: blocks allocated by producer thread and deallocated
+// by consumer threads are returned to the producer's buckets and reused,
+// also in bulk and after the producer has exited. Pool of exited producer
+// is destroyed once its last block is deallocated.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_remote_free.cpp -o test_remote_free
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_remote_free.cpp -o test_remote_free -DNDEBUG
+//
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+struct node
+{
+    long value;
+    node* next;
+};
+
+using node_allocator = sfl::pool_allocator<node, sfl::single_threaded>;
+
+std::size_t num_buckets(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_buckets;
+    }
+    return n;
+}
+
+std::size_t num_live_blocks(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_live_blocks;
+    }
+    return n;
+}
+
+/// Blocking queue of node lists. Nullptr ends the stream.
+///
+class list_queue
+{
+private:
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<node*> lists_;
+
+public:
+
+    void push(node* head)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        lists_.push_back(head);
+        cv_.notify_one();
+    }
+
+    node* pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return !lists_.empty(); });
+        node* head = lists_.front();
+        lists_.pop_front();
+        return head;
+    }
+};
+
+node* make_list(node_allocator& alloc, long first, long n)
+{
+    node* head = nullptr;
+    for (long i = n; i > 0; --i)
+    {
+        node* p = alloc.allocate(1);
+        p->value = first + i - 1;
+        p->next = head;
+        head = p;
+    }
+    return head;
+}
+
+void test_producer_consumer()
+{
+    const int num_consumers = 3;
+    const long list_size = 1000;
+    const long num_lists = 3000;
+
+    list_queue queue;
+
+    std::atomic<long> sum(0);
+
+    std::vector<std::thread> consumers;
+
+    for (int c = 0; c < num_consumers; ++c)
+    {
+        consumers.emplace_back
+        (
+            [&queue, &sum]()
+            {
+                node_allocator alloc;
+                while (node* head = queue.pop())
+                {
+                    while (head != nullptr)
+                    {
+                        node* next = head->next;
+                        sum += head->value;
+                        alloc.deallocate(head, 1);
+                        head = next;
+                    }
+                }
+            }
+        );
+    }
+
+    std::thread producer
+    (
+        [&queue, num_consumers, list_size, num_lists]()
+        {
+            node_allocator alloc;
+
+            for (long k = 0; k < num_lists; ++k)
+            {
+                queue.push(make_list(alloc, k * list_size, list_size));
+            }
+
+            for (int c = 0; c < num_consumers; ++c)
+            {
+                queue.push(nullptr);
+            }
+
+            // Three million nodes went through the pool. Only blocks in
+            // flight are held, the rest have been reused.
+            CHECK(num_buckets(sfl::pool_stats(sfl::single_threaded())) < 1000);
+        }
+    );
+
+    producer.join();
+
+    for (auto& th : consumers)
+    {
+        th.join();
+    }
+
+    const long n = list_size * num_lists;
+    CHECK(sum == n * (n - 1) / 2);
+
+    // Consumers never allocated and producer's pool is gone.
+    CHECK(num_buckets(sfl::pool_stats(sfl::single_threaded())) == 0);
+
+    std::cout << "producer consumer: OK" << std::endl;
+}
+
+void test_abandoned()
+{
+    std::vector<node*> blocks(20000);
+
+    std::thread producer
+    (
+        [&blocks]()
+        {
+            node_allocator alloc;
+            alloc.allocate_bulk(blocks.size(), blocks.data());
+        }
+    );
+
+    producer.join();
+
+    // Pool of exited producer is kept alive by its blocks.
+    sfl::pool_statistics s = sfl::pool_stats(sfl::single_threaded());
+    CHECK(num_live_blocks(s) == blocks.size());
+    CHECK(num_buckets(s) > 0);
+
+    // Consumer has no pool. Half freed one by one, half in bulk.
+    std::thread consumer
+    (
+        [&blocks]()
+        {
+            node_allocator alloc;
+            for (std::size_t i = 0; i < blocks.size() / 2; ++i)
+            {
+                alloc.deallocate(blocks[i], 1);
+            }
+            alloc.deallocate_bulk(blocks.size() / 2, blocks.data() + blocks.size() / 2);
+        }
+    );
+
+    consumer.join();
+
+    s = sfl::pool_stats(sfl::single_threaded());
+    CHECK(num_live_blocks(s) == 0);
+    CHECK(num_buckets(s) == 0);
+
+    std::cout << "abandoned: OK" << std::endl;
+}
+
+void test_reuse()
+{
+    node_allocator alloc;
+
+    for (int k = 0; k < 10; ++k)
+    {
+        std::vector<node*> blocks(20000);
+        alloc.allocate_bulk(blocks.size(), blocks.data());
+
+        CHECK(num_live_blocks(sfl::pool_stats(sfl::single_threaded())) == blocks.size());
+
+        // Half freed one by one, half in bulk, by another thread.
+        std::thread th
+        (
+            [&blocks]()
+            {
+                node_allocator other;
+                for (std::size_t i = 0; i < blocks.size() / 2; ++i)
+                {
+                    other.deallocate(blocks[i], 1);
+                }
+                other.deallocate_bulk(blocks.size() / 2, blocks.data() + blocks.size() / 2);
+            }
+        );
+
+        th.join();
+
+        // Statistics collect remote frees.
+        const sfl::pool_statistics s = sfl::pool_stats(sfl::single_threaded());
+        CHECK(num_live_blocks(s) == 0);
+        CHECK(num_buckets(s) <= 2);
+    }
+
+    // Mixed own and remote blocks in one bulk deallocation.
+    std::vector<node*> mine(100);
+    alloc.allocate_bulk(mine.size(), mine.data());
+
+    std::vector<node*> theirs(100);
+    std::thread th
+    (
+        [&theirs]()
+        {
+            node_allocator other;
+            other.allocate_bulk(theirs.size(), theirs.data());
+        }
+    );
+    th.join();
+
+    std::vector<node*> mixed;
+    for (std::size_t i = 0; i < 100; ++i)
+    {
+        mixed.push_back(mine[i]);
+        mixed.push_back(theirs[i]);
+    }
+    alloc.deallocate_bulk(mixed.size(), mixed.data());
+
+    CHECK(num_live_blocks(sfl::pool_stats(sfl::single_threaded())) == 0);
+
+    std::cout << "reuse: OK" << std::endl;
+}
+
+int main()
+{
+    test_abandoned();
+    test_producer_consumer();
+    test_reuse();
+
+    std::cout << "THE END" << std::endl;
+}
@@ -0,0 +1,95 @@
+//
+// DESCRIPTION:
+// Checks sfl::pool_allocator with policy sfl::single_threaded: every thread
+// allocates from its own pool, and global container can still be destroyed
+// after thread_local objects of the main thread are destroyed.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_single_threaded.cpp -o test_single_threaded
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_single_threaded.cpp -o test_single_threaded -DNDEBUG
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+template <typename T>
+using st_allocator = sfl::pool_allocator<T, sfl::single_threaded>;
+
+std::map<int, int, std::less<int>, st_allocator<std::pair<const int, int>>> global_map;
+
+std::size_t num_live_blocks(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_live_blocks;
+    }
+    return n;
+}
+
+void worker(int t)
+{
+    std::list<int, st_allocator<int>> l;
+
+    for (int k = 0; k < 20; ++k)
+    {
+        for (int i = 0; i < 10000; ++i)
+        {
+            l.push_back(t * 10000 + i);
+        }
+
+        CHECK(num_live_blocks(sfl::pool_stats(sfl::single_threaded())) == 10000);
+
+        int i = 0;
+        for (int x : l)
+        {
+            CHECK(x == t * 10000 + i);
+            ++i;
+        }
+
+        l.clear();
+    }
+
+    CHECK(num_live_blocks(sfl::pool_stats(sfl::single_threaded())) == 0);
+}
+
+int main()
+{
+    for (int i = 0; i < 1000; ++i)
+    {
+        global_map[i] = i;
+    }
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back(worker, t);
+    }
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    // Pools of other threads do not affect pool of this thread.
+    CHECK(num_live_blocks(sfl::pool_stats(sfl::single_threaded())) == 1000);
+
+    // Single-threaded pools do not affect the shared pool.
+    CHECK(num_live_blocks(sfl::pool_stats()) == 0);
+
+    CHECK(st_allocator<int>() == st_allocator<double>());
+
+    std::cout << "THE END" << std::endl;
+
+    // global_map is destroyed after thread_local objects of this thread.
+}
@@ -0,0 +1,112 @@
+//
+// DESCRIPTION:
+// Checks statistics reported by sfl::pool_stats() and prints them in JSON
+// format.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_stats.cpp -o test_stats
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_stats.cpp -o test_stats -DNDEBUG
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+#define NUM_ELEMENTS 100000
+
+const sfl::pool_size_class_stats& find_class(const sfl::pool_statistics& s, std::size_t size)
+{
+    for (const auto& c : s.size_classes)
+    {
+        if (c.block_size >= size)
+        {
+            return c;
+        }
+    }
+    std::abort();
+}
+
+struct node
+{
+    node* prev;
+    node* next;
+    double value;
+};
+
+int main()
+{
+    sfl::pool_allocator<node> alloc;
+
+    const sfl::pool_statistics before = sfl::pool_stats();
+    const std::uint64_t allocs_before = find_class(before, sizeof(node)).num_allocations;
+
+    std::vector<node*> nodes;
+
+    for (std::size_t i = 0; i < NUM_ELEMENTS; ++i)
+    {
+        nodes.push_back(alloc.allocate(1));
+    }
+
+    // Blocks allocated on another thread are counted too.
+    std::thread
+    (
+        [&]()
+        {
+            for (std::size_t i = 0; i < NUM_ELEMENTS; ++i)
+            {
+                nodes.push_back(alloc.allocate(1));
+            }
+        }
+    ).join();
+
+    {
+        const sfl::pool_statistics s = sfl::pool_stats();
+        const sfl::pool_size_class_stats& c = find_class(s, sizeof(node));
+
+        CHECK(c.num_allocations - allocs_before == 2 * NUM_ELEMENTS);
+        CHECK(c.num_live_blocks >= 2 * NUM_ELEMENTS);
+        CHECK(c.num_used_blocks == c.num_live_blocks + c.num_cached_blocks);
+        CHECK(c.num_blocks >= c.num_used_blocks);
+        CHECK(c.num_buckets > 0);
+        CHECK(c.bytes_mapped > 0);
+        CHECK(c.fragmentation >= 0.0 && c.fragmentation < 1.0);
+        CHECK(s.bytes_mapped >= c.bytes_mapped);
+    }
+
+    for (node* p : nodes)
+    {
+        alloc.deallocate(p, 1);
+    }
+
+    {
+        const sfl::pool_statistics s = sfl::pool_stats();
+        const sfl::pool_size_class_stats& c = find_class(s, sizeof(node));
+
+        CHECK(c.num_allocations == c.num_deallocations);
+        CHECK(c.num_live_blocks == 0);
+    }
+
+    // Too large for the pool.
+    std::vector<char, sfl::pool_allocator<char>> v(1024 * 1024);
+
+    {
+        const sfl::pool_statistics s = sfl::pool_stats();
+
+        CHECK(s.num_unpooled_allocations == 1);
+        CHECK(s.unpooled_bytes == 1024 * 1024);
+    }
+
+    std::size_t num_classes = 0;
+    sfl::pool_stats([&](const sfl::pool_size_class_stats&) { ++num_classes; });
+    CHECK(num_classes == sfl::pool_stats().size_classes.size());
+
+    std::cout << sfl::to_json(sfl::pool_stats()) << std::endl;
+
+    std::cout << "THE END" << std::endl;
+}
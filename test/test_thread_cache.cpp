@@ -0,0 +1,112 @@
+//
+// DESCRIPTION:
+// Allocates std::list nodes on producer threads and deallocates them on
+// consumer threads. Checks that blocks freed on a different thread than the
+// one that allocated them are correctly returned to the pool. Timing of this
+// workload is measured by benchmark `producer_consumer` in bench/.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_thread_cache.cpp -o test_thread_cache
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_thread_cache.cpp -o test_thread_cache -DNDEBUG
+//
+
+#include <condition_variable>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+#define NUM_PRODUCERS 4
+#define NUM_ITERATIONS 200
+#define LIST_SIZE 10000
+
+using list_type = std::list<std::size_t, sfl::pool_allocator<std::size_t>>;
+
+class channel
+{
+private:
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::list<list_type> queue_;
+
+public:
+
+    void push(list_type&& l)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::move(l));
+        cv_.notify_one();
+    }
+
+    list_type pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]() { return !queue_.empty(); });
+        list_type l = std::move(queue_.front());
+        queue_.pop_front();
+        return l;
+    }
+};
+
+int main()
+{
+    channel ch;
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < NUM_PRODUCERS; ++t)
+    {
+        threads.emplace_back
+        (
+            [&ch, t]()
+            {
+                for (std::size_t i = 0; i < NUM_ITERATIONS; ++i)
+                {
+                    list_type l;
+                    for (std::size_t j = 0; j < LIST_SIZE; ++j)
+                    {
+                        l.push_back(t * LIST_SIZE + j);
+                    }
+                    ch.push(std::move(l));
+                }
+            }
+        );
+
+        threads.emplace_back
+        (
+            [&ch]()
+            {
+                for (std::size_t i = 0; i < NUM_ITERATIONS; ++i)
+                {
+                    list_type l = ch.pop();
+
+                    CHECK(l.size() == LIST_SIZE);
+
+                    const std::size_t base = l.front() - l.front() % LIST_SIZE;
+                    std::size_t j = 0;
+                    for (auto x : l)
+                    {
+                        CHECK(x == base + j);
+                        ++j;
+                    }
+
+                    // Nodes are deallocated here, on consumer thread.
+                }
+            }
+        );
+    }
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    std::cout << "THE END" << std::endl;
+}
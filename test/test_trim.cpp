@@ -0,0 +1,359 @@
+//
+// DESCRIPTION:
+// Checks trimming: sfl::pool_trim returns empty buckets of the shared pool
+// and retained buckets, also large buckets of medium blocks,
+// pool_resource::trim purges pages of free blocks in partially used buckets
+// without damaging blocks that are still in use, and background scavenger
+// trims the pool when it is idle or when memory usage approaches limit.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_trim.cpp -o test_trim
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_trim.cpp -o test_trim -DNDEBUG
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+std::size_t num_buckets(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_buckets;
+    }
+    return n;
+}
+
+/// Allocates about `bytes` bytes of blocks of each given size.
+///
+std::vector<void*> allocate_blocks(std::size_t bytes, std::initializer_list<std::size_t> sizes)
+{
+    std::vector<void*> blocks;
+    for (std::size_t size : sizes)
+    {
+        sfl::pool_allocator<char> a;
+        for (std::size_t i = 0; i < bytes / size; ++i)
+        {
+            char* p = a.allocate(size);
+            std::memset(p, 0xAB, size);
+            blocks.push_back(p);
+        }
+    }
+    return blocks;
+}
+
+void deallocate_blocks(const std::vector<void*>& blocks)
+{
+    for (void* p : blocks)
+    {
+        CHECK(sfl::pool_deallocate(p));
+    }
+}
+
+void test_pool_trim()
+{
+    const std::vector<void*> blocks = allocate_blocks(8 * 1024 * 1024, {2, 24, 100, 1000, 10000});
+
+    CHECK(num_buckets(sfl::pool_stats()) > 0);
+
+    deallocate_blocks(blocks);
+
+    // Blocks are cached by this thread and every size class keeps one empty
+    // bucket. Trim returns all of them.
+    CHECK(sfl::pool_trim() > 0);
+
+    const sfl::pool_statistics s = sfl::pool_stats();
+    CHECK(num_buckets(s) == 0);
+    CHECK(s.bytes_mapped == 0);
+    CHECK(s.num_retained_buckets == 0);
+
+    // Nothing more to return.
+    CHECK(sfl::pool_trim() == 0);
+
+    std::cout << "pool_trim: OK" << std::endl;
+}
+
+template <std::size_t Size>
+void check_partial_buckets(sfl::pool_resource& r)
+{
+    // Keep one block per 64 KiB. Other pages hold only free blocks.
+    const std::size_t stride = 64 * 1024 / Size;
+
+    std::vector<unsigned char*> blocks;
+    for (std::size_t i = 0; i < 4 * 1024 * 1024 / Size; ++i)
+    {
+        blocks.push_back(static_cast<unsigned char*>(r.allocate(Size)));
+    }
+
+    std::vector<unsigned char*> kept;
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+    {
+        if (i % stride == 0)
+        {
+            std::memset(blocks[i], int(i % 251), Size);
+            kept.push_back(blocks[i]);
+        }
+    }
+
+    // Free blocks in reverse order, so that free list is not sorted.
+    for (std::size_t i = blocks.size(); i-- > 0;)
+    {
+        if (i % stride != 0)
+        {
+            r.deallocate(blocks[i], Size);
+        }
+    }
+
+    const std::size_t buckets = num_buckets(r.stats());
+
+    CHECK(r.trim() > 0);
+
+    // Partially used buckets are kept.
+    CHECK(num_buckets(r.stats()) <= buckets);
+    CHECK(num_buckets(r.stats()) > 0);
+
+    for (std::size_t k = 0; k < kept.size(); ++k)
+    {
+        for (std::size_t j = 0; j < Size; ++j)
+        {
+            CHECK(kept[k][j] == (k * stride) % 251);
+        }
+    }
+
+    // Free blocks are handed out again, without overlapping live blocks.
+    std::set<unsigned char*> unique(kept.begin(), kept.end());
+    std::vector<unsigned char*> again;
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+    {
+        unsigned char* p = static_cast<unsigned char*>(r.allocate(Size));
+        std::memset(p, 0xCD, Size);
+        CHECK(unique.insert(p).second);
+        again.push_back(p);
+    }
+
+    for (std::size_t k = 0; k < kept.size(); ++k)
+    {
+        CHECK(kept[k][0] == (k * stride) % 251);
+        r.deallocate(kept[k], Size);
+    }
+
+    for (unsigned char* p : again)
+    {
+        r.deallocate(p, Size);
+    }
+
+    r.trim();
+
+    CHECK(num_buckets(r.stats()) == 0);
+}
+
+void check_reused_bucket(sfl::pool_resource& r)
+{
+    std::vector<void*> blocks;
+    for (int i = 0; i < 2000; ++i)
+    {
+        void* p = r.allocate(64);
+        std::memset(p, 0xAB, 64);
+        blocks.push_back(p);
+    }
+
+    for (void* p : blocks)
+    {
+        r.deallocate(p, 64);
+    }
+
+    // Bucket is drained and then used lightly. Pages written before are
+    // still purged.
+    void* p = r.allocate(64);
+
+    CHECK(r.trim() >= 2000 * 64 - 2 * 4096 - 64);
+    CHECK(r.trim() == 0);
+
+    r.deallocate(p, 64);
+    r.trim();
+
+    CHECK(num_buckets(r.stats()) == 0);
+}
+
+void test_pool_resource()
+{
+    sfl::pool_resource r;
+
+    check_partial_buckets<1>(r);   // Bitmap bucket.
+    check_partial_buckets<64>(r);  // List bucket.
+    check_partial_buckets<512>(r);
+    check_reused_bucket(r);
+
+    std::cout << "pool_resource: OK" << std::endl;
+}
+
+void test_single_threaded()
+{
+    std::vector<int*> blocks;
+    sfl::pool_allocator<int, sfl::single_threaded> a;
+
+    for (int i = 0; i < 100000; ++i)
+    {
+        blocks.push_back(a.allocate(1));
+    }
+
+    for (int* p : blocks)
+    {
+        a.deallocate(p, 1);
+    }
+
+    CHECK(sfl::pool_trim(sfl::single_threaded()) > 0);
+    CHECK(num_buckets(sfl::pool_stats(sfl::single_threaded())) == 0);
+
+    std::cout << "single_threaded: OK" << std::endl;
+}
+
+void test_large_buckets()
+{
+    // Medium blocks live in buckets larger than SFL_BUCKET_SIZE.
+    const std::size_t size = 16384;
+
+    sfl::pool_allocator<char, sfl::single_threaded> a;
+
+    std::vector<char*> blocks;
+
+    for (int i = 0; i < 100; ++i)
+    {
+        blocks.push_back(a.allocate(size));
+    }
+
+    for (char* p : blocks)
+    {
+        a.deallocate(p, size);
+    }
+
+    // Empty large buckets other than the current one are not kept by the
+    // pool. Arena retains them.
+    const sfl::pool_statistics s1 = sfl::pool_stats(sfl::single_threaded());
+    CHECK(num_buckets(s1) <= 1);
+    CHECK(s1.num_retained_buckets > 0);
+    CHECK(s1.bytes_retained >= 32 * size);
+
+    // Retained buckets are reused.
+    for (char*& p : blocks)
+    {
+        p = a.allocate(size);
+    }
+
+    CHECK(sfl::pool_stats(sfl::single_threaded()).bytes_retained < s1.bytes_retained);
+
+    for (char* p : blocks)
+    {
+        a.deallocate(p, size);
+    }
+
+    CHECK(sfl::pool_trim(sfl::single_threaded()) >= 32 * size);
+
+    const sfl::pool_statistics s2 = sfl::pool_stats(sfl::single_threaded());
+    CHECK(num_buckets(s2) == 0);
+    CHECK(s2.num_retained_buckets == 0);
+    CHECK(s2.bytes_retained == 0);
+
+    std::cout << "large buckets: OK" << std::endl;
+}
+
+/// Waits until shared pool has no buckets. Returns false on timeout.
+///
+bool wait_for_trim()
+{
+    for (int i = 0; i < 500; ++i)
+    {
+        if (num_buckets(sfl::pool_stats()) == 0)
+        {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+void test_scavenger_idle()
+{
+    sfl::pool_scavenger_options options;
+    options.interval = std::chrono::milliseconds(10);
+    options.idle_time = std::chrono::milliseconds(50);
+
+    sfl::pool_start_scavenger(options);
+
+    // Blocks are deallocated by another thread. Its cache is flushed when
+    // it exits, and the empty buckets stay in the pool.
+    std::thread([]() { deallocate_blocks(allocate_blocks(1024 * 1024, {16, 200})); }).join();
+
+    CHECK(wait_for_trim());
+
+    sfl::pool_stop_scavenger();
+    sfl::pool_stop_scavenger();
+
+    std::cout << "scavenger idle: OK" << std::endl;
+}
+
+void write_file(const char* path, const char* text)
+{
+    std::FILE* f = std::fopen(path, "w");
+    CHECK(f != nullptr);
+    std::fputs(text, f);
+    std::fclose(f);
+}
+
+void test_scavenger_pressure()
+{
+    const char* limit_file = "test_trim_memory.high";
+    const char* usage_file = "test_trim_memory.current";
+
+    write_file(limit_file, "max\n");
+    write_file(usage_file, "950\n");
+
+    sfl::pool_scavenger_options options;
+    options.interval = std::chrono::milliseconds(10);
+    options.idle_time = std::chrono::milliseconds(0);
+    options.limit_file = limit_file;
+    options.usage_file = usage_file;
+
+    sfl::pool_start_scavenger(options);
+
+    std::thread([]() { deallocate_blocks(allocate_blocks(1024 * 1024, {16, 200})); }).join();
+
+    // No limit, no trim.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(num_buckets(sfl::pool_stats()) > 0);
+
+    write_file(limit_file, "1000\n");
+
+    CHECK(wait_for_trim());
+
+    sfl::pool_stop_scavenger();
+
+    std::remove(limit_file);
+    std::remove(usage_file);
+
+    std::cout << "scavenger pressure: OK" << std::endl;
+}
+
+int main()
+{
+    test_pool_trim();
+    test_pool_resource();
+    test_single_threaded();
+    test_large_buckets();
+    test_scavenger_idle();
+    test_scavenger_pressure();
+
+    std::cout << "THE END" << std::endl;
+}
@@ -0,0 +1,174 @@
+//
+// DESCRIPTION:
+// Checks deallocation without block size: blocks of every size class are
+// deallocated by pointer alone, usable size is the size of the block's size
+// class, and pointers not allocated from the pool (stack, ::operator new,
+// another pool) are recognized as foreign and left alone.
+//
+// DEBUG:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_unsized_free.cpp -o test_unsized_free
+//
+// RELEASE:
+// g++ -Wall -Wextra -Wpedantic -std=c++11 -O3 -pthread -I ../src ../src/pool_allocator.cpp test_unsized_free.cpp -o test_unsized_free -DNDEBUG
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "pool_allocator.hpp"
+
+std::size_t num_live_blocks(const sfl::pool_statistics& s)
+{
+    std::size_t n = 0;
+    for (const auto& c : s.size_classes)
+    {
+        n += c.num_live_blocks;
+    }
+    return n;
+}
+
+void test_pool_resource()
+{
+    sfl::pool_resource r1;
+    sfl::pool_resource r2;
+
+    std::vector<std::pair<void*, std::size_t>> blocks;
+
+    for (std::size_t size = 1; size <= r1.max_block_size(); size = size * 9 / 8 + 1)
+    {
+        for (std::size_t alignment : {1, 16, 64})
+        {
+            void* p = r1.allocate(size, alignment);
+            CHECK(r1.allocated_size(p) >= size);
+            CHECK(r2.allocated_size(p) == 0);
+            std::memset(p, 0xAB, r1.allocated_size(p));
+            blocks.emplace_back(p, size);
+        }
+    }
+
+    for (const auto& b : blocks)
+    {
+        // Pool does not own blocks of another pool.
+        CHECK(!r2.deallocate(b.first));
+        CHECK(r1.deallocate(b.first));
+    }
+
+    CHECK(num_live_blocks(r1.stats()) == 0);
+
+    // Blocks are reused after unsized deallocation.
+    void* p = r1.allocate(100);
+    CHECK(r1.deallocate(p));
+    CHECK(r1.allocate(100) == p);
+    r1.deallocate(p, 100);
+
+    // Foreign pointers.
+    int x = 0;
+    CHECK(!r1.deallocate(&x));
+    CHECK(r1.allocated_size(&x) == 0);
+
+    std::unique_ptr<char[]> heap(new char[100]);
+    CHECK(!r1.deallocate(heap.get()));
+
+    void* large = r1.allocate(r1.max_block_size() + 1);
+    CHECK(r1.allocated_size(large) == 0);
+    CHECK(!r1.deallocate(large));
+    r1.deallocate(large, r1.max_block_size() + 1);
+
+    std::cout << "pool_resource: OK" << std::endl;
+}
+
+void test_pool_allocator()
+{
+    sfl::pool_allocator<char> a;
+    sfl::pool_allocator<char, sfl::single_threaded> st;
+
+    for (std::size_t size : {1, 8, 24, 100, 1000, 10000})
+    {
+        char* p = a.allocate(size);
+        CHECK(sfl::pool_allocated_size(p) >= size);
+        CHECK(sfl::pool_deallocate(p));
+
+        // Blocks of thread's own pool are not blocks of the shared pool.
+        char* q = st.allocate(size);
+        CHECK(sfl::pool_allocated_size(q) == 0);
+        CHECK(!sfl::pool_deallocate(q));
+        st.deallocate(q, size);
+    }
+
+    int x = 0;
+    CHECK(!sfl::pool_deallocate(&x));
+    CHECK(!sfl::pool_deallocate(nullptr));
+
+    std::cout << "pool_allocator: OK" << std::endl;
+}
+
+void test_threads()
+{
+    // Blocks allocated by one thread are deallocated by another without size.
+    std::mutex mutex;
+    std::vector<char*> shared;
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back
+        (
+            [t, &mutex, &shared]()
+            {
+                sfl::pool_allocator<char> a;
+
+                for (int k = 0; k < 100000; ++k)
+                {
+                    const std::size_t size = (k * 37 + t) % 3000 + 1;
+                    char* p = a.allocate(size);
+                    std::memset(p, t, size);
+
+                    char* q = nullptr;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        shared.push_back(p);
+                        if (shared.size() > 100)
+                        {
+                            q = shared.front();
+                            shared.erase(shared.begin());
+                        }
+                    }
+                    if (q != nullptr)
+                    {
+                        CHECK(sfl::pool_deallocate(q));
+                    }
+                }
+            }
+        );
+    }
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    for (char* p : shared)
+    {
+        CHECK(sfl::pool_deallocate(p));
+    }
+
+    CHECK(num_live_blocks(sfl::pool_stats()) == 0);
+
+    std::cout << "threads: OK" << std::endl;
+}
+
+int main()
+{
+    test_pool_resource();
+    test_pool_allocator();
+    test_threads();
+
+    std::cout << "THE END" << std::endl;
+}